@@ -13,18 +13,50 @@
 #include "toon.h"
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <clocale>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <iterator>
 #include <limits>
+#include <condition_variable>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#if defined(TOON_NO_SIMD)
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TOON_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TOON_NEON 1
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#define toon_write _write
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define toon_write ::write
+#endif
 
 namespace helper_toon {
-static uint32_t parse_unicode_codepoint(const std::string &str, size_t &i,
-                                        std::string &err) {
+static uint32_t parse_unicode_codepoint(const char *str, size_t len,
+                                        size_t &i, std::string &err) {
   uint32_t val = 0;
-  if (i + 4 >= str.size()) {
+  if (i + 4 > len) {
     err = "unfinished unicode escape";
     return 0;
   }
@@ -79,715 +111,6543 @@ static void encode_utf8(uint32_t cp, std::string &out) {
   }
 }
 
-} // end namespace helper_toon
+/* Character-class scanning
+ *
+ * The parser and the serializer spend most of their time looking for the
+ * next structural character, quote or escape. scan() checks 16 bytes at a
+ * time with SSE2 (x86-64) or NEON (AArch64) and falls back to a lookup
+ * table for the tail and on other targets; define TOON_NO_SIMD to force the
+ * scalar path.
+ */
+enum CharClass : uint8_t {
+  SPECIAL = 1,      // , : \n [ ] { } #  (ends an unquoted string)
+  QUOTE_ESCAPE = 2, // " and \  (ends a run inside a quoted string)
+  NEEDS_ESCAPE = 4, // " \ and control characters (escaped by dump)
+};
 
-namespace toon {
+struct CharTable {
+  uint8_t cls[256];
+  CharTable() {
+    memset(cls, 0, sizeof cls);
+    for (const char *p = ",:\n[]{}#"; *p; ++p)
+      cls[static_cast<uint8_t>(*p)] |= SPECIAL;
+    cls[static_cast<uint8_t>('"')] |= QUOTE_ESCAPE | NEEDS_ESCAPE;
+    cls[static_cast<uint8_t>('\\')] |= QUOTE_ESCAPE | NEEDS_ESCAPE;
+    cls[static_cast<uint8_t>('\n')] |= QUOTE_ESCAPE;
+    for (int c = 0; c < 0x20; ++c)
+      cls[c] |= NEEDS_ESCAPE;
+  }
+};
 
-using std::make_shared;
-using std::map;
-using std::move;
-using std::string;
-using std::vector;
+static const uint8_t *char_classes() {
+  static const CharTable table;
+  return table.cls;
+}
+
+#if TOON_SSE2
+static inline int first_bit(uint32_t mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return static_cast<int>(index);
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+static inline __m128i eq(__m128i x, char c) {
+  return _mm_cmpeq_epi8(x, _mm_set1_epi8(c));
+}
+
+static inline __m128i match(__m128i x, CharClass cls) {
+  if (cls == SPECIAL)
+    return _mm_or_si128(
+        _mm_or_si128(_mm_or_si128(eq(x, ','), eq(x, ':')),
+                     _mm_or_si128(eq(x, '\n'), eq(x, '#'))),
+        _mm_or_si128(_mm_or_si128(eq(x, '['), eq(x, ']')),
+                     _mm_or_si128(eq(x, '{'), eq(x, '}'))));
+  __m128i m = _mm_or_si128(eq(x, '"'), eq(x, '\\'));
+  if (cls == QUOTE_ESCAPE)
+    return _mm_or_si128(m, eq(x, '\n'));
+  // NEEDS_ESCAPE: bytes <= 0x1f
+  return _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(x, _mm_set1_epi8(0x1f)),
+                                        _mm_set1_epi8(0x1f)));
+}
+#elif TOON_NEON
+static inline uint8x16_t eq(uint8x16_t x, char c) {
+  return vceqq_u8(x, vdupq_n_u8(static_cast<uint8_t>(c)));
+}
+
+static inline uint8x16_t match(uint8x16_t x, CharClass cls) {
+  if (cls == SPECIAL)
+    return vorrq_u8(vorrq_u8(vorrq_u8(eq(x, ','), eq(x, ':')),
+                             vorrq_u8(eq(x, '\n'), eq(x, '#'))),
+                    vorrq_u8(vorrq_u8(eq(x, '['), eq(x, ']')),
+                             vorrq_u8(eq(x, '{'), eq(x, '}'))));
+  uint8x16_t m = vorrq_u8(eq(x, '"'), eq(x, '\\'));
+  if (cls == QUOTE_ESCAPE)
+    return vorrq_u8(m, eq(x, '\n'));
+  return vorrq_u8(m, vcleq_u8(x, vdupq_n_u8(0x1f)));
+}
+#endif
+
+// Index of the first byte of class `cls` in s[i, len), or len.
+static size_t scan(const char *s, size_t i, size_t len, CharClass cls) {
+#if TOON_SSE2
+  for (; i + 16 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+    int bits = _mm_movemask_epi8(match(x, cls));
+    if (bits)
+      return i + first_bit(static_cast<uint32_t>(bits));
+  }
+#elif TOON_NEON
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t x = vld1q_u8(reinterpret_cast<const uint8_t *>(s + i));
+    if (vmaxvq_u8(match(x, cls)))
+      break; // the match is in this block; locate it below
+  }
+#endif
+  const uint8_t *table = char_classes();
+  for (; i < len; ++i) {
+    if (table[static_cast<uint8_t>(s[i])] & cls)
+      return i;
+  }
+  return len;
+}
+
+
+/* Numbers
+ *
+ * Both directions are locale independent: the decimal separator is always
+ * '.', whatever setlocale() says.
+ */
+static const double pow10_exact[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                     1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                     1e18, 1e19, 1e20, 1e21, 1e22};
 
-static void dump(std::nullptr_t, string &out, int) { out += "null"; }
+// strtod() on a NUL-terminated copy of [s, s + len), with '.' swapped for
+// the decimal point of the current locale.
+static double strtod_c(const char *s, size_t len) {
+  char buf[64];
+  std::string big;
+  char *p = buf;
+  if (len >= sizeof buf) {
+    big.assign(s, len);
+    p = &big[0];
+  } else {
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+  }
+  const char point = *localeconv()->decimal_point;
+  if (point != '.') {
+    if (char *dot = static_cast<char *>(memchr(p, '.', len)))
+      *dot = point;
+  }
+  return strtod(p, nullptr);
+}
 
-static void dump(double value, string &out, int) {
-  if (std::isfinite(value)) {
-    char buf[32];
-    snprintf(buf, sizeof buf, "%.17g", value);
-    out += buf;
+// Parses the longest prefix of [s, s + len) of the form
+// -?digits(.digits)?([eE][+-]?digits)? into `out` and returns its length,
+// or 0 when there is none. Short decimals, which is what table cells
+// usually hold, are converted exactly with one multiplication or division
+// by a power of ten; everything else goes through strtod_c().
+static size_t parse_double(const char *s, size_t len, double &out) {
+  size_t i = 0;
+  bool negative = i < len && s[i] == '-';
+  if (negative)
+    i++;
+  uint64_t mantissa = 0;
+  int digits = 0;  // significant digits accumulated in mantissa
+  int dropped = 0; // integer digits that did not fit
+  int scale = 0;   // decimal exponent contributed by the fraction
+  size_t digits_start = i;
+  for (; i < len && s[i] >= '0' && s[i] <= '9'; ++i) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (s[i] - '0');
+      digits += mantissa != 0;
+    } else {
+      dropped++;
+    }
+  }
+  bool any = i > digits_start;
+  bool inexact = dropped > 0;
+  if (i < len && s[i] == '.' && i + 1 < len && s[i + 1] >= '0' &&
+      s[i + 1] <= '9') {
+    for (++i; i < len && s[i] >= '0' && s[i] <= '9'; ++i) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (s[i] - '0');
+        digits += mantissa != 0;
+        scale--;
+      } else if (s[i] != '0') {
+        inexact = true;
+      }
+    }
+    any = true;
+  }
+  if (!any)
+    return 0;
+  int exponent = 0;
+  if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+    size_t j = i + 1;
+    bool exp_negative = false;
+    if (j < len && (s[j] == '+' || s[j] == '-'))
+      exp_negative = s[j++] == '-';
+    if (j < len && s[j] >= '0' && s[j] <= '9') {
+      for (; j < len && s[j] >= '0' && s[j] <= '9'; ++j)
+        if (exponent < 100000)
+          exponent = exponent * 10 + (s[j] - '0');
+      if (exp_negative)
+        exponent = -exponent;
+      i = j;
+    }
+  }
+  int e10 = exponent + scale + dropped;
+  if (!inexact && mantissa <= (uint64_t(1) << 53) && e10 >= -22 &&
+      e10 <= 22) {
+    // Both operands are exact, so IEEE rounding of the single operation
+    // yields the correctly rounded result.
+    double value = static_cast<double>(mantissa);
+    value = e10 < 0 ? value / pow10_exact[-e10] : value * pow10_exact[e10];
+    out = negative ? -value : value;
   } else {
-    out += "null";
+    out = strtod_c(s, i);
   }
+  return i;
 }
 
-static void dump(int value, string &out, int) {
-  char buf[32];
-  snprintf(buf, sizeof buf, "%d", value);
-  out += buf;
+// Writes the decimal digits of `value` backwards, ending at `end`, and
+// returns a pointer to the first one.
+static char *format_uint(uint64_t value, char *end) {
+  static const char pairs[] = "00010203040506070809"
+                              "10111213141516171819"
+                              "20212223242526272829"
+                              "30313233343536373839"
+                              "40414243444546474849"
+                              "50515253545556575859"
+                              "60616263646566676869"
+                              "70717273747576777879"
+                              "80818283848586878889"
+                              "90919293949596979899";
+  while (value >= 100) {
+    const char *pair = pairs + (value % 100) * 2;
+    value /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (value >= 10) {
+    const char *pair = pairs + value * 2;
+    *--end = pair[1];
+    *--end = pair[0];
+  } else {
+    *--end = static_cast<char>('0' + value);
+  }
+  return end;
 }
 
-static void dump(bool value, string &out, int) {
-  out += value ? "true" : "false";
+// Appends the decimal representation of `value` to `out`.
+template <class Out> static void format_int(int64_t value, Out &out) {
+  char buf[24];
+  char *end = buf + sizeof buf;
+  uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value)
+                                 : static_cast<uint64_t>(value);
+  char *p = format_uint(magnitude, end);
+  if (value < 0)
+    *--p = '-';
+  out.append(p, end - p);
 }
 
-static bool needs_quoting(const string &value) {
-  if (value.empty())
-    return true;
-  if (value == "null" || value == "true" || value == "false")
-    return true;
-  if (isdigit(value[0]) || value[0] == '-') {
-    // Check if it's a valid number
-    char *end;
-    strtod(value.c_str(), &end);
-    if (*end == '\0')
-      return true;
+template <class Out> static void format_unsigned(uint64_t value, Out &out) {
+  char buf[24];
+  char *end = buf + sizeof buf;
+  char *p = format_uint(value, end);
+  out.append(p, end - p);
+}
+
+// Parses [s, s + len) as a whole -?digits literal. Fails when anything else
+// is present or the magnitude does not fit in 64 bits.
+static bool parse_integer(const char *s, size_t len, bool &negative,
+                          uint64_t &magnitude) {
+  size_t i = 0;
+  negative = len > 0 && s[0] == '-';
+  if (negative)
+    i++;
+  if (i == len)
+    return false;
+  magnitude = 0;
+  for (; i < len; ++i) {
+    unsigned digit = static_cast<unsigned char>(s[i]) - '0';
+    if (digit > 9)
+      return false;
+    if (magnitude > (UINT64_MAX - digit) / 10)
+      return false;
+    magnitude = magnitude * 10 + digit;
   }
-  const string special = ",:\n[]{}#";
-  for (char c : value) {
-    if (special.find(c) != string::npos)
-      return true;
+  return true;
+}
+
+/* Shortest double digits
+ *
+ * shortest_digits() is Ryu (Ulf Adams, PLDI 2018): it finds the decimal
+ * with the fewest digits that lies in the interval of reals rounding to a
+ * double, choosing the closest one when several do, with a few 128-bit
+ * multiplications and no division by anything but constants. The 125-bit
+ * scaled powers of five it needs are built from every 26th one, a small
+ * power and a 2-bit correction, as in Ryu's small table.
+ */
+
+// 5^(26 k) in its top 125 bits, low word first.
+static const uint64_t kPow5Split[13][2] = {
+    {0u, 1152921504606846976u}, {0u, 1490116119384765625u},
+    {1032610780636961552u, 1925929944387235853u},
+    {7910200175544436838u, 1244603055572228341u},
+    {16941905809032713930u, 1608611746708759036u},
+    {13024893955298202172u, 2079081953128979843u},
+    {6607496772837067824u, 1343575221513417750u},
+    {17332926989895652603u, 1736530273035216783u},
+    {13037379183483547984u, 2244412773384604712u},
+    {1605989338741628675u, 1450417759929778918u},
+    {9630225068416591280u, 1874621017369538693u},
+    {665883850346957067u, 1211445438634777304u},
+    {14931890668723713708u, 1565756531257009982u}};
+
+// 2^(pow5_bits(26 k) + 124) / 5^(26 k) rounded up, low word first.
+static const uint64_t kPow5InvSplit[15][2] = {
+    {1u, 2305843009213693952u}, {5955668970331000884u, 1784059615882449851u},
+    {8982663654677661702u, 1380349269358112757u},
+    {7286864317269821294u, 2135987035920910082u},
+    {7005857020398200553u, 1652639921975621497u},
+    {17965325103354776697u, 1278668206209430417u},
+    {8928596168509315048u, 1978643211784836272u},
+    {10075671573058298858u, 1530901034580419511u},
+    {597001226353042382u, 1184477304306571148u},
+    {1527430471115325346u, 1832889850782397517u},
+    {12533209867169019542u, 1418129833677084982u},
+    {5577825024675947042u, 2194449627517475473u},
+    {11006974540203867551u, 1697873161311732311u},
+    {10313493231639821582u, 1313665730009899186u},
+    {12701016819766672773u, 2032799256770390445u}};
+
+// What pow5_split(i) and pow5_inv_split(i) add to the scaled product to
+// make it exact, two bits per i.
+static const uint32_t kPow5SplitFix[21] = {
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x40000000, 0x59695995,
+    0x55545555, 0x56555515, 0x41150504, 0x40555410, 0x44555145, 0x44504540,
+    0x45555550, 0x40004000, 0x96440440, 0x55565565, 0x54454045, 0x40154151,
+    0x55559155, 0x51405555, 0x00000105};
+
+static const uint32_t kPow5InvSplitFix[22] = {
+    0x54544554, 0x04055545, 0x10041000, 0x00400414, 0x40010000, 0x41155555,
+    0x00000454, 0x00010044, 0x40000000, 0x44000041, 0x50454450, 0x55550054,
+    0x51655554, 0x40004000, 0x01000001, 0x00010500, 0x51515411, 0x05555554,
+    0x50411500, 0x40040000, 0x05040110, 0x00000000};
+
+static const uint64_t kPow5[26] = {
+    1u, 5u, 25u, 125u, 625u, 3125u, 15625u, 78125u, 390625u, 1953125u, 9765625u,
+    48828125u, 244140625u, 1220703125u, 6103515625u, 30517578125u,
+    152587890625u, 762939453125u, 3814697265625u, 19073486328125u,
+    95367431640625u, 476837158203125u, 2384185791015625u, 11920928955078125u,
+    59604644775390625u, 298023223876953125u};
+
+// The high half of the 128-bit product a * b, and its low half in `lo`.
+static uint64_t mul_128(uint64_t a, uint64_t b, uint64_t &lo) {
+#ifdef __SIZEOF_INT128__
+  __extension__ typedef unsigned __int128 uint128;
+  const uint128 p = static_cast<uint128>(a) * b;
+  lo = static_cast<uint64_t>(p);
+  return static_cast<uint64_t>(p >> 64);
+#else
+  const uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+  const uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+  const uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi;
+  const uint64_t hl = a_hi * b_lo, hh = a_hi * b_hi;
+  const uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+  lo = (mid << 32) | (ll & 0xffffffff);
+  return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+// ceil(log2(5^e)), or 1 for e = 0.
+static int pow5_bits(int e) { return ((e * 1217359) >> 19) + 1; }
+
+// (mul * m >> shift) + add, modulo 2^128, for 0 < shift < 64.
+static void scale_128(const uint64_t mul[2], uint64_t m, int shift,
+                      uint64_t add, uint64_t out[2]) {
+  uint64_t b0_lo, b2_lo;
+  const uint64_t b0_hi = mul_128(m, mul[0], b0_lo);
+  const uint64_t b2_hi = mul_128(m, mul[1], b2_lo);
+  uint64_t lo = (b0_lo >> shift) | (b0_hi << (64 - shift));
+  uint64_t hi = b0_hi >> shift;
+  const uint64_t s_lo = b2_lo << (64 - shift);
+  hi += ((b2_hi << (64 - shift)) | (b2_lo >> shift));
+  lo += s_lo;
+  hi += lo < s_lo;
+  lo += add;
+  hi += lo < add;
+  out[0] = lo;
+  out[1] = hi;
+}
+
+// 5^i in its top 125 bits, for i < 326.
+static void pow5_split(int i, uint64_t out[2]) {
+  const int base = i / 26, offset = i - base * 26;
+  if (offset == 0) {
+    out[0] = kPow5Split[base][0];
+    out[1] = kPow5Split[base][1];
+    return;
   }
-  return false;
+  scale_128(kPow5Split[base], kPow5[offset],
+            pow5_bits(i) - pow5_bits(base * 26),
+            (kPow5SplitFix[i / 16] >> ((i % 16) * 2)) & 3, out);
 }
 
-static void dump(const string &value, string &out, int) {
-  if (!needs_quoting(value)) {
-    out += value;
+// 2^(pow5_bits(i) + 124) / 5^i rounded up, for i < 342.
+static void pow5_inv_split(int i, uint64_t out[2]) {
+  const int base = (i + 25) / 26, offset = base * 26 - i;
+  if (offset == 0) {
+    out[0] = kPow5InvSplit[base][0];
+    out[1] = kPow5InvSplit[base][1];
     return;
   }
-  out += '"';
-  for (size_t i = 0; i < value.length(); i++) {
-    const char ch = value[i];
-    if (ch == '\\')
-      out += "\\\\";
-    else if (ch == '"')
-      out += "\\\"";
-    else if (ch == '\b')
-      out += "\\b";
-    else if (ch == '\f')
-      out += "\\f";
-    else if (ch == '\n')
-      out += "\\n";
-    else if (ch == '\r')
-      out += "\\r";
-    else if (ch == '\t')
-      out += "\\t";
-    else if (static_cast<uint8_t>(ch) <= 0x1f) {
-      char buf[8];
-      snprintf(buf, sizeof buf, "\\u%04x", ch);
-      out += buf;
-    } else
-      out += ch;
+  const uint64_t floor[2] = {kPow5InvSplit[base][0] - 1,
+                             kPow5InvSplit[base][1]};
+  scale_128(floor, kPow5[offset], pow5_bits(base * 26) - pow5_bits(i),
+            ((kPow5InvSplitFix[i / 16] >> ((i % 16) * 2)) & 3) + 1, out);
+}
+
+// (m * mul) >> j, for 64 < j < 128.
+static uint64_t mul_shift(uint64_t m, const uint64_t mul[2], int j) {
+  uint64_t lo0, lo2;
+  const uint64_t hi0 = mul_128(m, mul[0], lo0);
+  const uint64_t hi2 = mul_128(m, mul[1], lo2);
+  const uint64_t sum_lo = lo2 + hi0;
+  const uint64_t sum_hi = hi2 + (sum_lo < hi0);
+  const int shift = j - 64;
+  return (sum_lo >> shift) | (sum_hi << (64 - shift));
+}
+
+static int pow5_factor(uint64_t value) {
+  int count = 0;
+  for (; value % 5 == 0; value /= 5)
+    ++count;
+  return count;
+}
+
+static bool multiple_of_pow5(uint64_t value, int p) {
+  return pow5_factor(value) >= p;
+}
+
+static bool multiple_of_pow2(uint64_t value, int p) {
+  return (value & ((uint64_t(1) << p) - 1)) == 0;
+}
+
+// Drops `digits` digits (step = 10^digits) from vr, vp and vm for as long
+// as vp and vm still differ in what is left, and notes whether the digits
+// dropped last round vr up.
+template <uint64_t step, int digits>
+static void drop_digits(uint64_t &vr, uint64_t &vp, uint64_t &vm,
+                        int &removed, bool &round_up) {
+  while (vp / step > vm / step) {
+    round_up = vr % step >= step / 2;
+    vr /= step;
+    vp /= step;
+    vm /= step;
+    removed += digits;
   }
-  out += '"';
 }
 
-static void indent(string &out, int level) {
-  for (int i = 0; i < level; ++i)
-    out += "  ";
+// The number of decimal digits of `value`, which is below 10^17.
+static int digit_count(uint64_t value) {
+  int n = 1;
+  for (uint64_t bound = 10; n < 17 && value >= bound; bound *= 10)
+    ++n;
+  return n;
 }
 
-static void dump(const Toon::array &values, string &out, int level) {
-  if (values.empty()) {
-    out += "[0]:";
-    return;
+// The shortest digits of the finite, nonzero double with IEEE fields
+// `fraction` and `biased` (exponent): their value is digits * 10^exponent.
+static uint64_t shortest_digits(uint64_t fraction, int biased, int &exponent) {
+  int e2;
+  uint64_t m2;
+  if (biased == 0) {
+    e2 = 1 - 1023 - 52 - 2;
+    m2 = fraction;
+  } else {
+    e2 = biased - 1023 - 52 - 2;
+    m2 = (uint64_t(1) << 52) | fraction;
   }
+  // Integers below 2^53 have their digits in m2 already.
+  if (e2 + 2 <= 0 && e2 + 2 >= -52 &&
+      multiple_of_pow2(m2, -(e2 + 2))) {
+    uint64_t digits = m2 >> -(e2 + 2);
+    exponent = 0;
+    for (; digits % 10 == 0; digits /= 10)
+      ++exponent;
+    return digits;
+  }
+  const bool accept_bounds = (m2 & 1) == 0;
+  // The interval's bounds are (4 * m2 - 1 - mm_shift) and (4 * m2 + 2),
+  // scaled by 2^e2; it is asymmetric at powers of two.
+  const uint64_t mv = 4 * m2;
+  const int mm_shift = fraction != 0 || biased <= 1;
 
-  // Check for tabular format possibility
-  bool all_objects = true;
-  vector<string> keys;
-  if (values[0].is_object()) {
-    for (auto const &kv : values[0].object_items())
-      keys.push_back(kv.first);
-    for (size_t i = 1; i < values.size(); ++i) {
-      if (!values[i].is_object() ||
-          values[i].object_items().size() != keys.size()) {
-        all_objects = false;
-        break;
-      }
-      for (auto const &k : keys) {
-        if (values[i].object_items().find(k) ==
-            values[i].object_items().end()) {
-          all_objects = false;
-          break;
-        }
-      }
-      if (!all_objects)
-        break;
+  uint64_t vr, vp, vm;
+  int e10;
+  bool vm_trailing_zeros = false, vr_trailing_zeros = false;
+  uint64_t mul[2];
+  if (e2 >= 0) {
+    const int q = ((e2 * 78913) >> 18) - (e2 > 3); // log10(2^e2), less
+    e10 = q;
+    const int k = 125 + pow5_bits(q) - 1;
+    const int i = -e2 + q + k;
+    pow5_inv_split(q, mul);
+    vr = mul_shift(4 * m2, mul, i);
+    vp = mul_shift(4 * m2 + 2, mul, i);
+    vm = mul_shift(4 * m2 - 1 - mm_shift, mul, i);
+    if (q <= 21) {
+      // Only one of mp, mv and mm can be a multiple of 5, if any.
+      if (mv % 5 == 0)
+        vr_trailing_zeros = multiple_of_pow5(mv, q);
+      else if (accept_bounds)
+        vm_trailing_zeros = multiple_of_pow5(mv - 1 - mm_shift, q);
+      else
+        vp -= multiple_of_pow5(mv + 2, q);
     }
   } else {
-    all_objects = false;
+    const int q = ((-e2 * 732923) >> 20) - (-e2 > 1); // log10(5^-e2), less
+    e10 = q + e2;
+    const int i = -e2 - q;
+    const int k = pow5_bits(i) - 125;
+    const int j = q - k;
+    pow5_split(i, mul);
+    vr = mul_shift(4 * m2, mul, j);
+    vp = mul_shift(4 * m2 + 2, mul, j);
+    vm = mul_shift(4 * m2 - 1 - mm_shift, mul, j);
+    if (q <= 1) {
+      // mv has at least q trailing zero bits, as it is a multiple of 4.
+      vr_trailing_zeros = true;
+      if (accept_bounds)
+        vm_trailing_zeros = mm_shift == 1;
+      else
+        --vp;
+    } else if (q < 63) {
+      vr_trailing_zeros = multiple_of_pow2(mv, q);
+    }
   }
 
-  if (all_objects && !keys.empty()) {
-    out += "[{";
-    for (size_t i = 0; i < keys.size(); ++i) {
-      out += keys[i];
-      if (i < keys.size() - 1)
-        out += ", ";
+  // Drop digits while the bounds still differ in what is left, rounding
+  // the last one dropped.
+  int removed = 0;
+  unsigned last_removed = 0;
+  uint64_t output;
+  if (vm_trailing_zeros || vr_trailing_zeros) {
+    // Rare: the bounds or the value itself may be exact decimals.
+    for (; vp / 10 > vm / 10; ++removed) {
+      vm_trailing_zeros &= vm % 10 == 0;
+      vr_trailing_zeros &= last_removed == 0;
+      last_removed = static_cast<unsigned>(vr % 10);
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
     }
-    out += "}]:\n";
-    for (size_t i = 0; i < values.size(); ++i) {
-      indent(out, level + 1);
-      auto const &obj = values[i].object_items();
-      for (size_t j = 0; j < keys.size(); ++j) {
-        obj.at(keys[j]).dump(out, level + 1);
-        if (j < keys.size() - 1)
-          out += ", ";
+    if (vm_trailing_zeros) {
+      for (; vm % 10 == 0; ++removed) {
+        vr_trailing_zeros &= last_removed == 0;
+        last_removed = static_cast<unsigned>(vr % 10);
+        vr /= 10;
+        vp /= 10;
+        vm /= 10;
       }
-      if (i < values.size() - 1)
-        out += "\n";
     }
+    if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0)
+      last_removed = 4; // exactly halfway: round to even
+    output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) ||
+                   last_removed >= 5);
   } else {
-    out += "[";
-    out += std::to_string(values.size());
-    out += "]: ";
-    for (size_t i = 0; i < values.size(); ++i) {
-      values[i].dump(out, level);
-      if (i < values.size() - 1)
-        out += ", ";
-    }
+    // Nothing is exact here, so rounding only looks at the digits removed
+    // last, and they can go several at a time.
+    bool round_up = false;
+    drop_digits<100000000, 8>(vr, vp, vm, removed, round_up);
+    drop_digits<10000, 4>(vr, vp, vm, removed, round_up);
+    drop_digits<100, 2>(vr, vp, vm, removed, round_up);
+    drop_digits<10, 1>(vr, vp, vm, removed, round_up);
+    output = vr + (vr == vm || round_up);
   }
+  exponent = e10 + removed;
+  return output;
 }
 
-static void dump(const Toon::object &values, string &out, int level) {
-  bool first = true;
-  for (auto const &kv : values) {
-    if (!first) {
-      out += "\n";
-      indent(out, level);
-    }
-    out += kv.first;
-    out += ": ";
-    if (kv.second.is_object() || kv.second.is_array()) {
-      if (kv.second.is_object())
-        out += "\n";
-      if (kv.second.is_object())
-        indent(out, level + 1);
-      kv.second.dump(out, level + 1);
+// Appends the shortest decimal string that parses back to `value`, which
+// must be finite, using the notation of printf("%g"): plain between 1e-4
+// and 1e16, and also above while there are as many digits as the integer
+// part, e-notation with at least two exponent digits otherwise. `Out` is
+// a std::string or anything else with its append(p, n) and operator+=.
+template <class Out> static void format_double(double value, Out &out) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof bits);
+  const uint64_t fraction = bits & ((uint64_t(1) << 52) - 1);
+  const int biased = static_cast<int>((bits >> 52) & 0x7ff);
+  char buf[32];
+  char *p = buf + 1, *end = p;
+  if (bits >> 63)
+    *--p = '-';
+  if (fraction == 0 && biased == 0) {
+    *end++ = '0';
+    out.append(p, end - p);
+    return;
+  }
+  int exponent;
+  const uint64_t digits = shortest_digits(fraction, biased, exponent);
+  const int n = digit_count(digits);
+  const int x = exponent + n - 1; // the exponent of the first digit
+  if (x >= -4 && x < std::max(n, 16)) {
+    if (x < 0) {
+      // 0.000ddd
+      *end++ = '0';
+      *end++ = '.';
+      for (int k = -1; k > x; --k)
+        *end++ = '0';
+      end += n;
+      format_uint(digits, end);
+    } else if (x >= n - 1) {
+      // ddd000
+      end += n;
+      format_uint(digits, end);
+      for (int k = n - 1; k < x; ++k)
+        *end++ = '0';
+    } else {
+      // dd.ddd: the integer digits are moved one place to the left.
+      format_uint(digits, end + n + 1);
+      for (int k = 0; k <= x; ++k)
+        end[k] = end[k + 1];
+      end[x + 1] = '.';
+      end += n + 1;
+    }
+  } else {
+    // d.ddde+xx
+    format_uint(digits, end + n + 1);
+    end[0] = end[1];
+    if (n > 1) {
+      end[1] = '.';
+      end += n + 1;
     } else {
-      kv.second.dump(out, level);
+      end += 1;
     }
-    first = false;
+    *end++ = 'e';
+    *end++ = x < 0 ? '-' : '+';
+    const int magnitude = x < 0 ? -x : x;
+    if (magnitude < 10)
+      *end++ = '0';
+    end += magnitude < 100 ? (magnitude < 10 ? 1 : 2) : 3;
+    format_uint(static_cast<uint64_t>(magnitude), end);
   }
+  out.append(p, end - p);
 }
 
-void Toon::dump(string &out, int level) const { m_ptr->dump(out, level); }
-
-/* Value Wrappers */
-template <Toon::Type tag, typename T> class Value : public ToonValue {
-protected:
-  explicit Value(const T &value) : m_value(value) {}
-  explicit Value(T &&value) : m_value(move(value)) {}
-
-  Toon::Type type() const override { return tag; }
-  bool equals(const ToonValue *other) const override {
-    return m_value == static_cast<const Value<tag, T> *>(other)->m_value;
-  }
-  bool less(const ToonValue *other) const override {
-    return m_value < static_cast<const Value<tag, T> *>(other)->m_value;
+// Multiply-xorshift over 8-byte words; keys are short, so this beats byte
+// at a time hashes by a wide margin. The low bits of the state are weak and
+// callers finish it off: hash_key() below, or hash_of() for strings.
+static uint64_t hash_words(toon::StringView key) {
+  const uint64_t k = 0x9e3779b97f4a7c15ull;
+  const char *p = key.data();
+  size_t n = key.size();
+  uint64_t h = n * k;
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h = (h ^ w) * k;
+    h ^= h >> 32;
   }
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-  const T m_value;
-#pragma GCC diagnostic pop
-  void dump(string &out, int level) const override {
-    toon::dump(m_value, out, level);
+  if (n) {
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    h = (h ^ w) * k;
+    h ^= h >> 32;
   }
-};
-
-template <>
-bool Value<Toon::NUL, std::nullptr_t>::less(const ToonValue *) const {
-  return false;
+  return h;
 }
 
-class ToonDouble final : public Value<Toon::NUMBER, double> {
-  double number_value() const override { return m_value; }
-  int int_value() const override { return static_cast<int>(m_value); }
+static uint32_t hash_key(toon::StringView key) {
+  // The high half of a product depends on every input bit.
+  return static_cast<uint32_t>((hash_words(key) * 0x9e3779b97f4a7c15ull) >>
+                               32);
+}
 
-public:
-  explicit ToonDouble(double value) : Value(value) {}
-};
+} // end namespace helper_toon
 
-class ToonInt final : public Value<Toon::NUMBER, int> {
-  double number_value() const override { return m_value; }
-  int int_value() const override { return m_value; }
+namespace toon {
 
-public:
-  explicit ToonInt(int value) : Value(value) {}
-};
+using std::make_shared;
+using std::map;
+using std::move;
+using std::shared_ptr;
+using std::string;
+using std::vector;
 
-class ToonBoolean final : public Value<Toon::BOOL, bool> {
-  bool bool_value() const override { return m_value; }
+/* Instrumentation
+ *
+ * With TOON_STATS, TOON_STAT(statements) runs them when the stats
+ * pointer in scope is set, and TOON_STATS_ONLY(...) keeps declarations that
+ * only instrumentation needs. Without it both expand to nothing. The parser
+ * carries its ParseStats pointer as a member; the serializer is spread over
+ * the ToonValue::dump overrides, so it finds its DumpStats through a
+ * thread-local pointer instead.
+ */
 
-public:
-  explicit ToonBoolean(bool value) : Value(value) {}
-};
+static std::atomic<StatsHook *> stats_hook(nullptr);
 
-class ToonString final : public Value<Toon::STRING, string> {
-  const string &string_value() const override { return m_value; }
+void set_stats_hook(StatsHook *hook) { stats_hook.store(hook); }
 
-public:
-  explicit ToonString(const string &value) : Value(value) {}
-  explicit ToonString(string &&value) : Value(move(value)) {}
-};
+#ifdef TOON_STATS
+#define TOON_STAT(...)                                                         \
+  do {                                                                         \
+    if (stats) {                                                               \
+      __VA_ARGS__;                                                             \
+    }                                                                          \
+  } while (0)
+#define TOON_STATS_ONLY(...) __VA_ARGS__
 
-class ToonArray final : public Value<Toon::ARRAY, Toon::array> {
-  const Toon::array &array_items() const override { return m_value; }
-  const Toon &operator[](size_t i) const override;
+bool stats_enabled() { return true; }
 
-public:
-  explicit ToonArray(const Toon::array &value) : Value(value) {}
-  explicit ToonArray(Toon::array &&value) : Value(move(value)) {}
-};
+typedef std::chrono::steady_clock StatsClock;
 
-class ToonObject final : public Value<Toon::OBJECT, Toon::object> {
-  const Toon::object &object_items() const override { return m_value; }
-  const Toon &operator[](const string &key) const override;
+static double ms_since(StatsClock::time_point start) {
+  return std::chrono::duration<double, std::milli>(StatsClock::now() - start)
+      .count();
+}
 
-public:
-  explicit ToonObject(const Toon::object &value) : Value(value) {}
-  explicit ToonObject(Toon::object &&value) : Value(move(value)) {}
+// Adds the time it is alive to `*ms`, unless `ms` is null or `running` is
+// already set by an enclosing timer for the same phase.
+struct StatsTimer {
+  StatsTimer(double *ms, bool &running)
+      : ms(ms && !running ? ms : nullptr), running(running) {
+    if (this->ms) {
+      running = true;
+      start = StatsClock::now();
+    }
+  }
+  ~StatsTimer() {
+    if (ms) {
+      *ms += ms_since(start);
+      running = false;
+    }
+  }
+  double *ms;
+  bool &running;
+  StatsClock::time_point start;
 };
 
-class ToonNull final : public Value<Toon::NUL, std::nullptr_t> {
-public:
-  ToonNull() : Value(nullptr) {}
+// Counts one level of nesting while it is alive.
+struct StatsDepth {
+  StatsDepth(ParseStats *stats, size_t &depth) : stats(stats), depth(depth) {
+    if (stats && ++depth > stats->max_depth)
+      stats->max_depth = depth;
+  }
+  ~StatsDepth() {
+    if (stats)
+      --depth;
+  }
+  ParseStats *stats;
+  size_t &depth;
 };
 
-/* Statics */
-struct Statics {
-  const std::shared_ptr<ToonValue> null = make_shared<ToonNull>();
-  const std::shared_ptr<ToonValue> t = make_shared<ToonBoolean>(true);
-  const std::shared_ptr<ToonValue> f = make_shared<ToonBoolean>(false);
-  const string empty_string;
-  const vector<Toon> empty_vector;
-  const map<string, Toon> empty_map;
-  Statics() {}
+// The stats of the dump running on this thread, if any.
+static thread_local DumpStats *dump_stats = nullptr;
+static thread_local bool dump_timing_table = false;
+
+// Points dump_stats at `stats` while it is alive.
+struct DumpStatsScope {
+  explicit DumpStatsScope(DumpStats *stats) : saved(dump_stats) {
+    dump_stats = stats;
+  }
+  ~DumpStatsScope() { dump_stats = saved; }
+  DumpStats *saved;
 };
+#else
+#define TOON_STAT(...)                                                         \
+  do {                                                                         \
+  } while (0)
+#define TOON_STATS_ONLY(...)
 
-static const Statics &statics() {
-  static const Statics s{};
-  return s;
-}
+bool stats_enabled() { return false; }
+#endif
 
-static const Toon &static_null() {
-  static const Toon json_null;
-  return json_null;
+template <class Out> static void dump(std::nullptr_t, Out &out, int) {
+  out += "null";
 }
 
-const Toon &ToonArray::operator[](size_t i) const {
-  if (i >= m_value.size())
-    return static_null();
+template <class Out>
+static void dump(double value, Out &out, int) {
+  if (std::isfinite(value))
+    helper_toon::format_double(value, out);
   else
-    return m_value[i];
+    out += "null";
 }
 
-const Toon &ToonObject::operator[](const string &key) const {
-  auto iter = m_value.find(key);
-  return (iter == m_value.end()) ? static_null() : iter->second;
-}
-
-Toon::Toon() noexcept : m_ptr(statics().null) {}
-Toon::Toon(std::nullptr_t) noexcept : m_ptr(statics().null) {}
-Toon::Toon(double value) : m_ptr(make_shared<ToonDouble>(value)) {}
-Toon::Toon(int value) : m_ptr(make_shared<ToonInt>(value)) {}
-Toon::Toon(bool value) : m_ptr(value ? statics().t : statics().f) {}
-Toon::Toon(const string &value) : m_ptr(make_shared<ToonString>(value)) {}
-Toon::Toon(string &&value) : m_ptr(make_shared<ToonString>(move(value))) {}
-Toon::Toon(const char *value) : m_ptr(make_shared<ToonString>(value)) {}
-Toon::Toon(const Toon::array &values) : m_ptr(make_shared<ToonArray>(values)) {}
-Toon::Toon(Toon::array &&values)
-    : m_ptr(make_shared<ToonArray>(move(values))) {}
-Toon::Toon(const Toon::object &values)
-    : m_ptr(make_shared<ToonObject>(values)) {}
-Toon::Toon(Toon::object &&values)
-    : m_ptr(make_shared<ToonObject>(move(values))) {}
-
-Toon::Type Toon::type() const { return m_ptr->type(); }
-double Toon::number_value() const { return m_ptr->number_value(); }
-int Toon::int_value() const { return m_ptr->int_value(); }
-bool Toon::bool_value() const { return m_ptr->bool_value(); }
-const string &Toon::string_value() const { return m_ptr->string_value(); }
-const Toon::array &Toon::array_items() const { return m_ptr->array_items(); }
-const Toon::object &Toon::object_items() const { return m_ptr->object_items(); }
-const Toon &Toon::operator[](size_t i) const { return (*m_ptr)[i]; }
-const Toon &Toon::operator[](const string &key) const { return (*m_ptr)[key]; }
-
-double ToonValue::number_value() const { return 0; }
-int ToonValue::int_value() const { return 0; }
-bool ToonValue::bool_value() const { return false; }
-const string &ToonValue::string_value() const { return statics().empty_string; }
-const Toon::array &ToonValue::array_items() const {
-  return statics().empty_vector;
-}
-const Toon::object &ToonValue::object_items() const {
-  return statics().empty_map;
-}
-const Toon &ToonValue::operator[](size_t) const {
-  static const Toon null;
-  return null;
+template <class Out>
+static void dump(int value, Out &out, int) {
+  helper_toon::format_int(value, out);
 }
-const Toon &ToonValue::operator[](const string &) const {
-  static const Toon null;
-  return null;
+
+template <class Out>
+static void dump(bool value, Out &out, int) {
+  out += value ? "true" : "false";
 }
 
-bool Toon::operator==(const Toon &other) const {
-  if (m_ptr == other.m_ptr)
+static bool needs_quoting(StringView value) {
+  if (value.empty())
     return true;
-  if (m_ptr->type() != other.m_ptr->type())
-    return false;
-  return m_ptr->equals(other.m_ptr.get());
+  if (value == "null" || value == "true" || value == "false")
+    return true;
+  // The parser reads anything starting like a number as one.
+  if (isdigit(static_cast<unsigned char>(value[0])) || value[0] == '-')
+    return true;
+  return helper_toon::scan(value.data(), 0, value.size(),
+                           helper_toon::SPECIAL) != value.size();
 }
 
-bool Toon::operator<(const Toon &other) const {
-  if (m_ptr == other.m_ptr)
-    return false;
-  if (m_ptr->type() != other.m_ptr->type())
-    return m_ptr->type() < other.m_ptr->type();
-  return m_ptr->less(other.m_ptr.get());
+// How dump_string() writes a string: as is, between quotes, or between
+// quotes with escapes. ToonString works this out once and keeps it.
+enum StringForm : uint8_t {
+  FORM_UNKNOWN,
+  FORM_PLAIN,
+  FORM_QUOTED,
+  FORM_ESCAPED
+};
+
+static StringForm string_form(StringView value) {
+  if (!needs_quoting(value))
+    return FORM_PLAIN;
+  return helper_toon::scan(value.data(), 0, value.size(),
+                           helper_toon::NEEDS_ESCAPE) == value.size()
+             ? FORM_QUOTED
+             : FORM_ESCAPED;
 }
 
-/* Parser Implementation */
-struct ToonParser {
-  const string &str;
-  size_t i;
-  string &err;
-  bool failed;
+// The letter after the backslash for the characters with a short escape,
+// 0 for those written as \u00xx.
+static char short_escape(char ch) {
+  switch (ch) {
+  case '\\':
+    return '\\';
+  case '"':
+    return '"';
+  case '\b':
+    return 'b';
+  case '\f':
+    return 'f';
+  case '\n':
+    return 'n';
+  case '\r':
+    return 'r';
+  case '\t':
+    return 't';
+  default:
+    return 0;
+  }
+}
 
-  Toon fail(string &&msg) {
-    if (!failed)
-      err = std::move(msg);
-    failed = true;
-    return Toon();
+// Writes `value` between quotes, escaping the characters that need it.
+template <class Out>
+static void write_escaped(StringView value, Out &out) {
+  static const char hex[] = "0123456789abcdef";
+  const char *data = value.data();
+  const size_t size = value.size();
+  out += '"';
+  for (size_t i = 0; i < size; i++) {
+    // Copy the run up to the next character that needs escaping in one go.
+    size_t run = helper_toon::scan(data, i, size, helper_toon::NEEDS_ESCAPE);
+    out.append(data + i, run - i);
+    if (run == size)
+      break;
+    i = run;
+    const char ch = data[i];
+    if (const char letter = short_escape(ch)) {
+      const char escape[2] = {'\\', letter};
+      out.append(escape, 2);
+    } else {
+      // Only control characters get here.
+      const char escape[6] = {'\\', 'u', '0', '0', hex[(ch >> 4) & 0xf],
+                              hex[ch & 0xf]};
+      out.append(escape, 6);
+    }
   }
+  out += '"';
+}
 
-  void consume_whitespace() {
-    while (i < str.size() &&
-           (str[i] == ' ' || str[i] == '\r' || str[i] == '\t'))
-      i++;
+template <class Out>
+static void dump_string(StringView value, StringForm form, Out &out) {
+  TOON_STATS_ONLY(DumpStats *stats = dump_stats;)
+  TOON_STAT(stats->strings++);
+  if (form == FORM_PLAIN) {
+    out.append(value.data(), value.size());
+    return;
   }
+  TOON_STAT(stats->quoted++);
+  if (form == FORM_ESCAPED)
+    return write_escaped(value, out);
+  out += '"';
+  out.append(value.data(), value.size());
+  out += '"';
+}
 
-  void consume_garbage() {
-    while (true) {
-      consume_whitespace();
-      if (i < str.size() && str[i] == '#') { // Comment
-        while (i < str.size() && str[i] != '\n')
+// For strings written once, escaping is left to the copy loop instead of a
+// separate scan.
+template <class Out>
+static void dump_string(StringView value, Out &out) {
+  dump_string(value, needs_quoting(value) ? FORM_ESCAPED : FORM_PLAIN, out);
+}
+
+template <class Out>
+static void dump(const string &value, Out &out, int) {
+  dump_string(value, out);
+}
+
+// dump_into() writes through a BoundedSink: it copies what fits in the
+// caller's buffer and only counts the rest, so the full length is known once
+// the walk ends. It has what the dump() overloads use of std::string.
+struct BoundedSink {
+  char *buf;
+  size_t size;
+  size_t n;
+  void append(const char *s, size_t count) {
+    if (n < size)
+      memcpy(buf + n, s, std::min(count, size - n));
+    n += count;
+  }
+  void append(size_t count, char ch) {
+    if (n < size)
+      memset(buf + n, ch, std::min(count, size - n));
+    n += count;
+  }
+  BoundedSink &operator+=(char ch) {
+    if (n < size)
+      buf[n] = ch;
+    n++;
+    return *this;
+  }
+  BoundedSink &operator+=(const char *s) {
+    append(s, strlen(s));
+    return *this;
+  }
+  BoundedSink &operator+=(const string &s) {
+    append(s.data(), s.size());
+    return *this;
+  }
+  void value(const Toon &toon, int level) { toon.dump(*this, level); }
+};
+
+static void dump_value(const Toon &value, string &out, int level) {
+  value.dump(out, level);
+}
+
+static void dump_value(const Toon &value, BoundedSink &out, int level) {
+  out.value(value, level);
+}
+
+template <class Out>
+static void indent(Out &out, int level) {
+  out.append(2 * static_cast<size_t>(level), ' ');
+}
+
+static bool same_keys(const Toon::members &a, const Toon::members &b) {
+  if (a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].first != b[i].first)
+      return false;
+  }
+  return true;
+}
+
+// Whether `value` can be a cell of a table row, which only reads scalars
+// and inline arrays back: objects cannot, nor arrays that hold one.
+static bool fits_in_cell(const Toon &value) {
+  if (value.is_object() || value.is_table())
+    return false;
+  if (value.is_array()) {
+    for (const Toon &item : value.array_items()) {
+      if (!fits_in_cell(item))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Whether dump() writes `values` in tabular form: every element must be an
+// object with exactly the keys of the first one, in the same order, so each
+// row is checked in one lockstep walk against the first, and every member
+// value must fit in a cell.
+static bool is_tabular(const Toon::array &values) {
+  const Toon::members &head = values[0].object_members();
+  bool tabular = values[0].is_object() && !head.empty();
+  for (size_t i = 0; tabular && i < values.size(); ++i) {
+    const Toon::members &row = values[i].object_members();
+    tabular = values[i].is_object() && (i == 0 || same_keys(head, row));
+    for (size_t k = 0; tabular && k < row.size(); ++k)
+      tabular = fits_in_cell(row[k].second);
+  }
+  return tabular;
+}
+
+template <class Out>
+static void dump_array_head(const Toon::array &values, bool tabular,
+                            Out &out) {
+  if (tabular) {
+    out += "[{";
+    bool first = true;
+    for (auto const &kv : values[0].object_members()) {
+      if (!first)
+        out += ", ";
+      out += kv.first;
+      first = false;
+    }
+    out += "}]:\n";
+  } else {
+    out += "[";
+    out += std::to_string(values.size());
+    out += "]: ";
+  }
+}
+
+// Writes elements [begin, end) of `values` together with the separators
+// that precede them.
+template <class Out>
+static void dump_array_items(const Toon::array &values, bool tabular,
+                             size_t begin, size_t end, Out &out, int level) {
+  for (size_t i = begin; i < end; ++i) {
+    if (!tabular) {
+      if (i > 0)
+        out += ", ";
+      dump_value(values[i], out, level);
+      continue;
+    }
+    if (i > 0)
+      out += "\n";
+    indent(out, level + 1);
+    // Same key order as the header, so cells are emitted as iterated.
+    bool first = true;
+    for (auto const &kv : values[i].object_members()) {
+      if (!first)
+        out += ", ";
+      dump_value(kv.second, out, level + 1);
+      first = false;
+    }
+  }
+}
+
+template <class Out>
+static void dump(const Toon::array &values, Out &out, int level) {
+  if (values.empty()) {
+    out += "[0]:";
+    return;
+  }
+  const bool tabular = is_tabular(values);
+  TOON_STATS_ONLY(DumpStats *stats = dump_stats;
+                  StatsTimer timer(stats && tabular ? &stats->table_ms : nullptr,
+                                   dump_timing_table);)
+  TOON_STAT(if (tabular) stats->table_rows += values.size());
+  dump_array_head(values, tabular, out);
+  dump_array_items(values, tabular, 0, values.size(), out, level);
+}
+
+// Writes the separator and key that precede member `i` and returns the
+// indentation level its value is dumped at.
+template <class Out>
+static int dump_member_head(const Toon::members &values, size_t i, Out &out,
+                            int level) {
+  if (i > 0) {
+    out += "\n";
+    indent(out, level);
+  }
+  const Toon &value = values[i].second;
+  out += values[i].first;
+  out += ": ";
+  if (value.is_object()) {
+    out += "\n";
+    indent(out, level + 1);
+  }
+  return value.is_object() || value.is_array() ? level + 1 : level;
+}
+
+template <class Out>
+static void dump_members(const Toon::members &values, size_t begin,
+                         size_t end, Out &out, int level) {
+  for (size_t i = begin; i < end; ++i) {
+    const int value_level = dump_member_head(values, i, out, level);
+    dump_value(values[i].second, out, value_level);
+  }
+}
+
+template <class Out>
+static void dump(const Toon::members &values, Out &out, int level) {
+  dump_members(values, 0, values.size(), out, level);
+}
+
+/* Dump sizes
+ *
+ * Byte counts of what the dump() overloads above write, kept in step with
+ * them: Toon::dump_size() adds these up without building any output.
+ */
+struct LengthCounter {
+  size_t n = 0;
+  void append(const char *, size_t count) { n += count; }
+  LengthCounter &operator+=(const char *s) {
+    n += strlen(s);
+    return *this;
+  }
+};
+
+static size_t uint_length(uint64_t value) {
+  size_t n = 1;
+  for (; value >= 10; value /= 10)
+    ++n;
+  return n;
+}
+
+static size_t int_length(int64_t value) {
+  return value < 0 ? 1 + uint_length(0 - static_cast<uint64_t>(value))
+                   : uint_length(static_cast<uint64_t>(value));
+}
+
+static size_t dump_size(std::nullptr_t, int) { return 4; }
+
+static size_t dump_size(double value, int) {
+  if (!std::isfinite(value))
+    return 4;
+  LengthCounter counter;
+  helper_toon::format_double(value, counter);
+  return counter.n;
+}
+
+static size_t dump_size(bool value, int) { return value ? 4 : 5; }
+
+static size_t string_size(StringView value, StringForm form) {
+  if (form == FORM_PLAIN)
+    return value.size();
+  size_t n = value.size() + 2;
+  if (form == FORM_QUOTED)
+    return n;
+  const char *data = value.data();
+  for (size_t i = helper_toon::scan(data, 0, value.size(),
+                                    helper_toon::NEEDS_ESCAPE);
+       i < value.size(); i = helper_toon::scan(data, i + 1, value.size(),
+                                               helper_toon::NEEDS_ESCAPE))
+    n += short_escape(data[i]) ? 1 : 5; // \x or \u00xx in place of one byte
+  return n;
+}
+
+static size_t string_size(StringView value) {
+  return string_size(value, needs_quoting(value) ? FORM_ESCAPED : FORM_PLAIN);
+}
+
+static size_t dump_size(const string &value, int) {
+  return string_size(value);
+}
+
+static size_t dump_size(const Toon::array &values, int level) {
+  if (values.empty())
+    return 4; // [0]:
+  const size_t count = values.size();
+  size_t n = 0;
+  if (!is_tabular(values)) {
+    n = uint_length(count) + 4 + 2 * (count - 1); // [N]: and the ", "
+    for (const Toon &value : values)
+      n += value.dump_size(level);
+    return n;
+  }
+  const Toon::members &head = values[0].object_members();
+  n = 6 + 2 * (head.size() - 1); // [{, }]:\n and the ", " between keys
+  for (auto const &kv : head)
+    n += kv.first.str().size();
+  // Each row: its newline (but the first), indentation and separators.
+  n += count * (2 * static_cast<size_t>(level + 1) + 2 * (head.size() - 1)) +
+       count - 1;
+  for (const Toon &row : values) {
+    for (auto const &kv : row.object_members())
+      n += kv.second.dump_size(level + 1);
+  }
+  return n;
+}
+
+static size_t dump_size(const Toon::members &values, int level) {
+  size_t n = 0;
+  for (size_t i = 0; i < values.size(); ++i) {
+    const Toon &value = values[i].second;
+    if (i > 0)
+      n += 1 + 2 * static_cast<size_t>(level);
+    n += values[i].first.str().size() + 2;
+    if (value.is_object())
+      n += 1 + 2 * static_cast<size_t>(level + 1);
+    n += value.dump_size(value.is_object() || value.is_array() ? level + 1
+                                                              : level);
+  }
+  return n;
+}
+
+#ifdef TOON_STATS
+static void dump_counted(const Toon &value, string &out, int level,
+                         DumpStats &stats) {
+  stats = DumpStats();
+  const size_t before = out.size();
+  StatsClock::time_point start = StatsClock::now();
+  {
+    DumpStatsScope scope(&stats);
+    value.dump(out, level);
+  }
+  stats.total_ms = ms_since(start);
+  stats.bytes = out.size() - before;
+  if (StatsHook *hook = stats_hook.load(std::memory_order_acquire))
+    hook->on_dump(stats);
+}
+#endif
+
+void Toon::dump(string &out, DumpStats &stats) const {
+#ifdef TOON_STATS
+  dump_counted(*this, out, 0, stats);
+#else
+  stats = DumpStats();
+  dump(out);
+#endif
+}
+
+void Toon::dump(string &out, int level) const {
+#ifdef TOON_STATS
+  DumpStats *stats = dump_stats;
+  if (!stats && stats_hook.load(std::memory_order_acquire)) {
+    DumpStats top;
+    return dump_counted(*this, out, level, top);
+  }
+  TOON_STAT(stats->nodes++,
+            stats->max_depth = std::max<size_t>(stats->max_depth, level));
+#endif
+  switch (m_storage) {
+  case S_NULL:
+    return toon::dump(nullptr, out, level);
+  case S_BOOL:
+    return toon::dump(m_bool, out, level);
+  case S_INT64:
+    return helper_toon::format_int(m_int64, out);
+  case S_UINT64:
+    return helper_toon::format_unsigned(m_uint64, out);
+  case S_DOUBLE:
+    return toon::dump(m_double, out, level);
+  case S_PTR:
+    break;
+  }
+  m_ptr->dump(out, level);
+}
+
+size_t Toon::dump_size(int level) const {
+  switch (m_storage) {
+  case S_NULL:
+    return toon::dump_size(nullptr, level);
+  case S_BOOL:
+    return toon::dump_size(m_bool, level);
+  case S_INT64:
+    return int_length(m_int64);
+  case S_UINT64:
+    return uint_length(m_uint64);
+  case S_DOUBLE:
+    return toon::dump_size(m_double, level);
+  case S_PTR:
+    break;
+  }
+  return m_ptr->dump_size(level);
+}
+
+void Toon::dump(BoundedSink &out, int level) const {
+  switch (m_storage) {
+  case S_NULL:
+    return toon::dump(nullptr, out, level);
+  case S_BOOL:
+    return toon::dump(m_bool, out, level);
+  case S_INT64:
+    return helper_toon::format_int(m_int64, out);
+  case S_UINT64:
+    return helper_toon::format_unsigned(m_uint64, out);
+  case S_DOUBLE:
+    return toon::dump(m_double, out, level);
+  case S_PTR:
+    break;
+  }
+  m_ptr->dump(out, level);
+}
+
+size_t Toon::dump_into(char *buf, size_t size) const {
+  BoundedSink out = {buf, size, 0};
+  dump(out, 0);
+  return out.n;
+}
+
+/* Keys */
+
+Key::Rep *Key::empty() noexcept {
+  static Rep rep(string(), helper_toon::hash_key(StringView()), true, 0);
+  return &rep;
+}
+
+Key::Key() noexcept : m_rep(empty()) {}
+Key::Key(const string &text) : Key(string(text)) {}
+Key::Key(string &&text) : m_rep(nullptr) {
+  uint32_t hash = helper_toon::hash_key(text);
+  m_rep = new Rep(move(text), hash, false, 0);
+}
+Key::Key(const char *text) : Key(string(text)) {}
+Key::Key(StringView text) : Key(text.str()) {}
+
+Key::Key(Key &&other) noexcept : m_rep(other.m_rep) { other.m_rep = empty(); }
+
+Key &Key::operator=(const Key &other) noexcept {
+  other.retain();
+  release();
+  m_rep = other.m_rep;
+  return *this;
+}
+
+Key &Key::operator=(Key &&other) noexcept {
+  if (this != &other) {
+    release();
+    m_rep = other.m_rep;
+    other.m_rep = empty();
+  }
+  return *this;
+}
+
+void Key::release() noexcept {
+  if (!m_rep->immortal &&
+      m_rep->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    delete m_rep;
+}
+
+// Open addressing over the interned reps, each holding one reference on
+// behalf of the table. Ids are never reused, unlike table addresses.
+struct KeyTable::Impl {
+  explicit Impl(bool immortal)
+      : count(0), immortal(immortal), id(next_id.fetch_add(1) + 1) {}
+  mutable std::mutex mutex;
+  vector<Key::Rep *> slots;
+  size_t count;
+  const bool immortal;
+  const uint64_t id;
+  static std::atomic<uint64_t> next_id;
+};
+
+std::atomic<uint64_t> KeyTable::Impl::next_id(0);
+
+KeyTable::KeyTable() : m_impl(new Impl(false)) {}
+KeyTable::KeyTable(bool immortal) : m_impl(new Impl(immortal)) {}
+
+KeyTable::~KeyTable() {
+  // Drop the table's references; keys still in use keep their rep alive.
+  for (Key::Rep *rep : m_impl->slots) {
+    if (rep && rep->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete rep;
+  }
+}
+
+Key KeyTable::intern(StringView text) {
+  const uint32_t hash = helper_toon::hash_key(text);
+  std::lock_guard<std::mutex> lock(m_impl->mutex);
+  vector<Key::Rep *> &slots = m_impl->slots;
+  if (m_impl->count * 2 >= slots.size()) {
+    vector<Key::Rep *> grown(slots.empty() ? 64 : slots.size() * 2, nullptr);
+    for (Key::Rep *rep : slots) {
+      if (!rep)
+        continue;
+      size_t slot = rep->hash & (grown.size() - 1);
+      while (grown[slot])
+        slot = (slot + 1) & (grown.size() - 1);
+      grown[slot] = rep;
+    }
+    slots.swap(grown);
+  }
+  const size_t mask = slots.size() - 1;
+  size_t slot = hash & mask;
+  for (; slots[slot]; slot = (slot + 1) & mask) {
+    if (slots[slot]->hash == hash && StringView(slots[slot]->text) == text)
+      break;
+  }
+  if (!slots[slot]) {
+    slots[slot] = new Key::Rep(text.str(), hash, m_impl->immortal, m_impl->id);
+    m_impl->count++;
+  }
+  Key key(slots[slot]);
+  key.retain();
+  return key;
+}
+
+size_t KeyTable::size() const {
+  std::lock_guard<std::mutex> lock(m_impl->mutex);
+  return m_impl->count;
+}
+
+KeyTable &KeyTable::global() {
+  static KeyTable *table = new KeyTable(true); // never destroyed
+  return *table;
+}
+
+/* Structural hashes
+ *
+ * Kept consistent with Toon::operator==: numbers hash by their double value
+ * (so 1 and 1.0 agree, and integers beyond 2^53 may only collide), members
+ * are summed so that member order does not matter, and tables hash row by
+ * row exactly as the arrays of objects they materialize to.
+ */
+static uint64_t mix_hash(uint64_t h) { // splitmix64's finalizer
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+static uint64_t hash_scalar(Toon::Type type, uint64_t bits) {
+  return mix_hash(bits + 0x9e3779b97f4a7c15ull * (type + 1));
+}
+
+static uint64_t hash_of(std::nullptr_t) { return hash_scalar(Toon::NUL, 0); }
+
+static uint64_t hash_of(double value) {
+  if (value == 0)
+    value = 0; // -0.0 == 0.0
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof bits);
+  return hash_scalar(Toon::NUMBER, bits);
+}
+
+static uint64_t hash_of(const string &value) {
+  return hash_scalar(Toon::STRING, helper_toon::hash_words(value));
+}
+
+// Arrays fold their elements in order.
+static uint64_t hash_array_start(size_t count) {
+  return hash_scalar(Toon::ARRAY, count);
+}
+static uint64_t hash_array_add(uint64_t h, uint64_t element) {
+  return mix_hash(h ^ element);
+}
+
+static uint64_t hash_of(const Toon::array &values) {
+  uint64_t h = hash_array_start(values.size());
+  for (const Toon &value : values)
+    h = hash_array_add(h, value.hash());
+  return h;
+}
+
+// Objects add up their members, `key` being the key's hash_key().
+static uint64_t hash_member(uint32_t key, uint64_t value) {
+  return mix_hash(value + 0x9e3779b97f4a7c15ull * key);
+}
+static uint64_t hash_object(size_t count, uint64_t member_sum) {
+  return hash_scalar(Toon::OBJECT, count + member_sum);
+}
+
+static uint64_t hash_of(const Toon::members &values) {
+  uint64_t sum = 0;
+  for (auto const &m : values)
+    sum += hash_member(m.first.hash(), m.second.hash());
+  return hash_object(values.size(), sum);
+}
+
+// The hash of an array, object or table, computed on first use; 0 stands
+// for not computed yet. Editing in place (Toon::own_array(), own_object())
+// resets it. Racing threads compute and store the same value.
+class HashCache {
+public:
+  template <class F> uint64_t get(F compute) const {
+    uint64_t h = m_value.load(std::memory_order_relaxed);
+    if (h == 0) {
+      h = compute();
+      h += h == 0;
+      m_value.store(h, std::memory_order_relaxed);
+    }
+    return h;
+  }
+  uint64_t peek() const { return m_value.load(std::memory_order_relaxed); }
+  void reset() { m_value.store(0, std::memory_order_relaxed); }
+
+private:
+  mutable std::atomic<uint64_t> m_value{0};
+};
+
+/* Value Wrappers */
+template <Toon::Type tag, typename T> class Value : public ToonValue {
+protected:
+  explicit Value(const T &value) : m_value(value) {}
+  explicit Value(T &&value) : m_value(move(value)) {}
+
+  Toon::Type type() const override { return tag; }
+  bool equals(const ToonValue *other) const override {
+    return m_value == static_cast<const Value<tag, T> *>(other)->m_value;
+  }
+  bool less(const ToonValue *other) const override {
+    return m_value < static_cast<const Value<tag, T> *>(other)->m_value;
+  }
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+  T m_value; // only edited by Toon, when it is the sole owner
+#pragma GCC diagnostic pop
+  void dump(string &out, int level) const override {
+    toon::dump(m_value, out, level);
+  }
+  void dump(BoundedSink &out, int level) const override {
+    toon::dump(m_value, out, level);
+  }
+  size_t dump_size(int level) const override {
+    return toon::dump_size(m_value, level);
+  }
+  uint64_t hash() const override { return toon::hash_of(m_value); }
+};
+
+template <>
+bool Value<Toon::NUL, std::nullptr_t>::less(const ToonValue *) const {
+  return false;
+}
+
+class ToonString final : public Value<Toon::STRING, string> {
+  const string &string_value() const override { return m_value; }
+  void dump(string &out, int) const override {
+    dump_string(m_value, form(), out);
+  }
+  void dump(BoundedSink &out, int) const override {
+    dump_string(m_value, form(), out);
+  }
+  size_t dump_size(int) const override {
+    return string_size(m_value, form());
+  }
+
+  // Worked out on the first dump; strings are immutable, and threads that
+  // race to store it store the same value.
+  StringForm form() const {
+    StringForm f = static_cast<StringForm>(
+        m_form.load(std::memory_order_relaxed));
+    if (f == FORM_UNKNOWN) {
+      f = string_form(m_value);
+      m_form.store(f, std::memory_order_relaxed);
+    }
+    return f;
+  }
+  mutable std::atomic<uint8_t> m_form{FORM_UNKNOWN};
+
+public:
+  explicit ToonString(const string &value) : Value(value) {}
+  explicit ToonString(string &&value) : Value(move(value)) {}
+};
+
+class ToonArray final : public Value<Toon::ARRAY, Toon::array> {
+  friend class Toon;
+  const Toon::array &array_items() const override { return m_value; }
+  const Toon &operator[](size_t i) const override;
+  // The other side may be a ToonTable.
+  bool equals(const ToonValue *other) const override {
+    return m_value == other->array_items();
+  }
+  bool less(const ToonValue *other) const override {
+    return m_value < other->array_items();
+  }
+  uint64_t hash() const override {
+    return m_hash.get([this] { return toon::hash_of(m_value); });
+  }
+  uint64_t cached_hash() const override { return m_hash.peek(); }
+
+  HashCache m_hash;
+
+public:
+  explicit ToonArray(const Toon::array &value) : Value(value) {}
+  explicit ToonArray(Toon::array &&value) : Value(move(value)) {}
+};
+
+// Members live in one vector, sorted by key (binary search) or in
+// insertion order (linear search); objects with more than kIndexedMembers
+// members also get an open-addressing table of member positions.
+class ToonObject final : public ToonValue {
+  friend class Toon;
+  friend class Interner;
+  friend struct BinaryWriter;
+  Toon::Type type() const override { return Toon::OBJECT; }
+  bool equals(const ToonValue *other) const override;
+  bool less(const ToonValue *other) const override;
+  void dump(string &out, int level) const override {
+    toon::dump(m_members, out, level);
+  }
+  void dump(BoundedSink &out, int level) const override {
+    toon::dump(m_members, out, level);
+  }
+  size_t dump_size(int level) const override {
+    return toon::dump_size(m_members, level);
+  }
+  uint64_t hash() const override {
+    return m_hash.get([this] { return toon::hash_of(m_members); });
+  }
+  uint64_t cached_hash() const override { return m_hash.peek(); }
+  const Toon::object &object_items() const override;
+  const Toon::members &object_members() const override { return m_members; }
+  const Toon &operator[](const string &key) const override;
+  const Toon &operator[](const Key &key) const override;
+
+  static const size_t kIndexedMembers = 16;
+  template <class K> const Toon *find(const K &key, uint32_t hash) const;
+  template <class K> size_t slot_of(const K &key, uint32_t hash) const;
+  void sort_unique();
+  void unique_in_order();
+  void reindex();
+  // In-place edits for Toon, which must be the only owner and have
+  // checked that m_map was never built.
+  Toon &at(const Key &key);
+  bool erase(const Key &key);
+
+  Toon::members m_members;
+  const bool m_ordered;
+  vector<uint32_t> m_index; // member position + 1, 0 marks a free slot
+  mutable std::once_flag m_materialized;
+  mutable std::atomic<bool> m_map_built{false};
+  mutable Toon::object m_map;
+  HashCache m_hash;
+
+public:
+  ToonObject(Toon::members &&members, bool ordered);
+};
+
+class ToonNull final : public Value<Toon::NUL, std::nullptr_t> {
+public:
+  ToonNull() : Value(nullptr) {}
+};
+
+class ToonTable final : public ToonValue {
+  friend class Toon;
+  Toon::Type type() const override { return Toon::ARRAY; }
+  bool equals(const ToonValue *other) const override;
+  bool less(const ToonValue *other) const override {
+    return array_items() < other->array_items();
+  }
+  void dump(string &out, int level) const override {
+    dump_table(out, level);
+  }
+  void dump(BoundedSink &out, int level) const override {
+    dump_table(out, level);
+  }
+  size_t dump_size(int level) const override;
+  uint64_t hash() const override;
+  uint64_t cached_hash() const override { return m_hash.peek(); }
+  const Toon::array &array_items() const override;
+  const Toon &operator[](size_t i) const override;
+  bool is_table() const override { return true; }
+  const vector<string> &table_keys() const override { return m_keys; }
+  size_t table_rows() const override { return m_rows; }
+  const Toon &table_cell(size_t row, size_t col) const override;
+
+  const vector<string> m_keys;
+  const Toon::array m_cells;
+  const size_t m_rows;
+  mutable std::once_flag m_materialized;
+  mutable Toon::array m_objects;
+  HashCache m_hash;
+
+public:
+  template <class Out> void dump_table(Out &out, int level) const;
+  // The two halves of dump(); rows [begin, end) each start on a new line.
+  template <class Out> void dump_head(Out &out) const;
+  template <class Out>
+  void dump_rows(size_t begin, size_t end, Out &out, int level) const;
+
+  ToonTable(vector<string> &&keys, Toon::array &&cells)
+      : m_keys(move(keys)), m_cells(move(cells)),
+        m_rows(m_cells.size() / m_keys.size()) {}
+};
+
+// A nested array or object of a parse_lazy() document that is built on
+// first use; every accessor forwards to the built value.
+struct LazySource;
+class ToonLazy final : public ToonValue {
+public:
+  // Parser position and line state where the value starts.
+  struct State {
+    size_t i, line_no, line_start;
+    int parent_indent;
+  };
+  static Toon make(const shared_ptr<LazySource> &source, const State &at,
+                   bool array) {
+    return Toon(make_shared<ToonLazy>(source, at, array));
+  }
+  ToonLazy(const shared_ptr<LazySource> &source, const State &at, bool array)
+      : m_source(source), m_at(at), m_array(array) {}
+
+private:
+  Toon::Type type() const override {
+    return m_array ? Toon::ARRAY : Toon::OBJECT;
+  }
+  bool equals(const ToonValue *other) const override {
+    return resolved()->equals(other->resolved());
+  }
+  bool less(const ToonValue *other) const override {
+    return resolved()->less(other->resolved());
+  }
+  void dump(string &out, int level) const override {
+    resolved()->dump(out, level);
+  }
+  void dump(BoundedSink &out, int level) const override {
+    resolved()->dump(out, level);
+  }
+  size_t dump_size(int level) const override {
+    return resolved()->dump_size(level);
+  }
+  uint64_t hash() const override { return resolved()->hash(); }
+  uint64_t cached_hash() const override {
+    return resolved()->cached_hash();
+  }
+  const Toon::array &array_items() const override {
+    return resolved()->array_items();
+  }
+  const Toon &operator[](size_t i) const override {
+    return (*resolved())[i];
+  }
+  const Toon::object &object_items() const override {
+    return resolved()->object_items();
+  }
+  const Toon::members &object_members() const override {
+    return resolved()->object_members();
+  }
+  const Toon &operator[](const string &key) const override {
+    return (*resolved())[key];
+  }
+  const Toon &operator[](const Key &key) const override {
+    return (*resolved())[key];
+  }
+  bool is_table() const override { return resolved()->is_table(); }
+  const vector<string> &table_keys() const override {
+    return resolved()->table_keys();
+  }
+  size_t table_rows() const override { return resolved()->table_rows(); }
+  const Toon &table_cell(size_t row, size_t col) const override {
+    return resolved()->table_cell(row, col);
+  }
+  const ToonValue *resolved() const override;
+  friend class Toon;
+
+  mutable shared_ptr<LazySource> m_source;
+  const State m_at;
+  const bool m_array;
+  mutable std::once_flag m_parsed;
+  mutable Toon m_value;
+};
+
+/* Statics */
+struct Statics {
+  // Stands in for the inline values, see Toon::value().
+  const ToonNull null;
+  const string empty_string;
+  const vector<Toon> empty_vector;
+  const map<string, Toon> empty_map;
+  const Toon::members empty_members;
+  const vector<string> empty_keys;
+  Statics() {}
+};
+
+static const Statics &statics() {
+  static const Statics s{};
+  return s;
+}
+
+static const Toon &static_null() {
+  static const Toon json_null;
+  return json_null;
+}
+
+ToonRef::ToonRef() noexcept : m_value(&static_null()) {}
+
+const Toon &ToonArray::operator[](size_t i) const {
+  if (i >= m_value.size())
+    return static_null();
+  else
+    return m_value[i];
+}
+
+bool ToonTable::equals(const ToonValue *other) const {
+  if (other->is_table() && other->table_keys() == m_keys)
+    return m_cells == static_cast<const ToonTable *>(other)->m_cells;
+  return array_items() == other->array_items();
+}
+
+template <class Out> void ToonTable::dump_table(Out &out, int level) const {
+  TOON_STATS_ONLY(DumpStats *stats = dump_stats;
+                  StatsTimer timer(stats ? &stats->table_ms : nullptr,
+                                   dump_timing_table);)
+  TOON_STAT(stats->table_rows += m_rows);
+  dump_head(out);
+  dump_rows(0, m_rows, out, level);
+}
+
+template <class Out> void ToonTable::dump_head(Out &out) const {
+  out += "[{";
+  for (size_t i = 0; i < m_keys.size(); ++i) {
+    out += m_keys[i];
+    if (i < m_keys.size() - 1)
+      out += ", ";
+  }
+  out += "}]:";
+}
+
+template <class Out>
+void ToonTable::dump_rows(size_t begin, size_t end, Out &out,
+                          int level) const {
+  const size_t width = m_keys.size();
+  for (size_t r = begin; r < end; ++r) {
+    out += "\n";
+    indent(out, level + 1);
+    for (size_t j = 0; j < width; ++j) {
+      dump_value(m_cells[r * width + j], out, level + 1);
+      if (j < width - 1)
+        out += ", ";
+    }
+  }
+}
+
+size_t ToonTable::dump_size(int level) const {
+  const size_t width = m_keys.size();
+  size_t n = 5 + 2 * (width - 1); // [{, }]: and the ", " between keys
+  for (const string &key : m_keys)
+    n += key.size();
+  // Each row: newline, indentation and the separators between cells.
+  n += m_rows * (1 + 2 * static_cast<size_t>(level + 1) + 2 * (width - 1));
+  for (const Toon &cell : m_cells)
+    n += cell.dump_size(level + 1);
+  return n;
+}
+
+uint64_t ToonTable::hash() const {
+  return m_hash.get([this] {
+    // Rows hash as the objects array_items() would build, without them.
+    const size_t width = m_keys.size();
+    vector<uint32_t> keys(width);
+    for (size_t j = 0; j < width; ++j)
+      keys[j] = helper_toon::hash_key(m_keys[j]);
+    uint64_t h = hash_array_start(m_rows);
+    for (size_t r = 0; r < m_rows; ++r) {
+      uint64_t sum = 0;
+      for (size_t j = 0; j < width; ++j)
+        sum += hash_member(keys[j], m_cells[r * width + j].hash());
+      h = hash_array_add(h, hash_object(width, sum));
+    }
+    return h;
+  });
+}
+
+const Toon::array &ToonTable::array_items() const {
+  std::call_once(m_materialized, [this] {
+    const size_t width = m_keys.size();
+    m_objects.reserve(m_rows);
+    // Visit the columns in key order so every row is built sorted.
+    vector<size_t> order(width);
+    for (size_t j = 0; j < width; ++j)
+      order[j] = j;
+    std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+      return m_keys[a] < m_keys[b];
+    });
+    // One Key per column, shared by every row.
+    vector<Key> keys(m_keys.begin(), m_keys.end());
+    for (size_t r = 0; r < m_rows; ++r) {
+      Toon::members row;
+      row.reserve(width);
+      for (size_t j : order)
+        row.emplace_back(keys[j], m_cells[r * width + j]);
+      m_objects.push_back(Toon::from_members(move(row)));
+    }
+  });
+  return m_objects;
+}
+
+const Toon &ToonTable::operator[](size_t i) const {
+  if (i >= m_rows)
+    return static_null();
+  return array_items()[i];
+}
+
+const Toon &ToonTable::table_cell(size_t row, size_t col) const {
+  if (row >= m_rows || col >= m_keys.size())
+    return static_null();
+  return m_cells[row * m_keys.size() + col];
+}
+
+static bool member_key_less(const std::pair<Key, Toon> &a,
+                            const std::pair<Key, Toon> &b) {
+  return a.first < b.first;
+}
+
+ToonObject::ToonObject(Toon::members &&members, bool ordered)
+    : m_members(move(members)), m_ordered(ordered) {
+  if (m_members.size() > kIndexedMembers) {
+    size_t slots = 32;
+    while (slots < m_members.size() * 2)
+      slots <<= 1;
+    m_index.assign(slots, 0);
+  }
+  if (m_ordered)
+    unique_in_order(); // fills m_index as it goes
+  else
+    sort_unique();
+}
+
+// Same semantics as Toon::object: sorted by key, last duplicate wins.
+void ToonObject::sort_unique() {
+  if (!std::is_sorted(m_members.begin(), m_members.end(), member_key_less))
+    std::stable_sort(m_members.begin(), m_members.end(), member_key_less);
+  size_t out = 0;
+  for (size_t i = 0; i < m_members.size(); ++i) {
+    if (out > 0 && m_members[out - 1].first == m_members[i].first)
+      m_members[out - 1].second = move(m_members[i].second);
+    else if (out++ != i)
+      m_members[out - 1] = move(m_members[i]);
+  }
+  m_members.resize(out);
+  if (!m_index.empty()) {
+    for (size_t i = 0; i < m_members.size(); ++i)
+      m_index[slot_of(m_members[i].first, m_members[i].first.hash())] =
+          static_cast<uint32_t>(i + 1);
+  }
+}
+
+// Keeps the first position of every key and its last value.
+void ToonObject::unique_in_order() {
+  size_t out = 0;
+  for (size_t i = 0; i < m_members.size(); ++i) {
+    std::pair<Key, Toon> &m = m_members[i];
+    size_t seen = out;
+    if (!m_index.empty()) {
+      size_t slot = slot_of(m.first, m.first.hash());
+      if (m_index[slot])
+        seen = m_index[slot] - 1;
+      else
+        m_index[slot] = static_cast<uint32_t>(out + 1);
+    } else {
+      for (size_t j = 0; j < out; ++j) {
+        if (m_members[j].first == m.first) {
+          seen = j;
+          break;
+        }
+      }
+    }
+    if (seen < out)
+      m_members[seen].second = move(m.second);
+    else if (out++ != i)
+      m_members[out - 1] = move(m);
+  }
+  m_members.resize(out);
+}
+
+// Rebuilds m_index, sized for the current members, after an edit.
+void ToonObject::reindex() {
+  m_index.clear();
+  if (m_members.size() <= kIndexedMembers)
+    return;
+  size_t slots = 32;
+  while (slots < m_members.size() * 2)
+    slots <<= 1;
+  m_index.assign(slots, 0);
+  for (size_t i = 0; i < m_members.size(); ++i)
+    m_index[slot_of(m_members[i].first, m_members[i].first.hash())] =
+        static_cast<uint32_t>(i + 1);
+}
+
+Toon &ToonObject::at(const Key &key) {
+  if (const Toon *found = find(key, key.hash()))
+    return const_cast<Toon &>(*found);
+  size_t pos = m_members.size();
+  if (!m_ordered)
+    pos = std::lower_bound(m_members.begin(), m_members.end(), key,
+                           [](const std::pair<Key, Toon> &m, const Key &k) {
+                             return m.first < k;
+                           }) -
+          m_members.begin();
+  m_members.emplace(m_members.begin() + pos, key, Toon());
+  if (pos + 1 == m_members.size() && m_members.size() * 2 <= m_index.size())
+    m_index[slot_of(key, key.hash())] = static_cast<uint32_t>(pos + 1);
+  else if (pos + 1 != m_members.size() || m_members.size() > kIndexedMembers)
+    reindex();
+  return m_members[pos].second;
+}
+
+bool ToonObject::erase(const Key &key) {
+  if (!find(key, key.hash()))
+    return false;
+  m_members.erase(std::find_if(
+      m_members.begin(), m_members.end(),
+      [&key](const std::pair<Key, Toon> &m) { return m.first == key; }));
+  reindex();
+  return true;
+}
+
+// Slot holding `key`, or the free slot where it would go. K is Key (pointer
+// compare when interned together) or StringView.
+template <class K>
+size_t ToonObject::slot_of(const K &key, uint32_t hash) const {
+  const size_t mask = m_index.size() - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    uint32_t pos = m_index[slot];
+    if (pos == 0)
+      return slot;
+    const Key &k = m_members[pos - 1].first;
+    if (k.hash() == hash && k == key)
+      return slot;
+  }
+}
+
+template <class K>
+const Toon *ToonObject::find(const K &key, uint32_t hash) const {
+  if (!m_index.empty()) {
+    uint32_t pos = m_index[slot_of(key, hash)];
+    return pos ? &m_members[pos - 1].second : nullptr;
+  }
+  if (m_ordered) {
+    for (const auto &m : m_members) {
+      if (m.first == key)
+        return &m.second;
+    }
+    return nullptr;
+  }
+  const StringView text(key);
+  size_t lo = 0, hi = m_members.size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int c = m_members[mid].first.view().compare(text);
+    if (c == 0)
+      return &m_members[mid].second;
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return nullptr;
+}
+
+const Toon &ToonObject::operator[](const string &key) const {
+  const StringView view(key);
+  const Toon *value = find(view, helper_toon::hash_key(view));
+  return value ? *value : static_null();
+}
+
+const Toon &ToonObject::operator[](const Key &key) const {
+  const Toon *value = find(key, key.hash());
+  return value ? *value : static_null();
+}
+
+const Toon::object &ToonObject::object_items() const {
+  std::call_once(m_materialized, [this] {
+    for (const auto &m : m_members)
+      m_map.emplace_hint(m_map.end(), m.first, m.second);
+    m_map_built = true;
+  });
+  return m_map;
+}
+
+// Objects compare as key/value sets, whatever their member order.
+bool ToonObject::equals(const ToonValue *other) const {
+  const Toon::members &theirs = other->object_members();
+  if (m_members.size() != theirs.size())
+    return false;
+  if (!m_ordered && !static_cast<const ToonObject *>(other)->m_ordered)
+    return m_members == theirs;
+  return object_items() == other->object_items();
+}
+
+bool ToonObject::less(const ToonValue *other) const {
+  if (!m_ordered && !static_cast<const ToonObject *>(other)->m_ordered)
+    return m_members < other->object_members();
+  return object_items() < other->object_items();
+}
+
+Toon::Toon() noexcept : m_storage(S_NULL) {}
+Toon::Toon(std::nullptr_t) noexcept : m_storage(S_NULL) {}
+Toon::Toon(double value) : m_double(value), m_storage(S_DOUBLE) {}
+Toon::Toon(int value) : m_int64(value), m_storage(S_INT64) {}
+Toon::Toon(long value) : m_int64(value), m_storage(S_INT64) {}
+Toon::Toon(long long value) : m_int64(value), m_storage(S_INT64) {}
+Toon::Toon(unsigned value) : m_int64(value), m_storage(S_INT64) {}
+Toon::Toon(unsigned long value)
+    : Toon(static_cast<unsigned long long>(value)) {}
+Toon::Toon(unsigned long long value) {
+  if (value > static_cast<uint64_t>(INT64_MAX)) {
+    m_uint64 = value;
+    m_storage = S_UINT64;
+  } else {
+    m_int64 = static_cast<int64_t>(value);
+    m_storage = S_INT64;
+  }
+}
+Toon::Toon(bool value) : m_bool(value), m_storage(S_BOOL) {}
+Toon::Toon(const string &value) : Toon(make_shared<ToonString>(value)) {}
+Toon::Toon(string &&value) : Toon(make_shared<ToonString>(move(value))) {}
+Toon::Toon(const char *value) : Toon(make_shared<ToonString>(value)) {}
+Toon::Toon(const Toon::array &values) : Toon(make_shared<ToonArray>(values)) {}
+Toon::Toon(Toon::array &&values)
+    : Toon(make_shared<ToonArray>(move(values))) {}
+Toon::Toon(const Toon::object &values)
+    : Toon(make_shared<ToonObject>(
+          Toon::members(values.begin(), values.end()), false)) {}
+Toon::Toon(Toon::object &&values) : m_storage(S_NULL) {
+  Toon::members members;
+  members.reserve(values.size());
+  for (auto &kv : values)
+    members.emplace_back(kv.first, move(kv.second));
+  *this = from_members(move(members));
+}
+Toon::Toon(std::shared_ptr<ToonValue> &&ptr) noexcept
+    : m_ptr(move(ptr)), m_storage(S_PTR) {}
+
+Toon::Toon(const Toon &other) noexcept : m_storage(other.m_storage) {
+  if (m_storage == S_PTR)
+    new (&m_ptr) std::shared_ptr<ToonValue>(other.m_ptr);
+  else
+    memcpy(&m_uint64, &other.m_uint64, sizeof m_uint64); // any scalar
+}
+
+Toon::Toon(Toon &&other) noexcept : m_storage(other.m_storage) {
+  if (m_storage == S_PTR) {
+    new (&m_ptr) std::shared_ptr<ToonValue>(move(other.m_ptr));
+    other.m_ptr.~shared_ptr();
+    other.m_storage = S_NULL;
+  } else {
+    memcpy(&m_uint64, &other.m_uint64, sizeof m_uint64);
+  }
+}
+
+Toon &Toon::operator=(const Toon &other) noexcept {
+  Toon copy(other);
+  return *this = move(copy);
+}
+
+Toon &Toon::operator=(Toon &&other) noexcept {
+  if (this != &other) {
+    // `other` may live inside this value: take it before releasing ours.
+    Toon taken(move(other));
+    this->~Toon();
+    new (this) Toon(move(taken));
+  }
+  return *this;
+}
+
+Toon::~Toon() {
+  if (m_storage == S_PTR)
+    m_ptr.~shared_ptr();
+}
+
+Toon Toon::table(vector<string> keys, Toon::array cells) {
+  if (keys.empty())
+    return Toon(Toon::array());
+  if (size_t partial = cells.size() % keys.size())
+    cells.resize(cells.size() + keys.size() - partial);
+  return Toon(make_shared<ToonTable>(move(keys), move(cells)));
+}
+
+Toon Toon::from_members(Toon::members values, bool preserve_order) {
+  return Toon(make_shared<ToonObject>(move(values), preserve_order));
+}
+
+/* Editing */
+
+void Toon::unwrap_lazy() {
+  if (m_storage == S_PTR && m_ptr->resolved() != m_ptr.get()) {
+    Toon built = static_cast<const ToonLazy *>(m_ptr.get())->m_value;
+    *this = move(built);
+  }
+}
+
+ToonArray &Toon::own_array() {
+  unwrap_lazy();
+  if (!is_array()) {
+    *this = Toon(array());
+  } else if (is_table()) {
+    // The row objects are built once, then moved out if nobody else can
+    // see them.
+    const array &rows = m_ptr->array_items();
+    array copy = m_ptr.use_count() == 1
+                     ? move(static_cast<ToonTable *>(m_ptr.get())->m_objects)
+                     : rows;
+    *this = Toon(move(copy));
+  } else if (m_ptr.use_count() > 1) {
+    *this = Toon(array(m_ptr->array_items()));
+  }
+  ToonArray *arr = static_cast<ToonArray *>(m_ptr.get());
+  arr->m_hash.reset();
+  return *arr;
+}
+
+ToonObject &Toon::own_object() {
+  unwrap_lazy();
+  if (!is_object())
+    *this = from_members(members());
+  ToonObject *obj = static_cast<ToonObject *>(m_ptr.get());
+  // A built object_items() map cannot be updated, so it is dropped along
+  // with the node.
+  if (m_ptr.use_count() > 1 || obj->m_map_built) {
+    const bool ordered = obj->m_ordered;
+    members copy =
+        m_ptr.use_count() > 1 ? obj->m_members : move(obj->m_members);
+    *this = from_members(move(copy), ordered);
+    obj = static_cast<ToonObject *>(m_ptr.get());
+  }
+  obj->m_hash.reset();
+  return *obj;
+}
+
+Toon::array &Toon::mutable_array() { return own_array().m_value; }
+
+void Toon::push_back(Toon value) { own_array().m_value.push_back(move(value)); }
+
+Toon &Toon::mutable_member(const Key &key) { return own_object().at(key); }
+
+void Toon::set(const Key &key, Toon value) {
+  own_object().at(key) = move(value);
+}
+
+bool Toon::erase(const Key &key) {
+  // Nothing to copy when there is nothing to erase.
+  if (!is_object() || &(*this)[key] == &static_null())
+    return false;
+  return own_object().erase(key);
+}
+
+Toon::array Toon::take_array() && {
+  array out = move(own_array().m_value);
+  *this = Toon();
+  return out;
+}
+
+Toon::members Toon::take_members() && {
+  members out = move(own_object().m_members);
+  *this = Toon();
+  return out;
+}
+
+Toon::object Toon::take_object() && {
+  object out;
+  for (auto &m : std::move(*this).take_members())
+    out.emplace_hint(out.end(), m.first.str(), move(m.second));
+  return out;
+}
+
+const ToonValue *Toon::value() const {
+  return m_storage == S_PTR ? m_ptr.get() : &statics().null;
+}
+
+Toon::Type Toon::type() const {
+  switch (m_storage) {
+  case S_NULL:
+    return NUL;
+  case S_BOOL:
+    return BOOL;
+  case S_PTR:
+    return m_ptr->type();
+  default:
+    return NUMBER;
+  }
+}
+
+bool Toon::is_integer() const {
+  return m_storage == S_INT64 || m_storage == S_UINT64;
+}
+
+double Toon::number_value() const {
+  switch (m_storage) {
+  case S_INT64:
+    return static_cast<double>(m_int64);
+  case S_UINT64:
+    return static_cast<double>(m_uint64);
+  case S_DOUBLE:
+    return m_double;
+  default:
+    return 0;
+  }
+}
+
+int Toon::int_value() const {
+  return m_storage == S_DOUBLE ? static_cast<int>(m_double)
+                               : static_cast<int>(int64_value());
+}
+
+int64_t Toon::int64_value() const {
+  switch (m_storage) {
+  case S_INT64:
+    return m_int64;
+  case S_UINT64:
+    return static_cast<int64_t>(m_uint64);
+  case S_DOUBLE:
+    return static_cast<int64_t>(m_double);
+  default:
+    return 0;
+  }
+}
+
+uint64_t Toon::uint64_value() const {
+  switch (m_storage) {
+  case S_INT64:
+    return static_cast<uint64_t>(m_int64);
+  case S_UINT64:
+    return m_uint64;
+  case S_DOUBLE:
+    return static_cast<uint64_t>(m_double);
+  default:
+    return 0;
+  }
+}
+
+bool Toon::bool_value() const { return m_storage == S_BOOL && m_bool; }
+const string &Toon::string_value() const { return value()->string_value(); }
+const Toon::array &Toon::array_items() const { return value()->array_items(); }
+const Toon::object &Toon::object_items() const {
+  return value()->object_items();
+}
+const Toon::members &Toon::object_members() const {
+  return value()->object_members();
+}
+const Toon &Toon::operator[](size_t i) const { return (*value())[i]; }
+const Toon &Toon::operator[](const string &key) const {
+  return (*value())[key];
+}
+const Toon &Toon::operator[](const Key &key) const { return (*value())[key]; }
+bool Toon::is_table() const { return value()->is_table(); }
+const vector<string> &Toon::table_keys() const {
+  return value()->table_keys();
+}
+size_t Toon::table_rows() const { return value()->table_rows(); }
+const Toon &Toon::table_cell(size_t row, size_t col) const {
+  return value()->table_cell(row, col);
+}
+
+const string &ToonValue::string_value() const { return statics().empty_string; }
+const Toon::array &ToonValue::array_items() const {
+  return statics().empty_vector;
+}
+const Toon::object &ToonValue::object_items() const {
+  return statics().empty_map;
+}
+const Toon::members &ToonValue::object_members() const {
+  return statics().empty_members;
+}
+const Toon &ToonValue::operator[](size_t) const {
+  static const Toon null;
+  return null;
+}
+const Toon &ToonValue::operator[](const string &) const {
+  static const Toon null;
+  return null;
+}
+const Toon &ToonValue::operator[](const Key &) const { return static_null(); }
+bool ToonValue::is_table() const { return false; }
+const ToonValue *ToonValue::resolved() const { return this; }
+uint64_t ToonValue::cached_hash() const { return 0; }
+const vector<string> &ToonValue::table_keys() const {
+  return statics().empty_keys;
+}
+size_t ToonValue::table_rows() const { return 0; }
+const Toon &ToonValue::table_cell(size_t, size_t) const {
+  return static_null();
+}
+
+// Both sides hold integers: compares them exactly. S_UINT64 values are
+// above every S_INT64 one.
+int Toon::compare_integers(const Toon &other) const {
+  if (m_storage != other.m_storage)
+    return m_storage == S_UINT64 ? 1 : -1;
+  if (m_storage == S_INT64)
+    return m_int64 < other.m_int64 ? -1 : (other.m_int64 < m_int64 ? 1 : 0);
+  return m_uint64 < other.m_uint64 ? -1 : (other.m_uint64 < m_uint64 ? 1 : 0);
+}
+
+bool Toon::operator==(const Toon &other) const {
+  if (m_storage == S_PTR && other.m_storage == S_PTR && m_ptr == other.m_ptr)
+    return true;
+  const Type t = type();
+  if (t != other.type())
+    return false;
+  switch (t) {
+  case NUL:
+    return true;
+  case BOOL:
+    return m_bool == other.m_bool;
+  case NUMBER:
+    if (is_integer() && other.is_integer())
+      return compare_integers(other) == 0;
+    return number_value() == other.number_value();
+  default: {
+    const ToonValue *a = m_ptr->resolved();
+    const ToonValue *b = other.m_ptr->resolved();
+    if (a == b)
+      return true;
+    // Values that have been hashed before are told apart without a walk.
+    const uint64_t ha = a->cached_hash(), hb = b->cached_hash();
+    if (ha && hb && ha != hb)
+      return false;
+    return a->equals(b);
+  }
+  }
+}
+
+uint64_t Toon::hash() const {
+  switch (m_storage) {
+  case S_NULL:
+    return hash_of(nullptr);
+  case S_BOOL:
+    return hash_scalar(BOOL, m_bool);
+  case S_INT64:
+  case S_UINT64:
+  case S_DOUBLE:
+    return hash_of(number_value());
+  case S_PTR:
+    break;
+  }
+  return m_ptr->resolved()->hash();
+}
+
+bool Toon::operator<(const Toon &other) const {
+  if (m_storage == S_PTR && other.m_storage == S_PTR && m_ptr == other.m_ptr)
+    return false;
+  const Type t = type();
+  if (t != other.type())
+    return t < other.type();
+  switch (t) {
+  case NUL:
+    return false;
+  case BOOL:
+    return m_bool < other.m_bool;
+  case NUMBER:
+    if (is_integer() && other.is_integer())
+      return compare_integers(other) < 0;
+    return number_value() < other.number_value();
+  default:
+    return m_ptr->resolved()->less(other.m_ptr->resolved());
+  }
+}
+
+/* Nesting limit */
+
+static string too_deep(size_t limit) {
+  return "nesting deeper than " + std::to_string(limit) + " levels";
+}
+
+// Counts one level of nesting for as long as it is in scope.
+struct Nested {
+  explicit Nested(size_t &counter) : counter(counter) { ++counter; }
+  ~Nested() { --counter; }
+  size_t &counter;
+};
+
+/* Parser Implementation */
+
+// The parser is written once against a Builder policy that decides how
+// values are materialized: ToonBuilder produces the shared_ptr based Toon
+// tree, DocBuilder writes nodes into a Document arena. Strings reach the
+// builder either as a StringView into the input (no escapes) or as a
+// decoded scratch buffer.
+// Builders for which the arrays and objects nested under keys are only
+// skimmed, see LazyBuilder.
+struct LazyBuilder;
+template <class Builder> struct DefersBlocks : std::false_type {};
+template <> struct DefersBlocks<LazyBuilder> : std::true_type {};
+// Builders that only need to know where values end, see SkimBuilder.
+struct SkimBuilder;
+template <class Builder> struct Skims : std::false_type {};
+template <> struct Skims<SkimBuilder> : std::true_type {};
+
+template <class Builder> struct ToonParser {
+  typedef typename Builder::value_type value_type;
+  typedef typename Builder::key_type key_type;
+
+  const char *str;
+  size_t len;
+  size_t i;
+  string &err;
+  bool failed;
+  Builder &build;
+  string scratch;
+  vector<key_type> header_keys; // reused by the outermost array header
+
+  // Line tracking: every consumed '\n' goes through newline(), so the start
+  // of the current line is always known and get_indent() does not have to
+  // search backwards for it.
+  size_t line_no;
+  size_t line_start;
+  size_t indent_line; // line_start the cached indent belongs to
+  int indent;
+
+  // Arrays and objects open around i, and how many may be.
+  size_t nesting;
+  const size_t nesting_limit;
+
+  TOON_STATS_ONLY(ParseStats *stats = nullptr; size_t depth = 0;
+                  bool timing_table = false; bool timing_unescape = false;)
+
+  ToonParser(const char *data, size_t size, string &err_out, Builder &b,
+             size_t max_depth = kDefaultMaxDepth)
+      : str(data), len(size), i(0), err(err_out), failed(false), build(b),
+        line_no(1), line_start(0), indent_line(size_t(-1)), indent(0),
+        nesting(0), nesting_limit(max_depth) {}
+
+  // Swaps the reusable buffers with a caller's, before and after a parse,
+  // so their capacity outlives the parser.
+  void lend(string &buffer, vector<key_type> &keys) {
+    scratch.swap(buffer);
+    header_keys.swap(keys);
+  }
+
+  value_type fail(string &&msg) {
+    if (!failed) {
+      err = std::move(msg);
+      err += " at line " + std::to_string(line_no) + ", column " +
+             std::to_string(i - line_start + 1);
+    }
+    failed = true;
+    return build.make_null();
+  }
+
+  // Called with i just past a '\n'.
+  void newline() {
+    line_no++;
+    line_start = i;
+  }
+
+  // Accounts for newlines skipped inside s[from, to) by scans that are not
+  // line-aware (keys and headers spanning lines in malformed input).
+  void skipped(size_t from, size_t to) {
+    while (const char *nl =
+               static_cast<const char *>(memchr(str + from, '\n', to - from))) {
+      from = nl - str + 1;
+      line_no++;
+      line_start = from;
+    }
+  }
+
+  bool match(const char *literal, size_t n) const {
+    return len - i >= n && memcmp(str + i, literal, n) == 0;
+  }
+
+  void consume_whitespace() {
+    while (i < len && (str[i] == ' ' || str[i] == '\r' || str[i] == '\t'))
+      i++;
+  }
+
+  void consume_garbage() {
+    while (true) {
+      consume_whitespace();
+      if (i < len && str[i] == '#') { // Comment
+        const char *nl =
+            static_cast<const char *>(memchr(str + i, '\n', len - i));
+        i = nl ? nl - str : len;
+      } else if (i < len && str[i] == '\n') {
+        i++;
+        newline();
+      } else {
+        break;
+      }
+    }
+  }
+
+  char get_next_token() {
+    consume_whitespace();
+    if (i == len)
+      return 0;
+    return str[i++];
+  }
+
+  int get_indent() {
+    if (indent_line != line_start) {
+      int count = 0;
+      size_t start = line_start;
+      while (start < len && (str[start] == ' ' || str[start] == '\t')) {
+        count += (str[start] == '\t' ? 8 : 1); // rough tab approximation
+        start++;
+      }
+      indent = count;
+      indent_line = line_start;
+    }
+    return indent;
+  }
+
+  value_type parse_root() {
+    consume_garbage();
+    if (i == len)
+      return build.make_null();
+
+    // If it starts with [ it is definitely not a top-level object
+    if (str[i] == '[')
+      return parse_value();
+
+    // If it contains : it might be an object, but we need to check if it's
+    // not inside quotes/brackets For simplicity, let's assume if it has : and
+    // doesn't start with [, it's an object. Actually, unquoted strings could
+    // contain :? No, : is a special char.
+    if (memchr(str, ':', len) != nullptr)
+      return parse_object(-1);
+    return parse_value();
+  }
+
+  value_type parse_value() {
+    consume_whitespace();
+    if (i == len)
+      return fail("unexpected end of input");
+
+    char ch = str[i];
+    if (ch == '"')
+      return parse_quoted_string();
+    if (ch == '[')
+      return parse_array();
+
+    // Check for special keywords
+    TOON_STAT(stats->nodes++);
+    if (ch == 'n' && match("null", 4)) {
+      i += 4;
+      return build.make_null();
+    }
+    if (ch == 't' && match("true", 4)) {
+      i += 4;
+      return build.make_bool(true);
+    }
+    if (ch == 'f' && match("false", 5)) {
+      i += 5;
+      return build.make_bool(false);
+    }
+
+    if (isdigit(ch) || ch == '-')
+      return parse_number();
+
+    return parse_unquoted_string();
+  }
+
+  value_type parse_quoted_string() {
+    i++; // skip "
+    size_t start = i;
+    i = helper_toon::scan(str, i, len, helper_toon::QUOTE_ESCAPE);
+    while (i < len && str[i] == '\n') { // raw newline inside the quotes
+      i++;
+      newline();
+      i = helper_toon::scan(str, i, len, helper_toon::QUOTE_ESCAPE);
+    }
+    TOON_STAT(stats->nodes++, stats->strings++);
+    if (i < len && str[i] == '"') {
+      // No escapes: hand the builder a view of the input.
+      StringView view(str + start, i - start);
+      TOON_STAT(stats->string_bytes += view.size());
+      i++; // skip "
+      return build.make_string(view);
+    }
+
+    TOON_STAT(stats->unescaped++);
+    TOON_STATS_ONLY(StatsTimer timer(stats ? &stats->unescape_ms : nullptr,
+                                     timing_unescape);)
+    string &out = scratch;
+    out.assign(str + start, i - start);
+    while (i < len && str[i] != '"') {
+      if (str[i] == '\\') {
+        i++;
+        if (i < len && str[i] == 'u') {
+          i++; // skip u
+          string unicode_err;
+          uint32_t cp =
+              helper_toon::parse_unicode_codepoint(str, len, i, unicode_err);
+          if (!unicode_err.empty())
+            return fail(std::move(unicode_err));
+          // Combine a UTF-16 surrogate pair into a single codepoint.
+          if (cp >= 0xd800 && cp <= 0xdbff && match("\\u", 2)) {
+            size_t saved = i;
+            i += 2;
+            uint32_t lo =
+                helper_toon::parse_unicode_codepoint(str, len, i, unicode_err);
+            if (unicode_err.empty() && lo >= 0xdc00 && lo <= 0xdfff)
+              cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+            else
+              i = saved;
+          }
+          helper_toon::encode_utf8(cp, out);
+          continue;
+        }
+        if (i == len)
+          return fail("unfinished escape");
+        char esc = str[i++];
+        if (esc == 'n')
+          out += '\n';
+        else if (esc == 'r')
+          out += '\r';
+        else if (esc == 't')
+          out += '\t';
+        else if (esc == 'b')
+          out += '\b';
+        else if (esc == 'f')
+          out += '\f';
+        else if (esc == '"' || esc == '\\' || esc == '/')
+          out += esc;
+        else {
+          i -= 2; // report the position of the backslash
+          return fail("invalid escape");
+        }
+      } else if (str[i] == '\n') {
+        out += str[i++];
+        newline();
+      } else {
+        size_t run = helper_toon::scan(str, i, len, helper_toon::QUOTE_ESCAPE);
+        out.append(str + i, run - i);
+        i = run;
+      }
+    }
+    if (i == len)
+      return fail("unfinished string");
+    i++; // skip "
+    TOON_STAT(stats->string_bytes += out.size());
+    return build.make_decoded_string(out);
+  }
+
+  value_type parse_unquoted_string() {
+    size_t start = i;
+    i = helper_toon::scan(str, i, len, helper_toon::SPECIAL);
+    if (Skims<Builder>::value)
+      return build.make_null();
+    // Trim trailing whitespace
+    size_t end = i;
+    while (end > start && (str[end - 1] == ' ' || str[end - 1] == '\t' ||
+                           str[end - 1] == '\r'))
+      end--;
+    TOON_STAT(stats->strings++, stats->string_bytes += end - start);
+    return build.make_string(StringView(str + start, end - start));
+  }
+
+  value_type parse_number() {
+    size_t start = i;
+    while (i < len && (isdigit(str[i]) || str[i] == '.' || str[i] == '-' ||
+                       str[i] == '+' || str[i] == 'e' || str[i] == 'E'))
+      i++;
+    if (Skims<Builder>::value)
+      return build.make_null();
+    bool negative;
+    uint64_t magnitude;
+    if (helper_toon::parse_integer(str + start, i - start, negative,
+                                   magnitude)) {
+      if (!negative)
+        return build.make_uint(magnitude);
+      // "-0" and values below INT64_MIN are read as doubles.
+      if (magnitude != 0 && magnitude <= uint64_t(1) << 63)
+        return build.make_int(static_cast<int64_t>(0 - magnitude));
+    }
+    double val = 0;
+    helper_toon::parse_double(str + start, i - start, val);
+    return build.make_number(val);
+  }
+
+  // Parses an array header, `[N]:` or `[{k1, k2}]:`, starting at '['.
+  // Returns true for tabular headers, whose keys are appended to `keys`;
+  // otherwise `count` is the declared length (-1 when missing).
+  bool parse_header(vector<key_type> &keys, int &count) {
+    size_t header_start = i;
+    i++; // skip [
+    bool tabular = false;
+    count = -1;
+
+    // 1. Parsing dell'header: [N] oppure [{k1, k2}]
+    if (i < len && str[i] == '{') {
+      tabular = true;
+      i++; // skip {
+      while (i < len && str[i] != '}') {
+        consume_whitespace();
+        size_t first = i;
+        while (i < len && str[i] != ',' && str[i] != '}')
+          i++;
+
+        // Trim key
+        size_t last = i;
+        while (first < last && str[first] == ' ')
+          first++;
+        while (last > first && str[last - 1] == ' ')
+          last--;
+        if (first < last)
+          keys.push_back(build.make_key(StringView(str + first, last - first)));
+
+        if (i < len && str[i] == ',')
+          i++;
+      }
+      if (i < len)
+        i++; // skip }
+    } else {
+      long n = -1;
+      while (i < len && isdigit(str[i])) {
+        n = (n < 0 ? 0 : n) * 10 + (str[i++] - '0');
+        if (n > std::numeric_limits<int>::max()) {
+          fail("array length out of range");
+          return false;
+        }
+      }
+      count = static_cast<int>(n);
+    }
+
+    // Skip closing bracket and optional colon
+    while (i < len && str[i] != ']')
+      i++;
+    if (i < len)
+      i++; // skip ]
+    if (i < len && str[i] == ':')
+      i++;
+    skipped(header_start, i);
+    return tabular;
+  }
+
+  value_type parse_array(int parent_indent = -1) {
+    const Nested level(nesting);
+    if (nesting > nesting_limit)
+      return fail(too_deep(nesting_limit));
+    TOON_STAT(stats->nodes++);
+    TOON_STATS_ONLY(StatsDepth counted(stats, depth);)
+    // Arrays nested in this one find header_keys empty and allocate.
+    vector<key_type> keys;
+    keys.swap(header_keys);
+    value_type result = parse_array(keys, parent_indent);
+    keys.clear();
+    keys.swap(header_keys);
+    return result;
+  }
+
+  value_type parse_array(vector<key_type> &keys, int parent_indent) {
+    int count;
+    bool tabular = parse_header(keys, count);
+    if (failed)
+      return build.make_null();
+
+    // 2. Parsing del corpo
+    if (tabular)
+      return parse_table(keys, parent_indent);
+
+    typename Builder::array_type arr = build.begin_array();
+
+    // Modalità Standard [N]: v1, v2, ...
+    // Qui l'indentazione è meno rilevante perché abbiamo il count esplicito,
+    // ma è comunque utile consumare whitespace correttamente.
+    for (int k = 0; count < 0 || k < count; ++k) {
+      consume_garbage(); // Importante per array multilinea
+
+      if (i == len)
+        break;
+
+      // Check opzionale: se siamo in array senza count esplicito (se mai
+      // supportato) potremmo usare la stessa logica dell'indentazione qui.
+      // Per ora ci fidiamo di 'count'.
+
+      build.push(arr, parse_value());
+
+      consume_whitespace();
+      if (i < len && str[i] == ',')
+        i++;
+      else if (count < 0) // Se count non c'è, stop al primo che non ha
+                          // virgola (o newline)
+        break;
+    }
+    return build.end_array(arr);
+  }
+
+  // Rows of a `[{k1, k2}]:` table, read while they are indented deeper than
+  // the parent.
+  value_type parse_table(vector<key_type> &keys, int parent_indent) {
+    TOON_STATS_ONLY(StatsTimer timer(stats ? &stats->table_ms : nullptr,
+                                     timing_table);)
+    typename Builder::table_type table = build.begin_table(keys);
+    // In modalità tabulare, leggiamo finché l'indentazione regge
+    while (i < len) {
+      consume_garbage(); // Salta commenti e newlines precedenti
+
+      // Se siamo alla fine del file, stop
+      if (i == len)
+        break;
+
+      // Verifica Indentazione
+      // Salviamo la posizione corrente per fare il peek dell'indentazione
+      size_t row_start_index = i;
+      int current_indent = get_indent();
+
+      // LOGICA CRITICA:
+      // Se l'indentazione della nuova riga è <= all'indentazione del
+      // genitore, significa che l'array tabulare è finito e siamo tornati al
+      // livello superiore. Nota: parent_indent == -1 significa root, quindi
+      // accettiamo tutto.
+      if (parent_indent != -1 && current_indent <= parent_indent) {
+        // Ripristiniamo l'indice in modo che il genitore possa leggere questa
+        // riga
+        i = row_start_index;
+        break;
+      }
+
+      // Se l'indentazione è valida, parsiamo la riga
+      bool row_failed = false;
+
+      for (size_t j = 0; j < keys.size(); ++j) {
+        consume_whitespace();
+
+        // Gestione fine inaspettata della riga
+        if (i == len || str[i] == '\n') {
+          // Se mancano colonne, decidiamo se fallire o mettere null.
+          // Qui interrompiamo la riga.
+          row_failed = true;
+          break;
+        }
+
+        value_type val = parse_value();
+        if (failed)
+          return build.make_null(); // Propaga errore critico
+
+        build.push_cell(table, std::move(val));
+        consume_whitespace();
+
+        // Salta la virgola se presente tra le colonne
+        if (j < keys.size() - 1 && i < len && str[i] == ',')
+          i++;
+      }
+
+      if (!row_failed) {
+        build.end_row(table);
+        TOON_STAT(stats->table_rows++);
+      } else {
+        // Se la riga è fallita o incompleta, potremmo voler uscire
+        // o semplicemente ignorarla. Qui usciamo per sicurezza.
+        build.abandon_row(table);
+        break;
+      }
+
+      // A row that consumed nothing would never advance.
+      if (i == row_start_index)
+        break;
+    }
+    return build.end_table(table);
+  }
+
+  // The array or object under a key, parsed with the parent's indentation.
+  value_type parse_block(int parent_indent, bool array) {
+    return parse_block(parent_indent, array, DefersBlocks<Builder>());
+  }
+  value_type parse_block(int parent_indent, bool array, std::false_type) {
+    return array ? parse_array(parent_indent) : parse_object(parent_indent);
+  }
+  value_type parse_block(int parent_indent, bool array, std::true_type);
+
+  value_type parse_object(int parent_indent) {
+    const Nested level(nesting);
+    if (nesting > nesting_limit)
+      return fail(too_deep(nesting_limit));
+    TOON_STAT(stats->nodes++);
+    TOON_STATS_ONLY(StatsDepth counted(stats, depth);)
+    typename Builder::object_type obj = build.begin_object();
+    bool empty = true;
+    while (i < len) {
+      consume_garbage();
+      size_t saved_i = i;
+      int current_indent = get_indent();
+
+      // Controllo uscita dall'oggetto corrente
+      if (current_indent <= parent_indent && !empty) {
+        i = saved_i;
+        break;
+      }
+
+      size_t key_start = i;
+      const char *colon =
+          static_cast<const char *>(memchr(str + i, ':', len - i));
+      if (!colon) {
+        i = len;
+        break;
+      }
+      i = colon - str;
+      skipped(key_start, i);
+      key_type key = build.make_key(StringView(str + key_start, i - key_start));
+      i++; // skip :
+
+      consume_whitespace();
+
+      if (i < len && str[i] == '\n') {
+        // Valore su una nuova riga (nested object o array)
+        i++; // skip \n
+        newline();
+        consume_garbage(); // posizionati all'inizio della riga successiva
+
+        if (i < len && str[i] == '[') {
+          // PASSAGGIO CHIAVE: passiamo current_indent
+          // Solitamente l'array è indentato rispetto alla chiave che lo
+          // contiene. Se la sintassi è: key:
+          //   [3]: ...
+          // Allora l'indentazione della riga annidata è maggiore.
+          build.set(obj, key, parse_block(current_indent, true));
+        } else {
+          build.set(obj, key, parse_block(current_indent, false));
+        }
+      } else {
+        // Valore inline
+        if (i < len && str[i] == '[') {
+          // Array inline sulla stessa riga: key: [3]: ...
+          // In questo caso passiamo current_indent perché fa parte della stessa
+          // riga logica
+          build.set(obj, key, parse_block(current_indent, true));
+        } else {
+          build.set(obj, key, parse_value());
+        }
+      }
+      empty = false;
+    }
+    return build.end_object(obj);
+  }
+};
+
+// Builds the shared_ptr based Toon tree.
+struct ToonBuilder {
+  typedef Toon value_type;
+  typedef Key key_type;
+  typedef Toon::array array_type;
+  typedef Toon::members object_type;
+
+  ToonBuilder(bool preserve_order, KeyTable &keys)
+      : preserve_order(preserve_order), keys(keys), cached(0) {}
+  bool preserve_order;
+  KeyTable &keys;
+  // Keys already interned by this parse, open addressing; an empty Key
+  // marks a free slot. Repeated keys are served from here without taking
+  // the table's lock.
+  vector<Key> cache;
+  size_t cached;
+
+  Toon make_null() { return Toon(); }
+  Toon make_bool(bool value) { return Toon(value); }
+  Toon make_number(double value) { return Toon(value); }
+  Toon make_int(int64_t value) { return Toon(value); }
+  Toon make_uint(uint64_t value) { return Toon(value); }
+  Toon make_string(StringView value) {
+    return Toon(string(value.data(), value.size()));
+  }
+  Toon make_decoded_string(string &value) { return Toon(move(value)); }
+  Key make_key(StringView text) {
+    if (text.empty())
+      return keys.intern(text);
+    const uint32_t hash = helper_toon::hash_key(text);
+    if (cached * 2 >= cache.size())
+      grow_cache();
+    const size_t mask = cache.size() - 1;
+    size_t slot = hash & mask;
+    for (; !cache[slot].str().empty(); slot = (slot + 1) & mask) {
+      if (cache[slot].hash() == hash && cache[slot] == text)
+        return cache[slot];
+    }
+    cache[slot] = keys.intern(text);
+    cached++;
+    return cache[slot];
+  }
+  void grow_cache() {
+    vector<Key> grown(cache.empty() ? 64 : cache.size() * 2);
+    const size_t mask = grown.size() - 1;
+    for (Key &key : cache) {
+      if (key.str().empty())
+        continue;
+      size_t slot = key.hash() & mask;
+      while (!grown[slot].str().empty())
+        slot = (slot + 1) & mask;
+      grown[slot] = move(key);
+    }
+    cache.swap(grown);
+  }
+
+  array_type begin_array() { return array_type(); }
+  void push(array_type &arr, Toon &&value) { arr.push_back(move(value)); }
+  Toon end_array(array_type &arr) { return Toon(move(arr)); }
+
+  object_type begin_object() { return object_type(); }
+  void set(object_type &obj, const Key &key, Toon &&value) {
+    obj.emplace_back(key, move(value));
+  }
+  Toon end_object(object_type &obj) {
+    return Toon::from_members(move(obj), preserve_order);
+  }
+
+  // Tables keep the header keys once and the cells row-major.
+  struct table_type {
+    vector<string> keys;
+    Toon::array cells;
+    size_t row_start;
+  };
+  table_type begin_table(const vector<Key> &header) {
+    table_type t;
+    t.keys.assign(header.begin(), header.end());
+    t.row_start = 0;
+    return t;
+  }
+  void push_cell(table_type &t, Toon &&value) {
+    t.cells.push_back(move(value));
+  }
+  void end_row(table_type &t) { t.row_start = t.cells.size(); }
+  void abandon_row(table_type &t) { t.cells.resize(t.row_start); }
+  Toon end_table(table_type &t) {
+    return Toon::table(move(t.keys), move(t.cells));
+  }
+};
+
+/* Lazy parsing
+ *
+ * parse_lazy() runs the parser with a LazyBuilder, which does not build the
+ * arrays and objects nested under keys. Each one is first run through a
+ * ToonParser<SkimBuilder>, which checks it and finds its end without
+ * building anything. The parser then skips over it and records a ToonLazy
+ * holding its position and parser state in the shared LazySource. Errors
+ * therefore surface from parse_lazy() exactly as from parse(). The first
+ * accessor call on a ToonLazy resumes the parser from that state, with a
+ * LazyBuilder again, so each level is built only once it is reached.
+ */
+
+struct SkimBuilder {
+  struct value_type {};
+  typedef value_type key_type;
+  typedef value_type array_type;
+  typedef value_type object_type;
+  typedef value_type table_type;
+
+  value_type make_null() { return value_type(); }
+  value_type make_bool(bool) { return value_type(); }
+  value_type make_number(double) { return value_type(); }
+  value_type make_int(int64_t) { return value_type(); }
+  value_type make_uint(uint64_t) { return value_type(); }
+  value_type make_string(StringView) { return value_type(); }
+  value_type make_decoded_string(string &) { return value_type(); }
+  key_type make_key(StringView) { return key_type(); }
+  array_type begin_array() { return array_type(); }
+  void push(array_type &, value_type &&) {}
+  value_type end_array(array_type &) { return value_type(); }
+  object_type begin_object() { return object_type(); }
+  void set(object_type &, const key_type &, value_type &&) {}
+  value_type end_object(object_type &) { return value_type(); }
+  table_type begin_table(const vector<key_type> &) { return table_type(); }
+  void push_cell(table_type &, value_type &&) {}
+  void end_row(table_type &) {}
+  void abandon_row(table_type &) {}
+  value_type end_table(table_type &) { return value_type(); }
+};
+
+struct LazySource {
+  LazySource(string &&text, bool preserve_order)
+      : text(move(text)), preserve_order(preserve_order) {}
+  const string text;
+  KeyTable keys;
+  const bool preserve_order;
+};
+
+struct LazyBuilder : ToonBuilder {
+  explicit LazyBuilder(const shared_ptr<LazySource> &source)
+      : ToonBuilder(source->preserve_order, source->keys), source(source) {}
+  shared_ptr<LazySource> source;
+};
+
+template <class Builder>
+typename ToonParser<Builder>::value_type
+ToonParser<Builder>::parse_block(int parent_indent, bool array,
+                                 std::true_type) {
+  SkimBuilder skim;
+  ToonParser<SkimBuilder> skimmer(str, len, err, skim, nesting_limit);
+  skimmer.i = i;
+  skimmer.line_no = line_no;
+  skimmer.line_start = line_start;
+  skimmer.failed = failed;
+  skimmer.nesting = nesting;
+  if (array)
+    skimmer.parse_array(parent_indent);
+  else
+    skimmer.parse_object(parent_indent);
+  ToonLazy::State at = {i, line_no, line_start, parent_indent};
+  i = skimmer.i;
+  line_no = skimmer.line_no;
+  line_start = skimmer.line_start;
+  if (skimmer.failed) {
+    failed = true;
+    return build.make_null();
+  }
+  return ToonLazy::make(build.source, at, array);
+}
+
+const ToonValue *ToonLazy::resolved() const {
+  std::call_once(m_parsed, [this] {
+    string err;
+    LazyBuilder builder(m_source);
+    ToonParser<LazyBuilder> parser(m_source->text.data(),
+                                   m_source->text.size(), err, builder);
+    parser.i = m_at.i;
+    parser.line_no = m_at.line_no;
+    parser.line_start = m_at.line_start;
+    m_value = m_array ? parser.parse_array(m_at.parent_indent)
+                      : parser.parse_object(m_at.parent_indent);
+    m_source.reset(); // the text stays alive while other nodes need it
+  });
+  return m_value.value();
+}
+
+Toon Toon::parse_lazy(string in, string &err, ToonParse strategy) {
+  shared_ptr<LazySource> source =
+      make_shared<LazySource>(move(in), strategy == PRESERVE_ORDER);
+  LazyBuilder builder(source);
+  ToonParser<LazyBuilder> parser(source->text.data(), source->text.size(),
+                                 err, builder);
+  return parser.parse_root();
+}
+
+Toon Toon::parse(const string &in, string &err, ToonParse strategy) {
+  return parse(in.data(), in.size(), err, strategy);
+}
+
+Toon Toon::parse(const string &in, string &err, KeyTable &keys,
+                 ToonParse strategy) {
+  return parse(in.data(), in.size(), err, keys, strategy);
+}
+
+Toon Toon::parse(const char *data, size_t len, string &err,
+                 ToonParse strategy) {
+  KeyTable keys;
+  return parse(data, len, err, keys, strategy);
+}
+
+// Runs a ToonParser with `builder` over [data, data + len). `scratch` and
+// `keys` are lent to the parser as its reusable buffers, so a caller can
+// keep their capacity between parses. In TOON_STATS builds `stats` is filled, or a
+// local ParseStats when only the hook wants them.
+static Toon parse_toon(ToonBuilder &builder, const char *data, size_t len,
+                       string &err, string &scratch, vector<Key> &keys,
+                       ParseStats *stats,
+                       size_t max_depth = kDefaultMaxDepth) {
+  ToonParser<ToonBuilder> parser(data, len, err, builder, max_depth);
+  parser.lend(scratch, keys);
+#ifdef TOON_STATS
+  ParseStats local;
+  StatsHook *hook = stats_hook.load(std::memory_order_acquire);
+  if (!stats && hook)
+    stats = &local;
+  StatsClock::time_point start;
+  if (stats) {
+    *stats = ParseStats();
+    parser.stats = stats;
+    start = StatsClock::now();
+  }
+  Toon result = parser.parse_root();
+  if (stats) {
+    stats->total_ms = ms_since(start);
+    stats->bytes = parser.i;
+    if (hook)
+      hook->on_parse(*stats);
+  }
+#else
+  if (stats)
+    *stats = ParseStats();
+  Toon result = parser.parse_root();
+#endif
+  parser.lend(scratch, keys);
+  return result;
+}
+
+Toon Toon::parse(const char *data, size_t len, string &err, KeyTable &keys,
+                 ToonParse strategy) {
+  ToonBuilder builder(strategy == PRESERVE_ORDER, keys);
+  string scratch;
+  vector<Key> header;
+  return parse_toon(builder, data, len, err, scratch, header, nullptr);
+}
+
+Toon Toon::parse(const string &in, string &err, ParseStats &stats,
+                 ToonParse strategy) {
+  KeyTable keys;
+  ToonBuilder builder(strategy == PRESERVE_ORDER, keys);
+  string scratch;
+  vector<Key> header;
+  return parse_toon(builder, in.data(), in.size(), err, scratch, header,
+                    &stats);
+}
+
+Toon Toon::parse_file(const string &path, string &err, ToonParse strategy) {
+  MappedFile file;
+  if (!file.open(path, err))
+    return Toon();
+  return parse(file.data(), file.size(), err, strategy);
+}
+
+/* Binary format
+ *
+ * A document is the magic "TOONB", a version byte and one value. Values
+ * start with a tag byte; integers and lengths are LEB128 varints (signed
+ * ones zigzag-encoded), doubles 8 little-endian bytes. Strings, arrays and
+ * objects carry their length or count. Keys are written once: a key is a
+ * varint n followed, when n is even, by n / 2 bytes of a new key, while an
+ * odd n refers back to the (n / 2)-th key seen. Tables store their keys,
+ * their row count, then each column with a type byte: columns of only
+ * integers, doubles, booleans or strings are packed without per-cell tags.
+ */
+static const char kBinaryMagic[] = "TOONB";
+static const uint8_t kBinaryVersion = 1;
+
+enum BinaryTag : uint8_t {
+  B_NULL,
+  B_FALSE,
+  B_TRUE,
+  B_INT,    // zigzag varint
+  B_UINT,   // varint, above INT64_MAX
+  B_DOUBLE, // 8 bytes
+  B_STRING, // varint length, bytes
+  B_ARRAY,  // varint count, values
+  B_OBJECT, // varint count, key and value pairs, sorted by key
+  B_ORDERED_OBJECT,
+  B_TABLE, // varint width, keys, varint rows, columns
+};
+
+enum BinaryColumn : uint8_t { C_VALUES, C_INT, C_DOUBLE, C_BOOL, C_STRING };
+
+static void put_varint(string &out, uint64_t v) {
+  char buf[10];
+  size_t n = 0;
+  for (; v >= 0x80; v >>= 7)
+    buf[n++] = static_cast<char>(v | 0x80);
+  buf[n++] = static_cast<char>(v);
+  out.append(buf, n);
+}
+
+static void put_double(string &out, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof bits);
+  char buf[8];
+  for (int i = 0; i < 8; ++i)
+    buf[i] = static_cast<char>(bits >> (8 * i));
+  out.append(buf, 8);
+}
+
+static uint64_t zigzag(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ (v < 0 ? ~uint64_t(0) : 0);
+}
+
+struct BinaryWriter {
+  string &out;
+  std::unordered_map<string, uint64_t> keys;
+
+  void bytes(const string &s) {
+    put_varint(out, s.size());
+    out += s;
+  }
+
+  void key(const string &k) {
+    auto it = keys.find(k);
+    if (it != keys.end())
+      return put_varint(out, it->second * 2 + 1);
+    const uint64_t index = keys.size();
+    keys.emplace(k, index);
+    put_varint(out, k.size() * 2);
+    out += k;
+  }
+
+  void value(const Toon &v) {
+    switch (v.m_storage) {
+    case Toon::S_NULL:
+      out += static_cast<char>(B_NULL);
+      return;
+    case Toon::S_BOOL:
+      out += static_cast<char>(v.m_bool ? B_TRUE : B_FALSE);
+      return;
+    case Toon::S_INT64:
+      out += static_cast<char>(B_INT);
+      return put_varint(out, zigzag(v.m_int64));
+    case Toon::S_UINT64:
+      out += static_cast<char>(B_UINT);
+      return put_varint(out, v.m_uint64);
+    case Toon::S_DOUBLE:
+      out += static_cast<char>(B_DOUBLE);
+      return put_double(out, v.m_double);
+    case Toon::S_PTR:
+      break;
+    }
+    const ToonValue *p = v.m_ptr->resolved();
+    switch (p->type()) {
+    case Toon::STRING:
+      out += static_cast<char>(B_STRING);
+      return bytes(p->string_value());
+    case Toon::ARRAY:
+      if (p->is_table())
+        return table(p);
+      out += static_cast<char>(B_ARRAY);
+      put_varint(out, p->array_items().size());
+      for (const Toon &item : p->array_items())
+        value(item);
+      return;
+    case Toon::OBJECT: {
+      const bool ordered = static_cast<const ToonObject *>(p)->m_ordered;
+      out += static_cast<char>(ordered ? B_ORDERED_OBJECT : B_OBJECT);
+      put_varint(out, p->object_members().size());
+      for (auto const &m : p->object_members()) {
+        key(m.first);
+        value(m.second);
+      }
+      return;
+    }
+    default:
+      out += static_cast<char>(B_NULL);
+    }
+  }
+
+  // The packed type shared by every cell of column `col`, if any.
+  static BinaryColumn column_type(const ToonValue *t, size_t col) {
+    const size_t rows = t->table_rows();
+    if (rows == 0)
+      return C_VALUES;
+    const Toon &first = t->table_cell(0, col);
+    BinaryColumn type = C_VALUES;
+    if (first.m_storage == Toon::S_INT64)
+      type = C_INT;
+    else if (first.m_storage == Toon::S_DOUBLE)
+      type = C_DOUBLE;
+    else if (first.m_storage == Toon::S_BOOL)
+      type = C_BOOL;
+    else if (first.is_string())
+      type = C_STRING;
+    for (size_t r = 1; type != C_VALUES && r < rows; ++r) {
+      const Toon &cell = t->table_cell(r, col);
+      const bool same = type == C_STRING ? cell.is_string()
+                                         : cell.m_storage == first.m_storage;
+      if (!same)
+        type = C_VALUES;
+    }
+    return type;
+  }
+
+  void table(const ToonValue *t) {
+    const vector<string> &names = t->table_keys();
+    const size_t rows = t->table_rows();
+    out += static_cast<char>(B_TABLE);
+    put_varint(out, names.size());
+    for (const string &name : names)
+      key(name);
+    put_varint(out, rows);
+    for (size_t j = 0; j < names.size(); ++j) {
+      const BinaryColumn type = column_type(t, j);
+      out += static_cast<char>(type);
+      for (size_t r = 0; r < rows; ++r) {
+        const Toon &cell = t->table_cell(r, j);
+        switch (type) {
+        case C_VALUES:
+          value(cell);
+          break;
+        case C_INT:
+          put_varint(out, zigzag(cell.m_int64));
+          break;
+        case C_DOUBLE:
+          put_double(out, cell.m_double);
+          break;
+        case C_BOOL:
+          out += static_cast<char>(cell.m_bool);
+          break;
+        case C_STRING:
+          bytes(cell.string_value());
+          break;
+        }
+      }
+    }
+  }
+};
+
+void Toon::dump_binary(string &out) const {
+  out.append(kBinaryMagic, sizeof kBinaryMagic - 1);
+  out += static_cast<char>(kBinaryVersion);
+  BinaryWriter writer{out, {}};
+  writer.value(*this);
+}
+
+struct BinaryReader {
+  const uint8_t *const begin, *p, *const end;
+  string &err;
+  vector<Key> keys;
+  size_t nesting; // arrays, objects and tables open around p
+
+  bool fail(const char *what) {
+    err = string(what) + " at offset " + std::to_string(p - begin);
+    return false;
+  }
+
+  // With p just past the tag of a container opened `nesting` levels deep.
+  bool too_deep() {
+    --p;
+    return fail(toon::too_deep(kDefaultMaxDepth).c_str());
+  }
+
+  bool varint(uint64_t &v) {
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p == end)
+        return fail("truncated binary input");
+      const uint8_t byte = *p++;
+      v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return true;
+    }
+    return fail("invalid varint");
+  }
+
+  // A count of items that each take at least `min_bytes` bytes, so that
+  // corrupt counts fail here instead of in a huge allocation.
+  bool count(size_t &n, size_t min_bytes = 1) {
+    uint64_t v;
+    if (!varint(v))
+      return false;
+    if (v > static_cast<uint64_t>(end - p) / min_bytes)
+      return fail("truncated binary input");
+    n = static_cast<size_t>(v);
+    return true;
+  }
+
+  bool text(string &s) {
+    size_t n = 0;
+    if (!count(n))
+      return false;
+    s.assign(reinterpret_cast<const char *>(p), n);
+    p += n;
+    return true;
+  }
+
+  bool key(Key &k) {
+    uint64_t v;
+    if (!varint(v))
+      return false;
+    if (v & 1) {
+      if (v / 2 >= keys.size())
+        return fail("invalid key reference");
+      k = keys[v / 2];
+      return true;
+    }
+    if (v / 2 > static_cast<uint64_t>(end - p))
+      return fail("truncated binary input");
+    const size_t n = static_cast<size_t>(v / 2);
+    k = Key(StringView(reinterpret_cast<const char *>(p), n));
+    p += n;
+    keys.push_back(k);
+    return true;
+  }
+
+  bool number(double &d) {
+    if (end - p < 8)
+      return fail("truncated binary input");
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; ++i)
+      bits |= static_cast<uint64_t>(p[i]) << (8 * i);
+    p += 8;
+    memcpy(&d, &bits, sizeof d);
+    return true;
+  }
+
+  bool integer(Toon &out) {
+    uint64_t v;
+    if (!varint(v))
+      return false;
+    out = Toon(static_cast<long long>((v >> 1) ^ (0 - (v & 1))));
+    return true;
+  }
+
+  bool value(Toon &out) {
+    if (p == end)
+      return fail("truncated binary input");
+    const uint8_t tag = *p++;
+    switch (tag) {
+    case B_NULL:
+      out = Toon();
+      return true;
+    case B_FALSE:
+    case B_TRUE:
+      out = Toon(tag == B_TRUE);
+      return true;
+    case B_INT:
+      return integer(out);
+    case B_UINT: {
+      uint64_t v;
+      if (!varint(v))
+        return false;
+      out = Toon(static_cast<unsigned long long>(v));
+      return true;
+    }
+    case B_DOUBLE: {
+      double d;
+      if (!number(d))
+        return false;
+      out = Toon(d);
+      return true;
+    }
+    case B_STRING: {
+      string s;
+      if (!text(s))
+        return false;
+      out = Toon(move(s));
+      return true;
+    }
+    case B_ARRAY: {
+      const Nested level(nesting);
+      if (nesting > kDefaultMaxDepth)
+        return too_deep();
+      size_t n = 0;
+      if (!count(n))
+        return false;
+      Toon::array items(n);
+      for (Toon &item : items) {
+        if (!value(item))
+          return false;
+      }
+      out = Toon(move(items));
+      return true;
+    }
+    case B_OBJECT:
+    case B_ORDERED_OBJECT: {
+      const Nested level(nesting);
+      if (nesting > kDefaultMaxDepth)
+        return too_deep();
+      size_t n = 0;
+      if (!count(n, 2))
+        return false;
+      Toon::members members(n);
+      for (auto &m : members) {
+        if (!key(m.first) || !value(m.second))
+          return false;
+      }
+      out = Toon::from_members(move(members), tag == B_ORDERED_OBJECT);
+      return true;
+    }
+    case B_TABLE: {
+      const Nested level(nesting);
+      return nesting > kDefaultMaxDepth ? too_deep() : table(out);
+    }
+    default:
+      --p;
+      return fail("invalid binary tag");
+    }
+  }
+
+  bool table(Toon &out) {
+    size_t width = 0, rows = 0;
+    if (!count(width))
+      return false;
+    vector<string> names(width);
+    for (string &name : names) {
+      Key k;
+      if (!key(k))
+        return false;
+      name = k.str();
+    }
+    if (!count(rows, width ? width : 1))
+      return false;
+    Toon::array cells(rows * width);
+    for (size_t j = 0; j < width; ++j) {
+      if (p == end)
+        return fail("truncated binary input");
+      const uint8_t type = *p++;
+      if (type > C_STRING) {
+        --p;
+        return fail("invalid binary column");
+      }
+      for (size_t r = 0; r < rows; ++r) {
+        Toon &cell = cells[r * width + j];
+        bool ok = true;
+        switch (type) {
+        case C_VALUES:
+          ok = value(cell);
+          break;
+        case C_INT:
+          ok = integer(cell);
+          break;
+        case C_DOUBLE: {
+          double d;
+          if ((ok = number(d)))
+            cell = Toon(d);
+          break;
+        }
+        case C_BOOL:
+          if (p == end)
+            return fail("truncated binary input");
+          cell = Toon(*p++ != 0);
+          break;
+        case C_STRING: {
+          string s;
+          if ((ok = text(s)))
+            cell = Toon(move(s));
+          break;
+        }
+        }
+        if (!ok)
+          return false;
+      }
+    }
+    out = width ? Toon::table(move(names), move(cells)) : Toon(Toon::array());
+    return true;
+  }
+};
+
+Toon Toon::parse_binary(StringView in, string &err) {
+  const uint8_t *data = reinterpret_cast<const uint8_t *>(in.data());
+  const size_t head = sizeof kBinaryMagic; // magic and version
+  if (in.size() < head ||
+      memcmp(in.data(), kBinaryMagic, sizeof kBinaryMagic - 1) != 0) {
+    err = "not binary TOON";
+    return Toon();
+  }
+  if (data[head - 1] != kBinaryVersion) {
+    err = "unsupported binary TOON version " + std::to_string(data[head - 1]);
+    return Toon();
+  }
+  BinaryReader reader{data, data + head, data + in.size(), err, {}, 0};
+  Toon out;
+  if (!reader.value(out))
+    return Toon();
+  if (reader.p != reader.end) {
+    reader.fail("unexpected data after the value");
+    return Toon();
+  }
+  return out;
+}
+
+Toon Toon::parse_binary_file(const string &path, string &err) {
+  MappedFile file;
+  if (!file.open(path, err))
+    return Toon();
+  return parse_binary(file.view(), err);
+}
+
+/* Parallel tabular parse
+ *
+ * The header is read sequentially, then the rows after it are cut at line
+ * starts into chunks, each parsed by a ToonParser whose input ends at the
+ * chunk boundary. A chunk is clean when it parsed without error right up to
+ * its end: the sequential parser, reaching the same line start in the same
+ * state, would have produced the same cells. Clean chunks are kept up to
+ * the first one that is not (an error, a short row ending the table, a
+ * quoted string crossing the boundary); the rest of the input is parsed
+ * sequentially from the start of that chunk, so results and error messages
+ * never depend on where the cuts fell.
+ */
+
+static const size_t kParallelMinBytes = 1 << 20;
+
+// Hands the finished cells back instead of building the table.
+struct ChunkBuilder : ToonBuilder {
+  ChunkBuilder(KeyTable &keys, Toon::array &out)
+      : ToonBuilder(false, keys), out(out) {}
+  Toon::array &out;
+  Toon end_table(table_type &t) {
+    out = move(t.cells);
+    return Toon();
+  }
+};
+
+typedef std::function<void(vector<std::function<void()>> &)> RunAll;
+typedef std::function<void(std::function<void()>)> Executor;
+
+// Runs each task on a thread of its own, the first one on the caller's.
+static void run_on_threads(vector<std::function<void()>> &tasks) {
+  vector<std::thread> workers;
+  for (size_t k = 1; k < tasks.size(); ++k)
+    workers.emplace_back(tasks[k]);
+  tasks[0]();
+  for (std::thread &w : workers)
+    w.join();
+}
+
+// Hands each task to `execute` and waits until all of them have run.
+static void run_on_executor(const Executor &execute,
+                            vector<std::function<void()>> &tasks) {
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t pending = tasks.size();
+  for (std::function<void()> &task : tasks) {
+    execute([&, task] {
+      task();
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--pending == 0)
+        done.notify_one();
+    });
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&] { return pending == 0; });
+}
+
+static Toon parse_table_parallel(const string &in, string &err,
+                                 unsigned chunks, const RunAll &run_all) {
+  if (chunks < 2 || in.size() < kParallelMinBytes)
+    return Toon::parse(in, err);
+  KeyTable key_table;
+  Toon::array cells;
+  ChunkBuilder head_builder(key_table, cells);
+  string head_err;
+  ToonParser<ChunkBuilder> head(in.data(), in.size(), head_err, head_builder);
+  head.consume_garbage();
+  vector<Key> keys;
+  int count;
+  if (head.i == in.size() || in[head.i] != '[' ||
+      !head.parse_header(keys, count) || head.failed)
+    return Toon::parse(in, err);
+
+  // Cut the row region at the first line start after each even share.
+  const size_t rows_begin = head.i;
+  const size_t share = (in.size() - rows_begin) / chunks + 1;
+  vector<size_t> bounds(1, rows_begin);
+  for (unsigned k = 1; k < chunks; ++k) {
+    size_t from = std::max(bounds.back(), rows_begin + k * share);
+    if (from >= in.size())
+      break;
+    const char *nl =
+        static_cast<const char *>(memchr(in.data() + from, '\n',
+                                         in.size() - from));
+    if (!nl)
+      break;
+    bounds.push_back(nl - in.data() + 1);
+  }
+  bounds.push_back(in.size());
+
+  const size_t n = bounds.size() - 1;
+  vector<Toon::array> parts(n);
+  vector<char> clean(n, 0);
+  vector<std::function<void()>> tasks;
+  for (size_t k = 0; k < n; ++k) {
+    tasks.push_back([&, k] {
+      string chunk_err;
+      ChunkBuilder builder(key_table, parts[k]);
+      ToonParser<ChunkBuilder> p(in.data(), bounds[k + 1], chunk_err,
+                                 builder);
+      p.i = p.line_start = bounds[k];
+      p.nesting = 1; // inside the table, as in parse_array()
+      p.parse_table(keys, -1);
+      clean[k] = !p.failed && p.i == bounds[k + 1];
+    });
+  }
+  run_all(tasks);
+
+  size_t first_unclean = 0;
+  size_t total = 0;
+  while (first_unclean < n && clean[first_unclean])
+    total += parts[first_unclean++].size();
+  if (first_unclean < n) {
+    // Continue sequentially, numbering lines as a full parse would.
+    head.skipped(rows_begin, bounds[first_unclean]);
+    head.i = bounds[first_unclean];
+    head.nesting = 1;
+    head.parse_table(keys, -1);
+    if (head.failed) {
+      err = move(head_err);
+      return Toon();
+    }
+    total += cells.size();
+  }
+  Toon::array joined;
+  joined.reserve(total);
+  for (size_t k = 0; k < first_unclean; ++k)
+    std::move(parts[k].begin(), parts[k].end(), std::back_inserter(joined));
+  std::move(cells.begin(), cells.end(), std::back_inserter(joined));
+  vector<string> names(keys.begin(), keys.end());
+  return Toon::table(move(names), move(joined));
+}
+
+Toon Toon::parse_parallel(const string &in, string &err, unsigned threads) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  return parse_table_parallel(in, err, threads, run_on_threads);
+}
+
+Toon Toon::parse_parallel(const string &in, string &err,
+                          const Executor &execute, unsigned chunks) {
+  return parse_table_parallel(
+      in, err, chunks, [&execute](vector<std::function<void()>> &tasks) {
+        run_on_executor(execute, tasks);
+      });
+}
+
+/* Parallel dump
+ *
+ * DumpPlan walks a value the way dump() does, writing it into `text` until
+ * it reaches an array, table or object large enough to give every chunk at
+ * least kParallelDumpMin elements. Those elements are split into runs, and
+ * each run becomes a job writing a buffer of its own with the same helpers
+ * dump() uses. The output is text[0], job 0's buffer, text[1], and so on,
+ * which is dump()'s output byte for byte.
+ */
+
+static const size_t kParallelDumpMin = 512;
+
+struct DumpPlan {
+  typedef std::function<void(size_t, size_t, string &)> RangeWriter;
+
+  explicit DumpPlan(unsigned chunks) : chunks(chunks), text(1) {}
+  void add(const Toon &value, int level);
+  void split(size_t count, const RangeWriter &write);
+  void finish(string &out, const RunAll &run_all);
+
+  const unsigned chunks;
+  vector<string> text;
+  vector<std::function<void(string &)>> jobs;
+};
+
+void DumpPlan::add(const Toon &value, int level) {
+  string &out = text.back();
+  if (value.is_table()) {
+    const ToonTable *t =
+        static_cast<const ToonTable *>(value.value()->resolved());
+    t->dump_head(out);
+    split(value.table_rows(), [t, level](size_t b, size_t e, string &o) {
+      t->dump_rows(b, e, o, level);
+    });
+  } else if (value.is_array() && !value.array_items().empty()) {
+    const Toon::array &items = value.array_items();
+    const bool tabular = is_tabular(items);
+    dump_array_head(items, tabular, out);
+    if (!tabular && items.size() < 2 * kParallelDumpMin) {
+      // Too few to split, but one of them may be large.
+      for (size_t i = 0; i < items.size(); ++i) {
+        if (i > 0)
+          text.back() += ", ";
+        add(items[i], level);
+      }
+      return;
+    }
+    split(items.size(), [&items, tabular, level](size_t b, size_t e,
+                                                 string &o) {
+      dump_array_items(items, tabular, b, e, o, level);
+    });
+  } else if (value.is_object()) {
+    const Toon::members &members = value.object_members();
+    if (members.size() < 2 * kParallelDumpMin) {
+      for (size_t i = 0; i < members.size(); ++i)
+        add(members[i].second,
+            dump_member_head(members, i, text.back(), level));
+      return;
+    }
+    split(members.size(), [&members, level](size_t b, size_t e, string &o) {
+      dump_members(members, b, e, o, level);
+    });
+  } else {
+    value.dump(out, level);
+  }
+}
+
+void DumpPlan::split(size_t count, const RangeWriter &write) {
+  const size_t parts = std::min<size_t>(chunks, count / kParallelDumpMin);
+  if (parts < 2)
+    return write(0, count, text.back());
+  for (size_t k = 0; k < parts; ++k) {
+    const size_t begin = count * k / parts, end = count * (k + 1) / parts;
+    jobs.push_back([write, begin, end](string &o) { write(begin, end, o); });
+    text.emplace_back();
+  }
+}
+
+void DumpPlan::finish(string &out, const RunAll &run_all) {
+  vector<string> parts(jobs.size());
+  std::atomic<size_t> next(0);
+  vector<std::function<void()>> tasks(
+      std::min<size_t>(chunks, jobs.size()), [&] {
+        // Element dumps on this thread must not report to the stats hook
+        // as dumps of their own.
+        TOON_STATS_ONLY(DumpStats ignored; DumpStatsScope silent(&ignored);)
+        for (size_t k; (k = next++) < jobs.size();)
+          jobs[k](parts[k]);
+      });
+  if (!tasks.empty())
+    run_all(tasks);
+  size_t total = out.size();
+  for (size_t k = 0; k < text.size(); ++k)
+    total += text[k].size() + (k < parts.size() ? parts[k].size() : 0);
+  out.reserve(total);
+  for (size_t k = 0; k < text.size(); ++k) {
+    out += text[k];
+    if (k < parts.size())
+      out += parts[k];
+  }
+}
+
+void Toon::dump_parallel(string &out, unsigned threads) const {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  if (threads < 2)
+    return dump(out);
+  TOON_STATS_ONLY(DumpStats ignored; DumpStatsScope silent(&ignored);)
+  DumpPlan plan(threads);
+  plan.add(*this, 0);
+  plan.finish(out, run_on_threads);
+}
+
+void Toon::dump_parallel(string &out, const Executor &execute,
+                         unsigned chunks) const {
+  if (chunks < 2)
+    return dump(out);
+  TOON_STATS_ONLY(DumpStats ignored; DumpStatsScope silent(&ignored);)
+  DumpPlan plan(chunks);
+  plan.add(*this, 0);
+  plan.finish(out, [&execute](vector<std::function<void()>> &tasks) {
+    run_on_executor(execute, tasks);
+  });
+}
+
+/* Truncated dump
+ *
+ * TruncatedDump writes a value as dump() does, but no further than an
+ * absolute limit on the size of `out`. When the elements of an array, table
+ * or object do not all fit, the header keeps the full count and a
+ * "... K more" marker stands where the K elements left out would have been.
+ * While an element is written, room is kept back for the marker that would
+ * follow it. When the element then overruns, the elements still to come are
+ * measured against the whole room, since the marker's share may have been
+ * all they lacked. Rows are written or left out whole: a short row would not
+ * read back. Apart from the tabular check of each array reached, the work is
+ * bounded by the limit rather than by the size of the value.
+ */
+
+static size_t more_size(size_t left) { return 9 + uint_length(left); }
+
+static void write_more(size_t left, string &out) {
+  out += "... ";
+  helper_toon::format_unsigned(left, out);
+  out += " more";
+}
+
+static bool take(size_t n, size_t &room) {
+  if (n > room)
+    return false;
+  room -= n;
+  return true;
+}
+
+static bool fits_within(const Toon &value, int level, size_t &room);
+
+// Row `r` of a table `width` cells wide, with the newline that starts it.
+template <class Cell>
+static bool row_fits(const Cell &cell, size_t r, size_t width, int level,
+                     size_t &room) {
+  if (!take(1 + 2 * static_cast<size_t>(level + 1) + 2 * (width - 1), room))
+    return false;
+  for (size_t c = 0; c < width; ++c) {
+    if (!fits_within(cell(r, c), level + 1, room))
+      return false;
+  }
+  return true;
+}
+
+static bool item_fits(const Toon::array &items, size_t i, int level,
+                      size_t &room) {
+  return take(i > 0 ? 2 : 0, room) && fits_within(items[i], level, room);
+}
+
+static bool member_fits(const Toon::members &values, size_t i, int level,
+                        size_t &room) {
+  const Toon &value = values[i].second;
+  const bool nested = value.is_object() || value.is_array();
+  size_t head = values[i].first.str().size() + 2;
+  if (i > 0)
+    head += 1 + 2 * static_cast<size_t>(level);
+  if (value.is_object())
+    head += 1 + 2 * static_cast<size_t>(level + 1);
+  return take(head, room) &&
+         fits_within(value, nested ? level + 1 : level, room);
+}
+
+static size_t table_head_size(const Toon::members &head) {
+  size_t n = 3 + 2 * head.size(); // [{, }]: and the ", " between keys
+  for (auto const &kv : head)
+    n += kv.first.str().size();
+  return n;
+}
+
+static size_t table_head_size(const vector<string> &keys) {
+  size_t n = 3 + 2 * keys.size();
+  for (const string &key : keys)
+    n += key.size();
+  return n;
+}
+
+// Whether dump(out, level) of `value` takes at most `room` bytes, taking
+// them out of `room` if so. Unlike dump_size(), it stops once the room is
+// used up.
+static bool fits_within(const Toon &value, int level, size_t &room) {
+  const Toon::Type type = value.type();
+  if (type == Toon::ARRAY && value.is_table()) {
+    const size_t width = value.table_keys().size();
+    if (!take(table_head_size(value.table_keys()), room))
+      return false;
+    auto cell = [&value](size_t r, size_t c) -> const Toon & {
+      return value.table_cell(r, c);
+    };
+    for (size_t r = 0; r < value.table_rows(); ++r) {
+      if (!row_fits(cell, r, width, level, room))
+        return false;
+    }
+    return true;
+  }
+  if (type == Toon::ARRAY && !value.array_items().empty()) {
+    const Toon::array &items = value.array_items();
+    if (is_tabular(items)) {
+      const Toon::members &head = items[0].object_members();
+      if (!take(table_head_size(head), room))
+        return false;
+      auto cell = [&items](size_t r, size_t c) -> const Toon & {
+        return items[r].object_members()[c].second;
+      };
+      for (size_t r = 0; r < items.size(); ++r) {
+        if (!row_fits(cell, r, head.size(), level, room))
+          return false;
+      }
+      return true;
+    }
+    if (!take(uint_length(items.size()) + 4, room)) // [N]:
+      return false;
+    for (size_t i = 0; i < items.size(); ++i) {
+      if (!item_fits(items, i, level, room))
+        return false;
+    }
+    return true;
+  }
+  if (type == Toon::OBJECT) {
+    const Toon::members &members = value.object_members();
+    for (size_t i = 0; i < members.size(); ++i) {
+      if (!member_fits(members, i, level, room))
+        return false;
+    }
+    return true;
+  }
+  return take(value.dump_size(level), room);
+}
+
+struct TruncatedDump {
+  // What of a value made it into `out`; NONE leaves `out` as it was.
+  enum Fit { NONE, PARTIAL, FULL };
+
+  explicit TruncatedDump(string &out) : out(out) {}
+  Fit add(const Toon &value, int level, size_t limit);
+  template <class Cell>
+  Fit rows(size_t count, size_t width, const Cell &cell, int level,
+           size_t limit);
+  Fit members(const Toon::members &values, int level, size_t limit);
+  // Writes `count` elements, each after separator(i), through write(i,
+  // limit) until one does not fit, then the marker for the rest; fits(i,
+  // room) measures element i with its separator.
+  template <class Separator, class Write, class Fits>
+  Fit items(size_t count, size_t separator_size, const Separator &separator,
+            const Write &write, const Fits &fits, size_t limit);
+
+  string &out;
+};
+
+TruncatedDump::Fit TruncatedDump::add(const Toon &value, int level,
+                                      size_t limit) {
+  const size_t mark = out.size();
+  const Toon::Type type = value.type();
+  Fit fit;
+  if (type == Toon::ARRAY && value.is_table()) {
+    const vector<string> &keys = value.table_keys();
+    out += "[{";
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (i > 0)
+        out += ", ";
+      out += keys[i];
+    }
+    out += "}]:";
+    fit = rows(value.table_rows(), keys.size(),
+               [&value](size_t r, size_t c) -> const Toon & {
+                 return value.table_cell(r, c);
+               },
+               level, limit);
+  } else if (type == Toon::ARRAY && !value.array_items().empty()) {
+    const Toon::array &values = value.array_items();
+    const bool tabular = is_tabular(values);
+    dump_array_head(values, tabular, out);
+    if (tabular) {
+      out.pop_back(); // rows start with their own newline here
+      fit = rows(values.size(), values[0].object_members().size(),
+                 [&values](size_t r, size_t c) -> const Toon & {
+                   return values[r].object_members()[c].second;
+                 },
+                 level, limit);
+    } else {
+      fit = items(values.size(), 2,
+                  [this](size_t i) {
+                    if (i > 0)
+                      out += ", ";
+                  },
+                  [this, &values, level](size_t i, size_t lim) {
+                    return add(values[i], level, lim);
+                  },
+                  [&values, level](size_t i, size_t &room) {
+                    return item_fits(values, i, level, room);
+                  },
+                  limit);
+    }
+  } else if (type == Toon::OBJECT) {
+    fit = members(value.object_members(), level, limit);
+  } else if (type == Toon::STRING) {
+    // Measured first: a long string is cheaper to size than to copy.
+    if (mark + value.dump_size(level) > limit)
+      return NONE;
+    value.dump(out, level);
+    return FULL;
+  } else {
+    // Numbers are written and taken back, rather than formatted twice.
+    value.dump(out, level);
+    fit = out.size() <= limit ? FULL : NONE;
+  }
+  if (fit == NONE)
+    out.resize(mark);
+  return fit;
+}
+
+template <class Cell>
+TruncatedDump::Fit TruncatedDump::rows(size_t count, size_t width,
+                                       const Cell &cell, int level,
+                                       size_t limit) {
+  return items(count, 1 + 2 * static_cast<size_t>(level + 1),
+               [this, level](size_t) {
+                 out += '\n';
+                 indent(out, level + 1);
+               },
+               [this, &cell, width, level](size_t r, size_t lim) -> Fit {
+                 for (size_t c = 0; c < width; ++c) {
+                   if (c > 0)
+                     out += ", ";
+                   if (add(cell(r, c), level + 1, lim) != FULL)
+                     return NONE;
+                 }
+                 return FULL;
+               },
+               [&cell, width, level](size_t r, size_t &room) {
+                 return row_fits(cell, r, width, level, room);
+               },
+               limit);
+}
+
+TruncatedDump::Fit TruncatedDump::members(const Toon::members &values,
+                                          int level, size_t limit) {
+  return items(values.size(), 1 + 2 * static_cast<size_t>(level),
+               [this, level](size_t i) {
+                 if (i > 0) {
+                   out += '\n';
+                   indent(out, level);
+                 }
+               },
+               [this, &values, level](size_t i, size_t lim) {
+                 const Toon &value = values[i].second;
+                 out += values[i].first;
+                 out += ": ";
+                 if (value.is_object()) {
+                   out += '\n';
+                   indent(out, level + 1);
+                 }
+                 return add(value,
+                            value.is_object() || value.is_array() ? level + 1
+                                                                  : level,
+                            lim);
+               },
+               [&values, level](size_t i, size_t &room) {
+                 return member_fits(values, i, level, room);
+               },
+               limit);
+}
+
+template <class Separator, class Write, class Fits>
+TruncatedDump::Fit
+TruncatedDump::items(size_t count, size_t separator_size,
+                     const Separator &separator, const Write &write,
+                     const Fits &fits, size_t limit) {
+  for (size_t i = 0; i < count; ++i) {
+    const size_t mark = out.size();
+    // Room for the marker, should the next element not fit.
+    const size_t keep =
+        i + 1 < count ? separator_size + more_size(count - i - 1) : 0;
+    Fit fit = NONE;
+    if (keep <= limit) {
+      separator(i);
+      fit = write(i, limit - keep);
+    }
+    if (fit == FULL)
+      continue;
+    if (fit == NONE)
+      out.resize(mark);
+    size_t room = limit > mark ? limit - mark : 0;
+    size_t j = i;
+    while (j < count && fits(j, room))
+      ++j;
+    if (j == count) {
+      out.resize(mark);
+      for (j = i; j < count; ++j) {
+        separator(j);
+        write(j, limit);
+      }
+      return FULL;
+    }
+    if (fit == PARTIAL && ++i == count)
+      return PARTIAL;
+    if (out.size() + separator_size + more_size(count - i) > limit)
+      return NONE;
+    separator(i);
+    write_more(count - i, out);
+    return PARTIAL;
+  }
+  return FULL;
+}
+
+bool Toon::dump_truncated(string &out, size_t max_bytes) const {
+  const size_t start = out.size();
+  const size_t limit =
+      max_bytes > SIZE_MAX - start ? SIZE_MAX : start + max_bytes;
+  TruncatedDump dumper(out);
+  return dumper.add(*this, 0, limit) == TruncatedDump::FULL;
+}
+
+/* File input */
+
+MappedFile::MappedFile() noexcept
+    : m_data(nullptr), m_size(0), m_mapped(false) {}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : m_data(other.m_data), m_size(other.m_size), m_mapped(other.m_mapped) {
+  other.m_data = nullptr;
+  other.m_size = 0;
+  other.m_mapped = false;
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+  if (this != &other) {
+    close();
+    std::swap(m_data, other.m_data);
+    std::swap(m_size, other.m_size);
+    std::swap(m_mapped, other.m_mapped);
+  }
+  return *this;
+}
+
+MappedFile::~MappedFile() { close(); }
+
+void MappedFile::close() {
+#ifndef _WIN32
+  if (m_mapped)
+    munmap(const_cast<char *>(m_data), m_size);
+#endif
+  if (!m_mapped)
+    delete[] m_data;
+  m_data = nullptr;
+  m_size = 0;
+  m_mapped = false;
+}
+
+bool MappedFile::open(const string &path, string &err) {
+  close();
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    err = "cannot open " + path + ": " + strerror(errno);
+    if (fd >= 0)
+      ::close(fd);
+    return false;
+  }
+  // Empty files cannot be mapped; they read as an empty buffer, below.
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE; // fault the pages in up front, with read-ahead
+#endif
+    void *p = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      err = "cannot map " + path + ": " + strerror(errno);
+      return false;
+    }
+#ifdef POSIX_MADV_SEQUENTIAL
+    posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+    m_data = static_cast<const char *>(p);
+    m_size = st.st_size;
+    m_mapped = true;
+    return true;
+  }
+  ::close(fd);
+#endif
+  // Portable fallback, also used for pipes and other unmappable files.
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    err = "cannot open " + path + ": " + strerror(errno);
+    return false;
+  }
+  string buf;
+  char chunk[65536];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof chunk, f)) > 0)
+    buf.append(chunk, n);
+  const bool failed = ferror(f) != 0;
+  fclose(f);
+  if (failed) {
+    err = "cannot read " + path;
+    return false;
+  }
+  char *data = new char[buf.size() + 1];
+  memcpy(data, buf.data(), buf.size());
+  m_data = data;
+  m_size = buf.size();
+  return true;
+}
+
+/* Arena */
+
+static const size_t kMaxArenaBlock = 1 << 20;
+
+Arena::Arena(size_t block_size)
+    : m_blocks(nullptr), m_cur(nullptr), m_end(nullptr),
+      m_block_size(block_size), m_capacity(0) {}
+
+Arena::Arena(Arena &&other) noexcept
+    : m_blocks(other.m_blocks), m_cur(other.m_cur), m_end(other.m_end),
+      m_block_size(other.m_block_size), m_capacity(other.m_capacity) {
+  other.m_blocks = nullptr;
+  other.m_cur = other.m_end = nullptr;
+  other.m_capacity = 0;
+}
+
+Arena &Arena::operator=(Arena &&other) noexcept {
+  if (this != &other) {
+    release(nullptr);
+    m_blocks = other.m_blocks;
+    m_cur = other.m_cur;
+    m_end = other.m_end;
+    m_block_size = other.m_block_size;
+    m_capacity = other.m_capacity;
+    other.m_blocks = nullptr;
+    other.m_cur = other.m_end = nullptr;
+    other.m_capacity = 0;
+  }
+  return *this;
+}
+
+Arena::~Arena() { release(nullptr); }
+
+void Arena::release(Block *keep) {
+  Block *b = m_blocks;
+  while (b) {
+    Block *next = b->next;
+    if (b != keep) {
+      m_capacity -= b->size;
+      ::operator delete(b);
+    }
+    b = next;
+  }
+  m_blocks = keep;
+  if (keep) {
+    keep->next = nullptr;
+    m_cur = reinterpret_cast<char *>(keep + 1);
+    m_end = reinterpret_cast<char *>(keep) + keep->size;
+  } else {
+    m_cur = m_end = nullptr;
+  }
+}
+
+void Arena::reset() { release(m_blocks); }
+
+void *Arena::allocate(size_t size, size_t align) {
+  uintptr_t p = (reinterpret_cast<uintptr_t>(m_cur) + align - 1) & ~(align - 1);
+  if (m_cur == nullptr || p + size > reinterpret_cast<uintptr_t>(m_end)) {
+    // Blocks grow geometrically so large parses touch the system allocator
+    // only a handful of times.
+    size_t block = std::max(m_block_size, sizeof(Block) + size + align);
+    if (m_block_size < kMaxArenaBlock)
+      m_block_size *= 2;
+    Block *b = static_cast<Block *>(::operator new(block));
+    b->next = m_blocks;
+    b->size = block;
+    m_blocks = b;
+    m_capacity += block;
+    m_cur = reinterpret_cast<char *>(b + 1);
+    m_end = reinterpret_cast<char *>(b) + block;
+    p = (reinterpret_cast<uintptr_t>(m_cur) + align - 1) & ~(align - 1);
+  }
+  m_cur = reinterpret_cast<char *>(p + size);
+  return reinterpret_cast<void *>(p);
+}
+
+const char *Arena::copy_string(const char *data, size_t size) {
+  if (size == 0)
+    return "";
+  char *dst = static_cast<char *>(allocate(size, 1));
+  memcpy(dst, data, size);
+  return dst;
+}
+
+/* Document */
+
+// DocNode::number_kind
+enum { DOC_DOUBLE, DOC_INT64, DOC_UINT64 };
+
+static DocNode doc_node(Toon::Type type, uint32_t size = 0) {
+  DocNode n;
+  n.size = size;
+  n.type = static_cast<uint8_t>(type);
+  n.number_kind = DOC_DOUBLE;
+  n.items = nullptr;
+  return n;
+}
+
+static bool member_less(const DocMember &a, const DocMember &b) {
+  return a.key() < b.key();
+}
+
+// Builds Document nodes. Children of the array/object being parsed are
+// staged on shared scratch stacks and copied into the arena contiguously
+// once the container is complete.
+struct DocBuilder {
+  typedef DocNode value_type;
+  typedef StringView key_type;
+  typedef size_t array_type;  // mark into `items`
+  typedef size_t object_type; // mark into `members`
+
+  Arena &arena;
+  vector<DocNode> items;
+  vector<DocMember> members;
+  bool zero_copy; // reference the input instead of copying unescaped text
+  bool overflow;
+
+  DocBuilder(Arena &a, bool reference_input)
+      : arena(a), zero_copy(reference_input), overflow(false) {}
+
+  const char *store(StringView s) {
+    return zero_copy ? s.data() : arena.copy_string(s.data(), s.size());
+  }
+
+  uint32_t checked_size(size_t n) {
+    if (n > std::numeric_limits<uint32_t>::max()) {
+      overflow = true;
+      return 0;
+    }
+    return static_cast<uint32_t>(n);
+  }
+
+  DocNode make_null() { return doc_node(Toon::NUL); }
+  DocNode make_bool(bool value) {
+    DocNode n = doc_node(Toon::BOOL);
+    n.boolean = value;
+    return n;
+  }
+  DocNode make_number(double value) {
+    DocNode n = doc_node(Toon::NUMBER);
+    n.number = value;
+    return n;
+  }
+  DocNode make_int(int64_t value) {
+    DocNode n = doc_node(Toon::NUMBER);
+    n.number_kind = DOC_INT64;
+    n.int64 = value;
+    return n;
+  }
+  DocNode make_uint(uint64_t value) {
+    if (value <= static_cast<uint64_t>(INT64_MAX))
+      return make_int(static_cast<int64_t>(value));
+    DocNode n = doc_node(Toon::NUMBER);
+    n.number_kind = DOC_UINT64;
+    n.uint64 = value;
+    return n;
+  }
+  DocNode make_string(StringView value) {
+    DocNode n = doc_node(Toon::STRING, checked_size(value.size()));
+    n.chars = store(value);
+    return n;
+  }
+  // Escaped strings live in the parser's scratch buffer and are always
+  // copied.
+  DocNode make_decoded_string(string &value) {
+    DocNode n = doc_node(Toon::STRING, checked_size(value.size()));
+    n.chars = arena.copy_string(value.data(), value.size());
+    return n;
+  }
+  StringView make_key(StringView key) {
+    return StringView(store(key), key.size());
+  }
+
+  size_t begin_array() { return items.size(); }
+  void push(size_t &, DocNode &&value) { items.push_back(value); }
+  DocNode end_array(size_t &mark) {
+    size_t n = items.size() - mark;
+    DocNode node = doc_node(Toon::ARRAY, checked_size(n));
+    if (n) {
+      DocNode *dst = arena.allocate_array<DocNode>(n);
+      std::copy(items.begin() + mark, items.end(), dst);
+      node.items = dst;
+    }
+    items.resize(mark);
+    return node;
+  }
+
+  size_t begin_object() { return members.size(); }
+  void set(size_t &, StringView key, DocNode &&value) {
+    DocMember m;
+    m.key_chars = key.data();
+    m.key_size = checked_size(key.size());
+    m.node = value;
+    members.push_back(m);
+  }
+  DocNode end_object(size_t &mark) {
+    auto first = members.begin() + mark;
+    // Same semantics as Toon::object: sorted by key, last duplicate wins.
+    // Small objects are insertion sorted, which unlike std::stable_sort
+    // needs no temporary buffer.
+    if (members.end() - first <= 16) {
+      for (auto it = first; it != members.end(); ++it) {
+        DocMember m = *it;
+        auto hole = it;
+        for (; hole != first && member_less(m, *(hole - 1)); --hole)
+          *hole = *(hole - 1);
+        *hole = m;
+      }
+    } else if (!std::is_sorted(first, members.end(), member_less)) {
+      std::stable_sort(first, members.end(), member_less);
+    }
+    auto out = first;
+    for (auto it = first; it != members.end(); ++it) {
+      if (out != first && (out - 1)->key() == it->key())
+        *(out - 1) = *it;
+      else
+        *out++ = *it;
+    }
+    size_t n = out - first;
+    DocNode node = doc_node(Toon::OBJECT, checked_size(n));
+    if (n) {
+      DocMember *dst = arena.allocate_array<DocMember>(n);
+      std::copy(first, out, dst);
+      node.members = dst;
+    }
+    members.resize(mark);
+    return node;
+  }
+
+  // Table rows become ordinary objects whose keys all point at the header
+  // copy of each key.
+  struct table_type {
+    size_t array_mark;
+    size_t row_mark;
+    const vector<StringView> *keys;
+    size_t col;
+  };
+  table_type begin_table(const vector<StringView> &keys) {
+    table_type t = {items.size(), members.size(), &keys, 0};
+    return t;
+  }
+  void push_cell(table_type &t, DocNode &&value) {
+    set(t.row_mark, (*t.keys)[t.col++], move(value));
+  }
+  void end_row(table_type &t) {
+    items.push_back(end_object(t.row_mark));
+    t.col = 0;
+  }
+  void abandon_row(table_type &t) {
+    members.resize(t.row_mark);
+    t.col = 0;
+  }
+  DocNode end_table(table_type &t) { return end_array(t.array_mark); }
+};
+
+Document::Document() noexcept : m_root(nullptr) {}
+
+Document::Document(Document &&other) noexcept
+    : m_file(move(other.m_file)), m_arena(move(other.m_arena)),
+      m_root(other.m_root) {
+  other.m_root = nullptr;
+}
+
+Document &Document::operator=(Document &&other) noexcept {
+  m_arena = move(other.m_arena);
+  m_file = move(other.m_file);
+  m_root = other.m_root;
+  other.m_root = nullptr;
+  return *this;
+}
+
+// Parses `in` into the builder's arena and returns the root node, which is
+// null after an error. `scratch` and `keys` are lent to the parser as for
+// parse_toon().
+static const DocNode *parse_document(DocBuilder &builder, StringView in,
+                                     string &err, string &scratch,
+                                     vector<StringView> &keys,
+                                     size_t max_depth = kDefaultMaxDepth) {
+  ToonParser<DocBuilder> parser(in.data(), in.size(), err, builder,
+                                max_depth);
+  parser.lend(scratch, keys);
+  DocNode root = parser.parse_root();
+  if (builder.overflow && !parser.failed)
+    parser.fail("value too large for a document");
+  parser.lend(scratch, keys);
+  DocNode *node = builder.arena.allocate_array<DocNode>(1);
+  *node = parser.failed ? doc_node(Toon::NUL) : root;
+  return node;
+}
+
+Document::Document(StringView in, string &err, bool zero_copy)
+    : m_root(nullptr) {
+  DocBuilder builder(m_arena, zero_copy);
+  string scratch;
+  vector<StringView> header;
+  m_root = parse_document(builder, in, err, scratch, header);
+}
+
+Document Document::parse(const string &in, string &err, ToonParse) {
+  return Document(in, err, false);
+}
+
+Document Document::parse_view(StringView in, string &err, ToonParse) {
+  return Document(in, err, true);
+}
+
+Document Document::parse_file(const string &path, string &err, ToonParse) {
+  MappedFile file;
+  if (!file.open(path, err))
+    return Document();
+  // The mapping does not move with the MappedFile, so the views stay valid.
+  Document doc(file.view(), err, true);
+  doc.m_file = move(file);
+  return doc;
+}
+
+/* Reusable parser */
+
+// Past this many interned keys the table is dropped before the next parse,
+// so inputs with ever new keys cannot grow it without bound.
+static const size_t kMaxParserKeys = 1 << 16;
+
+struct Parser::Impl {
+  Impl(ToonParse strategy, size_t max_depth)
+      : preserve_order(strategy == PRESERVE_ORDER), max_depth(max_depth),
+        doc(arena, true) {
+    reset_keys();
+  }
+  void reset_keys() {
+    builder.reset();
+    keys.reset(new KeyTable());
+    builder.reset(new ToonBuilder(preserve_order, *keys));
+  }
+
+  const bool preserve_order;
+  const size_t max_depth;
+  std::unique_ptr<KeyTable> keys;
+  std::unique_ptr<ToonBuilder> builder; // keeps its key cache
+  string scratch;
+  vector<Key> toon_header;
+  vector<StringView> doc_header;
+  Arena arena;
+  DocBuilder doc; // keeps its staging vectors
+};
+
+Parser::Parser(ToonParse strategy, size_t max_depth)
+    : m_impl(new Impl(strategy, max_depth)) {}
+
+Parser::~Parser() {}
+
+Toon Parser::parse(StringView in, string &err) {
+  Impl &m = *m_impl;
+  if (m.keys->size() > kMaxParserKeys)
+    m.reset_keys();
+  return parse_toon(*m.builder, in.data(), in.size(), err, m.scratch,
+                    m.toon_header, nullptr, m.max_depth);
+}
+
+DocValue Parser::parse_view(StringView in, string &err) {
+  Impl &m = *m_impl;
+  m.arena.reset();
+  m.doc.overflow = false;
+  return DocValue(parse_document(m.doc, in, err, m.scratch, m.doc_header,
+                                 m.max_depth));
+}
+
+size_t Parser::memory_usage() const {
+  const Impl &m = *m_impl;
+  return m.arena.capacity() + m.scratch.capacity() +
+         m.builder->cache.capacity() * sizeof(Key) +
+         m.doc.items.capacity() * sizeof(DocNode) +
+         m.doc.members.capacity() * sizeof(DocMember);
+}
+
+void Parser::clear() {
+  Impl &m = *m_impl;
+  m.reset_keys();
+  string().swap(m.scratch);
+  vector<Key>().swap(m.toon_header);
+  vector<StringView>().swap(m.doc_header);
+  m.arena = Arena();
+  vector<DocNode>().swap(m.doc.items);
+  vector<DocMember>().swap(m.doc.members);
+}
+
+Toon::Type DocValue::type() const {
+  return m_node ? static_cast<Toon::Type>(m_node->type) : Toon::NUL;
+}
+
+bool DocValue::is_integer() const {
+  return type() == Toon::NUMBER && m_node->number_kind != DOC_DOUBLE;
+}
+
+double DocValue::number_value() const {
+  if (type() != Toon::NUMBER)
+    return 0;
+  switch (m_node->number_kind) {
+  case DOC_INT64:
+    return static_cast<double>(m_node->int64);
+  case DOC_UINT64:
+    return static_cast<double>(m_node->uint64);
+  default:
+    return m_node->number;
+  }
+}
+
+int DocValue::int_value() const {
+  if (is_integer())
+    return static_cast<int>(int64_value());
+  return static_cast<int>(number_value());
+}
+
+int64_t DocValue::int64_value() const {
+  if (is_integer())
+    return m_node->number_kind == DOC_INT64
+               ? m_node->int64
+               : static_cast<int64_t>(m_node->uint64);
+  return static_cast<int64_t>(number_value());
+}
+
+uint64_t DocValue::uint64_value() const {
+  if (is_integer())
+    return m_node->number_kind == DOC_UINT64
+               ? m_node->uint64
+               : static_cast<uint64_t>(m_node->int64);
+  return static_cast<uint64_t>(number_value());
+}
+
+bool DocValue::bool_value() const {
+  return type() == Toon::BOOL ? m_node->boolean : false;
+}
+
+StringView DocValue::string_value() const {
+  if (type() != Toon::STRING)
+    return StringView();
+  return StringView(m_node->chars, m_node->size);
+}
+
+DocArray DocValue::array_items() const {
+  if (type() != Toon::ARRAY)
+    return DocArray();
+  return DocArray(m_node->items, m_node->size);
+}
+
+DocObject DocValue::object_items() const {
+  if (type() != Toon::OBJECT)
+    return DocObject();
+  return DocObject(m_node->members, m_node->size);
+}
+
+DocValue DocValue::operator[](size_t i) const { return array_items()[i]; }
+
+DocValue DocValue::operator[](StringView key) const {
+  const DocMember *m = object_items().find(key);
+  return m ? m->value() : DocValue();
+}
+
+const DocMember *DocObject::find(StringView key) const {
+  const DocMember *first = m_members, *last = m_members + m_size;
+  while (first < last) {
+    const DocMember *mid = first + (last - first) / 2;
+    int c = mid->key().compare(key);
+    if (c == 0)
+      return mid;
+    if (c < 0)
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  return nullptr;
+}
+
+Toon DocValue::to_toon() const {
+  switch (type()) {
+  case Toon::NUMBER:
+    if (m_node->number_kind == DOC_INT64)
+      return Toon(m_node->int64);
+    if (m_node->number_kind == DOC_UINT64)
+      return Toon(m_node->uint64);
+    return Toon(m_node->number);
+  case Toon::BOOL:
+    return Toon(m_node->boolean);
+  case Toon::STRING:
+    return Toon(string_value().str());
+  case Toon::ARRAY: {
+    Toon::array arr;
+    arr.reserve(m_node->size);
+    for (DocValue v : array_items())
+      arr.push_back(v.to_toon());
+    return Toon(move(arr));
+  }
+  case Toon::OBJECT: {
+    Toon::members obj;
+    obj.reserve(m_node->size);
+    for (const DocMember &m : object_items())
+      obj.emplace_back(m.key().str(), m.value().to_toon());
+    return Toon::from_members(move(obj));
+  }
+  default:
+    return Toon();
+  }
+}
+
+/* Hash-consing */
+
+struct Interner::Impl {
+  std::unordered_multimap<uint64_t, Toon> pool;
+  // The interned children of the nodes being interned, innermost last.
+  Toon::array stack;
+};
+
+// Whether interned `candidate` is the node `v` with its children (cells,
+// elements or member values, in order) replaced by `shared`: a pointer
+// comparison per child once those are interned.
+static bool same_node(const Toon &candidate, const Toon &v,
+                      const Toon *shared) {
+  if (v.is_string())
+    return candidate == v;
+  if (candidate.is_table() != v.is_table() ||
+      candidate.is_array() != v.is_array())
+    return false;
+  if (v.is_table()) {
+    if (candidate.table_keys() != v.table_keys() ||
+        candidate.table_rows() != v.table_rows())
+      return false;
+    const size_t width = v.table_keys().size();
+    for (size_t i = 0; i < width * v.table_rows(); ++i) {
+      if (!(candidate.table_cell(i / width, i % width) == shared[i]))
+        return false;
+    }
+    return true;
+  }
+  if (v.is_array()) {
+    const Toon::array &theirs = candidate.array_items();
+    return theirs.size() == v.array_items().size() &&
+           std::equal(theirs.begin(), theirs.end(), shared);
+  }
+  const Toon::members &theirs = candidate.object_members();
+  const Toon::members &ours = v.object_members();
+  if (theirs.size() != ours.size())
+    return false;
+  for (size_t i = 0; i < ours.size(); ++i) {
+    if (theirs[i].first != ours[i].first || !(theirs[i].second == shared[i]))
+      return false;
+  }
+  return true;
+}
+
+Interner::Interner() : m_impl(new Impl()) {}
+
+Interner::~Interner() {}
+
+Toon Interner::intern(const Toon &value) {
+  if (value.m_storage != Toon::S_PTR)
+    return value;
+  Toon v = value;
+  v.unwrap_lazy();
+  // Children first, so that the node itself is matched against the pool by
+  // comparing child pointers, and only rebuilt when it is new.
+  Toon::array &stack = m_impl->stack;
+  const size_t base = stack.size();
+  bool changed = false;
+  auto share = [&](const Toon &child) {
+    Toon shared = intern(child);
+    changed |= shared.m_storage == Toon::S_PTR && shared.m_ptr != child.m_ptr;
+    stack.push_back(move(shared));
+  };
+  if (v.is_table()) {
+    const size_t rows = v.table_rows(), width = v.table_keys().size();
+    for (size_t r = 0; r < rows; ++r) {
+      for (size_t j = 0; j < width; ++j)
+        share(v.table_cell(r, j));
+    }
+  } else if (v.is_array()) {
+    for (const Toon &item : v.array_items())
+      share(item);
+  } else if (v.is_object()) {
+    for (auto const &m : v.object_members())
+      share(m.second);
+  }
+  // Equal values hash alike, so the node's hash is known before it is
+  // built. Equal values in another form (a table and its array of objects,
+  // sorted and ordered objects) are found by a full comparison.
+  const uint64_t hash = v.hash();
+  const Toon *shared = stack.data() + base;
+  const Toon *found = nullptr;
+  auto range = m_impl->pool.equal_range(hash);
+  for (auto it = range.first; !found && it != range.second; ++it) {
+    if (same_node(it->second, v, shared))
+      found = &it->second;
+  }
+  for (auto it = range.first; !found && it != range.second; ++it) {
+    if (it->second == v)
+      found = &it->second;
+  }
+  if (!found && changed) {
+    auto begin = stack.begin() + base;
+    auto moved = [&] {
+      return Toon::array(std::make_move_iterator(begin),
+                         std::make_move_iterator(stack.end()));
+    };
+    if (v.is_table()) {
+      v = Toon::table(v.table_keys(), moved());
+    } else if (v.is_array()) {
+      v = Toon(moved());
+    } else {
+      Toon::members members;
+      members.reserve(stack.size() - base);
+      for (size_t i = base; i < stack.size(); ++i)
+        members.emplace_back(v.object_members()[i - base].first,
+                             move(stack[i]));
+      const bool ordered =
+          static_cast<const ToonObject *>(v.m_ptr.get())->m_ordered;
+      v = Toon::from_members(move(members), ordered);
+    }
+  }
+  stack.resize(base);
+  if (found)
+    return *found;
+  m_impl->pool.emplace(hash, v);
+  return v;
+}
+
+size_t Interner::size() const { return m_impl->pool.size(); }
+
+void Interner::clear() {
+  m_impl->pool.clear();
+  Toon::array().swap(m_impl->stack);
+}
+
+/* Streaming parser */
+
+// Line-oriented state machine driving the same scanning code as
+// ToonParser: each complete line is handed to a ToonParser<DocBuilder>
+// over that line for scalars, headers and table rows, while the frame
+// stack replaces the recursion of parse_object/parse_array.
+struct StreamParser::Impl {
+  enum Kind { OBJECT, ARRAY, TABLE };
+  enum State {
+    START,   // nothing parsed yet
+    PENDING, // saw `key:` at end of line, nested value on the next line
+    ACTIVE,
+    DONE
+  };
+
+  struct Frame {
+    Kind kind;
+    int parent_indent;
+    bool empty;        // OBJECT: no member yet
+    int remaining;     // ARRAY: elements left, -1 when unknown
+    bool after_nested; // ARRAY: a nested array just closed
+    vector<string> keys;
+  };
+
+  typedef ToonParser<DocBuilder> LineParser;
+
+  ToonHandler &handler;
+  string buf;
+  string err;
+  string line_err;
+  size_t line_no;
+  State state;
+  int pending_indent;
+  vector<Frame> frames;
+  Arena arena; // strings and cells of the current line
+  DocBuilder builder;
+  bool failed;
+  const size_t max_depth;
+
+  Impl(ToonHandler &h, size_t max_depth)
+      : handler(h), line_no(0), state(START), pending_indent(-1),
+        arena(4096), builder(arena, true), failed(false),
+        max_depth(max_depth) {}
+
+  // Line parsers number their lines from line_no, so their errors already
+  // carry the position in the whole stream.
+  bool check(LineParser &p) {
+    if (p.failed && !failed) {
+      err = line_err;
+      failed = true;
+    }
+    return !failed;
+  }
+
+  // False, failing the parse, when another frame would nest too deep.
+  bool can_open(LineParser &p) {
+    if (frames.size() >= p.nesting_limit)
+      p.fail(too_deep(p.nesting_limit));
+    return check(p);
+  }
+
+  void push(Kind kind, int parent_indent, int remaining = -1) {
+    Frame f;
+    f.kind = kind;
+    f.parent_indent = parent_indent;
+    f.empty = true;
+    f.remaining = remaining;
+    f.after_nested = false;
+    frames.push_back(move(f));
+  }
+
+  void close_top() {
+    Kind kind = frames.back().kind;
+    frames.pop_back();
+    if (kind == OBJECT)
+      handler.end_object();
+    else if (kind == ARRAY)
+      handler.end_array();
+    else
+      handler.end_table();
+    if (frames.empty())
+      state = DONE;
+    else if (frames.back().kind == ARRAY)
+      frames.back().after_nested = true;
+  }
+
+  void scalar(LineParser &p) {
+    p.nesting = frames.size();
+    DocNode v = p.parse_value();
+    if (check(p))
+      handler.on_scalar(DocValue(&v));
+  }
+
+  // Parses one table row; false when the line does not hold a full row.
+  bool row(LineParser &p) {
+    const vector<string> &keys = frames.back().keys;
+    p.nesting = frames.size();
+    size_t mark = builder.begin_array();
+    for (size_t j = 0; j < keys.size(); ++j) {
+      p.consume_whitespace();
+      if (p.i == p.len) {
+        builder.items.resize(mark);
+        return false;
+      }
+      builder.push(mark, p.parse_value());
+      if (!check(p))
+        return true;
+      p.consume_whitespace();
+      if (j < keys.size() - 1 && p.i < p.len && p.str[p.i] == ',')
+        p.i++;
+    }
+    DocNode cells = builder.end_array(mark);
+    handler.table_row(DocValue(&cells).array_items());
+    return true;
+  }
+
+  // Opens the array or table whose header starts at p.i.
+  void open_header(LineParser &p, int parent_indent) {
+    if (!can_open(p))
+      return;
+    vector<StringView> keys;
+    int count;
+    bool tabular = p.parse_header(keys, count);
+    if (!check(p))
+      return;
+    if (tabular) {
+      push(TABLE, parent_indent);
+      for (StringView k : keys)
+        frames.back().keys.push_back(k.str());
+      handler.begin_table(frames.back().keys);
+      p.consume_whitespace();
+      if (p.i < p.len && p.str[p.i] != '#' && !row(p))
+        close_top();
+    } else {
+      push(ARRAY, parent_indent, count);
+      handler.begin_array(count);
+      elements(p);
+    }
+  }
+
+  // Continues the innermost inline arrays with the rest of the line.
+  void elements(LineParser &p) {
+    while (!failed && !frames.empty() && frames.back().kind == ARRAY) {
+      Frame &f = frames.back();
+      if (f.after_nested) {
+        f.after_nested = false;
+        separator(p, f);
+        continue;
+      }
+      if (f.remaining == 0) {
+        close_top();
+        continue;
+      }
+      p.consume_whitespace();
+      if (p.i == p.len || p.str[p.i] == '#')
+        return; // the array continues on the next line
+      if (f.remaining > 0)
+        f.remaining--;
+      if (p.str[p.i] == '[') {
+        // Nested arrays follow parse_value(), which has no parent indent.
+        open_header(p, -1);
+        if (!frames.empty() && frames.back().kind == TABLE)
+          return;
+        continue;
+      }
+      scalar(p);
+      separator(p, f);
+    }
+  }
+
+  void separator(LineParser &p, Frame &f) {
+    p.consume_whitespace();
+    if (p.i < p.len && p.str[p.i] == ',')
+      p.i++;
+    else if (f.remaining < 0)
+      f.remaining = 0;
+  }
+
+  void member(LineParser &p, int indent) {
+    size_t colon = p.i;
+    while (colon < p.len && p.str[colon] != ':')
+      colon++;
+    if (colon == p.len) {
+      p.fail("expected ':' after key");
+      check(p);
+      return;
+    }
+    frames.back().empty = false;
+    handler.on_key(StringView(p.str + p.i, colon - p.i));
+    p.i = colon + 1;
+    p.consume_whitespace();
+    if (p.i == p.len) {
+      state = PENDING;
+      pending_indent = indent;
+    } else if (p.str[p.i] == '[') {
+      open_header(p, indent);
+    } else {
+      scalar(p);
+    }
+  }
+
+  void open_object(LineParser &p, int parent_indent, int indent) {
+    if (!can_open(p))
+      return;
+    push(OBJECT, parent_indent);
+    handler.begin_object();
+    member(p, indent);
+  }
+
+  void process_line(StringView line) {
+    line_no++;
+    if (failed || state == DONE)
+      return;
+    LineParser p(line.data(), line.size(), line_err, builder, max_depth);
+    p.line_no = line_no;
+    int indent = p.get_indent();
+    p.consume_whitespace();
+    if (p.i == p.len || line[p.i] == '#')
+      return; // blank line or comment
+    arena.reset();
+
+    switch (state) {
+    case START:
+      state = ACTIVE;
+      if (line[p.i] == '[')
+        open_header(p, -1);
+      else if (memchr(line.data(), ':', line.size()) != nullptr)
+        open_object(p, -1, indent);
+      else {
+        scalar(p);
+        state = DONE;
+      }
+      return;
+    case PENDING:
+      state = ACTIVE;
+      if (line[p.i] == '[')
+        open_header(p, pending_indent);
+      else
+        open_object(p, pending_indent, indent);
+      return;
+    default:
+      break;
+    }
+
+    while (!failed && !frames.empty()) {
+      Frame &f = frames.back();
+      if (f.kind == ARRAY) {
+        elements(p);
+        return;
+      }
+      if (f.kind == TABLE) {
+        if (f.parent_indent == -1 || indent > f.parent_indent) {
+          size_t start = p.i;
+          if (row(p))
+            return;
+          p.i = start;
+        }
+        // Indentation dropped or the row is incomplete: the table ended.
+        close_top();
+        continue;
+      }
+      if (indent <= f.parent_indent && !f.empty) {
+        close_top();
+        continue;
+      }
+      member(p, indent);
+      return;
+    }
+  }
+
+  bool feed(const char *data, size_t len) {
+    if (failed)
+      return false;
+    const char *end = data + len;
+    if (!buf.empty()) {
+      // Complete the line left over from the previous chunk.
+      const char *nl = static_cast<const char *>(memchr(data, '\n', len));
+      if (!nl) {
+        buf.append(data, len);
+        return true;
+      }
+      buf.append(data, nl - data);
+      process_line(buf);
+      buf.clear();
+      data = nl + 1;
+    }
+    while (data < end) {
+      const char *nl =
+          static_cast<const char *>(memchr(data, '\n', end - data));
+      if (!nl)
+        break;
+      process_line(StringView(data, nl - data));
+      data = nl + 1;
+    }
+    buf.append(data, end - data);
+    return !failed;
+  }
+
+  bool finish() {
+    if (!buf.empty()) {
+      process_line(buf);
+      buf.clear();
+    }
+    if (failed)
+      return false;
+    if (state == START) {
+      handler.on_scalar(DocValue());
+    } else if (state == PENDING) {
+      // `key:` at end of input is an empty object, as in parse_object().
+      handler.begin_object();
+      handler.end_object();
+    }
+    while (!frames.empty())
+      close_top();
+    state = DONE;
+    return true;
+  }
+};
+
+StreamParser::StreamParser(ToonHandler &handler, size_t max_depth)
+    : m_impl(new Impl(handler, max_depth)) {}
+
+StreamParser::~StreamParser() {}
+
+bool StreamParser::feed(const char *data, size_t len) {
+  return m_impl->feed(data, len);
+}
+
+bool StreamParser::finish() { return m_impl->finish(); }
+
+const string &StreamParser::error() const { return m_impl->err; }
+
+/* Path queries */
+
+Path::Path(const string &expr) {
+  string err;
+  *this = Path(expr, err);
+}
+
+Path::Path(const string &expr, string &err) {
+  m_valid = compile(expr, err);
+  if (!m_valid)
+    m_steps.clear();
+}
+
+bool Path::compile(const string &expr, string &err) {
+  const size_t n = expr.size();
+  size_t i = 0;
+  auto fail = [&](const char *msg) {
+    err = string("invalid path: ") + msg + " at column " +
+          std::to_string(i + 1);
+    return false;
+  };
+  while (i < n) {
+    Step step;
+    step.index = 0;
+    if (expr[i] == '[') {
+      i++;
+      if (i < n && expr[i] == '*') {
+        step.kind = Step::ALL;
+        i++;
+      } else if (i < n && expr[i] == '"') {
+        string key;
+        for (i++; i < n && expr[i] != '"'; ++i) {
+          if (expr[i] == '\\' && i + 1 < n)
+            i++;
+          key += expr[i];
+        }
+        if (i == n)
+          return fail("unterminated key");
+        i++;
+        step.kind = Step::KEY;
+        step.key = Key(key);
+      } else {
+        const bool negative = i < n && expr[i] == '-';
+        if (negative)
           i++;
-      } else if (i < str.size() && str[i] == '\n') {
+        if (i == n || !isdigit(static_cast<unsigned char>(expr[i])))
+          return fail("expected an index, '*' or a quoted key");
+        long index = 0;
+        for (; i < n && isdigit(static_cast<unsigned char>(expr[i])); ++i) {
+          if (index > (std::numeric_limits<long>::max() - 9) / 10)
+            return fail("index out of range");
+          index = index * 10 + (expr[i] - '0');
+        }
+        step.kind = Step::INDEX;
+        step.index = negative ? -index : index;
+      }
+      if (i == n || expr[i] != ']')
+        return fail("expected ']'");
+      i++;
+    } else {
+      if (!m_steps.empty()) {
+        if (expr[i] != '.')
+          return fail("expected '.' or '['");
+        i++;
+      }
+      if (i < n && expr[i] == '*') {
+        step.kind = Step::ALL;
         i++;
       } else {
-        break;
+        const size_t start = i;
+        while (i < n && expr[i] != '.' && expr[i] != '[' && expr[i] != ']')
+          i++;
+        if (i == start)
+          return fail("expected a key");
+        step.kind = Step::KEY;
+        step.key = Key(expr.substr(start, i - start));
       }
     }
+    m_steps.push_back(move(step));
+  }
+  return true;
+}
+
+// Rows [begin, end) of an array or table of `size` elements selected by an
+// INDEX or ALL step; empty when the index is out of range.
+static void step_range(long index, bool all, size_t size, size_t &begin,
+                       size_t &end) {
+  begin = 0;
+  end = all ? size : 0;
+  if (all)
+    return;
+  const long k = index < 0 ? index + static_cast<long>(size) : index;
+  if (k >= 0 && static_cast<size_t>(k) < size) {
+    begin = k;
+    end = k + 1;
+  }
+}
+
+// Visits the matches of steps [step, end) in `value`; stops as soon as
+// `visit` returns false, and then returns false itself.
+template <class Visit>
+bool Path::walk(const Toon &value, size_t step, Visit &visit) const {
+  if (step == m_steps.size())
+    return visit(value);
+  const Step &s = m_steps[step];
+  if (s.kind == Step::KEY) {
+    if (!value.is_object())
+      return true;
+    const Toon &child = value[s.key];
+    return &child == &static_null() || walk(child, step + 1, visit);
+  }
+  if (value.is_object()) {
+    if (s.kind == Step::ALL) {
+      for (const auto &m : value.object_members())
+        if (!walk(m.second, step + 1, visit))
+          return false;
+    }
+    return true;
+  }
+  if (!value.is_array())
+    return true;
+  const bool table = value.is_table();
+  size_t begin, end;
+  step_range(s.index, s.kind == Step::ALL, table ? value.table_rows()
+                                                 : value.array_items().size(),
+             begin, end);
+  if (table && step + 1 < m_steps.size() &&
+      m_steps[step + 1].kind == Step::KEY) {
+    // Read the column instead of building the row objects.
+    const vector<string> &keys = value.table_keys();
+    const Key &key = m_steps[step + 1].key;
+    const size_t col = std::find(keys.begin(), keys.end(), key.str()) -
+                       keys.begin();
+    for (size_t r = begin; col < keys.size() && r < end; ++r)
+      if (!walk(value.table_cell(r, col), step + 2, visit))
+        return false;
+    return true;
+  }
+  const Toon::array &items = value.array_items();
+  for (size_t r = begin; r < end; ++r)
+    if (!walk(items[r], step + 1, visit))
+      return false;
+  return true;
+}
+
+template <class Visit>
+bool Path::walk(DocValue value, size_t step, Visit &visit) const {
+  if (step == m_steps.size())
+    return visit(value);
+  const Step &s = m_steps[step];
+  if (s.kind == Step::KEY) {
+    const DocMember *m =
+        value.is_object() ? value.object_items().find(s.key.view()) : nullptr;
+    return !m || walk(m->value(), step + 1, visit);
+  }
+  if (value.is_object()) {
+    if (s.kind == Step::ALL) {
+      for (const DocMember &m : value.object_items())
+        if (!walk(m.value(), step + 1, visit))
+          return false;
+    }
+    return true;
+  }
+  const DocArray items = value.array_items();
+  size_t begin, end;
+  step_range(s.index, s.kind == Step::ALL, items.size(), begin, end);
+  for (size_t r = begin; r < end; ++r)
+    if (!walk(items[r], step + 1, visit))
+      return false;
+  return true;
+}
+
+vector<const Toon *> Path::select(const Toon &root) const {
+  vector<const Toon *> out;
+  select(root, out);
+  return out;
+}
+
+void Path::select(const Toon &root, vector<const Toon *> &out) const {
+  auto visit = [&out](const Toon &v) {
+    out.push_back(&v);
+    return true;
+  };
+  if (m_valid)
+    walk(root, 0, visit);
+}
+
+const Toon &Path::first(const Toon &root) const {
+  const Toon *found = &static_null();
+  auto visit = [&found](const Toon &v) {
+    found = &v;
+    return false;
+  };
+  if (m_valid)
+    walk(root, 0, visit);
+  return *found;
+}
+
+vector<DocValue> Path::select(DocValue root) const {
+  vector<DocValue> out;
+  select(root, out);
+  return out;
+}
+
+void Path::select(DocValue root, vector<DocValue> &out) const {
+  auto visit = [&out](DocValue v) {
+    out.push_back(v);
+    return true;
+  };
+  if (m_valid)
+    walk(root, 0, visit);
+}
+
+PathHandler::PathHandler(const Path &path,
+                         std::function<void(DocValue)> on_match)
+    : m_path(path), m_on_match(move(on_match)),
+      m_pending(path.m_valid ? 0 : -1) {}
+
+// The step the value starting now is matched against, -1 when it cannot
+// match; counts the value as a child of the enclosing array.
+int PathHandler::child_step() {
+  if (m_frames.empty() || m_frames.back().object) {
+    const int step = m_pending;
+    m_pending = -1;
+    return step;
+  }
+  Frame &f = m_frames.back();
+  const size_t index = f.count++;
+  if (f.step < 0)
+    return -1;
+  const Path::Step &s = m_path.m_steps[f.step];
+  if (s.kind == Path::Step::KEY)
+    return -1;
+  if (s.kind == Path::Step::INDEX && s.index < 0 && f.declared < 0)
+    return -1;
+  size_t begin, end;
+  step_range(s.index, s.kind == Path::Step::ALL,
+             f.declared >= 0 ? f.declared : size_t(-1), begin, end);
+  return index >= begin && index < end ? f.step + 1 : -1;
+}
+
+void PathHandler::open(bool object, int declared) {
+  const int step = child_step();
+  Frame f;
+  f.object = object;
+  f.step = step >= 0 && size_t(step) < m_path.m_steps.size() ? step : -1;
+  f.count = 0;
+  f.declared = declared;
+  f.column = -2;
+  m_frames.push_back(f);
+}
+
+void PathHandler::match(DocValue value, size_t step) {
+  auto visit = [this](DocValue v) {
+    m_on_match(v);
+    return true;
+  };
+  m_path.walk(value, step, visit);
+}
+
+void PathHandler::begin_object() { open(true); }
+
+void PathHandler::on_key(StringView key) {
+  const Frame &f = m_frames.back();
+  m_pending = -1;
+  if (f.step < 0)
+    return;
+  const Path::Step &s = m_path.m_steps[f.step];
+  if (s.kind == Path::Step::ALL ||
+      (s.kind == Path::Step::KEY && s.key == key))
+    m_pending = f.step + 1;
+}
+
+void PathHandler::end_object() { m_frames.pop_back(); }
+
+void PathHandler::begin_array(int count) { open(false, count); }
+
+void PathHandler::end_array() { m_frames.pop_back(); }
+
+void PathHandler::begin_table(const vector<string> &keys) {
+  open(false);
+  Frame &f = m_frames.back();
+  const size_t next = f.step + 1;
+  if (f.step < 0 || next >= m_path.m_steps.size())
+    return;
+  const Path::Step &s = m_path.m_steps[next];
+  if (s.kind == Path::Step::ALL) {
+    f.column = -1;
+  } else if (s.kind == Path::Step::KEY) {
+    for (size_t j = 0; j < keys.size(); ++j)
+      if (s.key == keys[j])
+        f.column = static_cast<int>(j);
+  }
+}
+
+void PathHandler::table_row(DocArray cells) {
+  // Rows are matched like array elements, then the column step is applied.
+  const int step = child_step();
+  const int column = m_frames.back().column;
+  if (step < 0 || column == -2)
+    return;
+  if (column >= 0)
+    return match(cells[column], step + 1);
+  for (DocValue cell : cells)
+    match(cell, step + 1);
+}
+
+void PathHandler::end_table() { m_frames.pop_back(); }
+
+void PathHandler::on_scalar(DocValue value) {
+  const int step = child_step();
+  if (step >= 0)
+    match(value, step);
+}
+
+/* Struct binding */
+
+bool read_field(DocValue cell, bool &out) {
+  if (!cell.is_bool())
+    return false;
+  out = cell.bool_value();
+  return true;
+}
+
+bool read_field(DocValue cell, double &out) {
+  if (!cell.is_number())
+    return false;
+  out = cell.number_value();
+  return true;
+}
+
+bool read_field(DocValue cell, float &out) {
+  if (!cell.is_number())
+    return false;
+  out = static_cast<float>(cell.number_value());
+  return true;
+}
+
+bool read_field(DocValue cell, string &out) {
+  if (!cell.is_string())
+    return false;
+  StringView v = cell.string_value();
+  out.assign(v.data(), v.size());
+  return true;
+}
+
+bool read_field(DocValue cell, Toon &out) {
+  out = cell.to_toon();
+  return true;
+}
+
+// Integers above INT64_MAX are stored unsigned and wrap in int64_value(),
+// so number_value() supplies the sign.
+bool read_integer(DocValue cell, int64_t min, int64_t max, int64_t &out) {
+  if (!cell.is_integer())
+    return false;
+  int64_t v = cell.int64_value();
+  if (v < 0 && cell.number_value() > 0)
+    return false;
+  if (v < min || v > max)
+    return false;
+  out = v;
+  return true;
+}
+
+bool read_unsigned(DocValue cell, uint64_t max, uint64_t &out) {
+  if (!cell.is_integer())
+    return false;
+  uint64_t v = cell.uint64_value();
+  if (cell.number_value() < 0)
+    return false;
+  if (v > max)
+    return false;
+  out = v;
+  return true;
+}
+
+TableReaderBase::TableReaderBase(vector<string> fields)
+    : m_fields(std::move(fields)), m_columns(m_fields.size(), -1),
+      m_state(WAITING), m_rows(0) {}
+
+void TableReaderBase::begin_table(const vector<string> &keys) {
+  if (m_state != WAITING)
+    return;
+  for (size_t f = 0; f < m_fields.size(); ++f)
+    for (size_t k = 0; k < keys.size(); ++k)
+      if (keys[k] == m_fields[f]) {
+        m_columns[f] = static_cast<int>(k);
+        break;
+      }
+  m_state = READING;
+}
+
+void TableReaderBase::end_table() {
+  if (m_state == READING)
+    m_state = DONE;
+}
+
+bool TableReaderBase::begin_row() {
+  if (m_state != READING || !m_error.empty())
+    return false;
+  m_rows++;
+  return true;
+}
+
+void TableReaderBase::fail(size_t index) {
+  if (m_error.empty())
+    m_error = "row " + std::to_string(m_rows) + ": cannot read column " +
+              m_fields[index];
+}
+
+bool TableReaderBase::finish(string &err) const {
+  if (!m_error.empty()) {
+    err = m_error;
+    return false;
+  }
+  if (m_state != DONE) {
+    err = "no table found";
+    return false;
   }
+  return true;
+}
 
-  char get_next_token() {
-    consume_whitespace();
-    if (i == str.size())
-      return 0;
-    return str[i++];
+/* Writer */
+
+namespace {
+struct FileSink final : ToonSink {
+  std::FILE *file;
+  explicit FileSink(std::FILE *f) : file(f) {}
+  bool write(const char *data, size_t len) override {
+    return fwrite(data, 1, len, file) == len;
   }
+};
 
-  int get_indent() {
-    int count = 0;
-    size_t start = i;
-    while (start > 0 && str[start - 1] != '\n')
-      start--;
-    while (start < str.size() && (str[start] == ' ' || str[start] == '\t')) {
-      count += (str[start] == '\t' ? 8 : 1); // rough tab approximation
-      start++;
+struct FdSink final : ToonSink {
+  int fd;
+  explicit FdSink(int f) : fd(f) {}
+  bool write(const char *data, size_t len) override {
+    while (len > 0) {
+      auto n = toon_write(fd, data, len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      data += n;
+      len -= static_cast<size_t>(n);
     }
-    return count;
+    return true;
   }
+};
 
-  Toon parse_value() {
-    consume_whitespace();
-    if (i == str.size())
-      return fail("unexpected end of input");
+struct StringOutSink final : ToonSink {
+  string &out;
+  explicit StringOutSink(string &s) : out(s) {}
+  bool write(const char *data, size_t len) override {
+    out.append(data, len);
+    return true;
+  }
+};
+} // namespace
 
-    char ch = str[i];
-    if (ch == '"')
-      return parse_quoted_string();
-    if (ch == '[')
-      return parse_array();
+Writer::Writer(ToonSink &sink, size_t buffer_size)
+    : m_sink(&sink), m_capacity(buffer_size), m_good(true) {
+  m_buf.reserve(buffer_size);
+}
 
-    // Check for special keywords
-    if (str.compare(i, 4, "null") == 0) {
-      i += 4;
-      return Toon();
-    }
-    if (str.compare(i, 4, "true") == 0) {
-      i += 4;
-      return Toon(true);
-    }
-    if (str.compare(i, 5, "false") == 0) {
-      i += 5;
-      return Toon(false);
-    }
+Writer::Writer(std::FILE *file, size_t buffer_size)
+    : m_owned(new FileSink(file)), m_sink(m_owned.get()),
+      m_capacity(buffer_size), m_good(true) {
+  m_buf.reserve(buffer_size);
+}
 
-    if (isdigit(ch) || ch == '-')
-      return parse_number();
+Writer::Writer(int fd, size_t buffer_size)
+    : m_owned(new FdSink(fd)), m_sink(m_owned.get()), m_capacity(buffer_size),
+      m_good(true) {
+  m_buf.reserve(buffer_size);
+}
 
-    return parse_unquoted_string();
-  }
+Writer::Writer(string &out, size_t buffer_size)
+    : m_owned(new StringOutSink(out)), m_sink(m_owned.get()),
+      m_capacity(buffer_size), m_good(true) {
+  m_buf.reserve(buffer_size);
+}
 
-  Toon parse_quoted_string() {
-    i++; // skip "
-    string out;
-    while (i < str.size() && str[i] != '"') {
-      if (str[i] == '\\') {
-        i++;
-        if (str[i] == 'u') {
-          string unicode_err;
-          uint32_t cp =
-              helper_toon::parse_unicode_codepoint(str, i, unicode_err);
-          if (!unicode_err.empty())
-            return fail(std::move(unicode_err));
-          helper_toon::encode_utf8(cp, out);
-        }
-        if (i == str.size())
-          return fail("unfinished escape");
-        char esc = str[i++];
-        if (esc == 'n')
-          out += '\n';
-        else if (esc == 'r')
-          out += '\r';
-        else if (esc == 't')
-          out += '\t';
-        else if (esc == '"' || esc == '\\')
-          out += esc;
-        else
-          return fail("invalid escape");
-      } else {
-        out += str[i++];
-      }
+Writer::~Writer() { flush(); }
+
+bool Writer::flush() {
+  if (m_good && !m_buf.empty())
+    m_good = m_sink->write(m_buf.data(), m_buf.size());
+  m_buf.clear();
+  return m_good;
+}
+
+// Writes the separator that precedes a value in the current container and
+// returns the indentation level the value is dumped at, mirroring
+// dump(const Toon::array &) and dump(const Toon::members &).
+int Writer::before_value(Kind kind) {
+  if (m_frames.empty())
+    return 0;
+  Frame &f = m_frames.back();
+  assert(f.kind != TABLE && "table cells go through begin_row()/row()");
+  if (f.kind == OBJECT) {
+    assert(f.written > 0 && "key() must precede an object member");
+    if (kind == OBJECT) {
+      m_buf += "\n";
+      indent(m_buf, f.level + 1);
+      return f.level + 1;
     }
-    if (i == str.size())
-      return fail("unfinished string");
-    i++; // skip "
-    return out;
+    return kind == SCALAR ? f.level : f.level + 1;
   }
+  assert(f.written < f.size && "more values than declared");
+  if (f.written++ > 0)
+    m_buf += ", ";
+  return f.level;
+}
 
-  Toon parse_unquoted_string() {
-    string out;
-    const string special = ",:\n[]{}#";
-    while (i < str.size() && special.find(str[i]) == string::npos) {
-      out += str[i++];
-    }
-    // Trim trailing whitespace
-    size_t last = out.find_last_not_of(" \t\r");
-    if (last != string::npos)
-      out.erase(last + 1);
-    return out;
+void Writer::begin_object() {
+  Frame f = {OBJECT, before_value(OBJECT), 0, 0};
+  m_frames.push_back(f);
+}
+
+void Writer::key(StringView key) {
+  Frame &f = m_frames.back();
+  assert(f.kind == OBJECT);
+  if (f.written++ > 0) {
+    m_buf += "\n";
+    indent(m_buf, f.level);
   }
+  m_buf.append(key.data(), key.size());
+  m_buf += ": ";
+}
 
-  Toon parse_number() {
-    size_t start = i;
-    while (i < str.size() && (isdigit(str[i]) || str[i] == '.' ||
-                              str[i] == '-' || str[i] == 'e' || str[i] == 'E'))
-      i++;
-    string n = str.substr(start, i - start);
+void Writer::end_object() {
+  assert(!m_frames.empty() && m_frames.back().kind == OBJECT);
+  m_frames.pop_back();
+  maybe_flush();
+}
 
-    // std::stod dipende dal locale. Meglio usare strtod_l se disponibile o
-    // forzare il punto. Metodo semplice "C-style" manuale o strtod standard
-    // (assumendo locale "C" per i dati):
-    char *end;
-    double val = strtod(n.c_str(), &end);
-    return val;
+void Writer::begin_array(size_t count) {
+  Frame f = {ARRAY, before_value(ARRAY), count, 0};
+  if (count == 0) {
+    m_buf += "[0]:";
+  } else {
+    m_buf += "[";
+    m_buf += std::to_string(count);
+    m_buf += "]: ";
   }
+  m_frames.push_back(f);
+}
 
-  Toon parse_array(int parent_indent = -1) {
-    i++; // skip [
-    bool tabular = false;
-    vector<string> keys;
-    int count = -1;
+void Writer::end_array() {
+  assert(!m_frames.empty() && m_frames.back().kind == ARRAY);
+  assert(m_frames.back().written == m_frames.back().size);
+  m_frames.pop_back();
+  maybe_flush();
+}
 
-    // 1. Parsing dell'header: [N] oppure [{k1, k2}]
-    if (i < str.size() && str[i] == '{') {
-      tabular = true;
-      i++; // skip {
-      while (i < str.size() && str[i] != '}') {
-        consume_whitespace();
-        string key;
-        while (i < str.size() && str[i] != ',' && str[i] != '}')
-          key += str[i++];
+void Writer::begin_table(const vector<string> &keys) {
+  assert(!keys.empty());
+  Frame f = {TABLE, before_value(TABLE), keys.size(), 0};
+  m_buf += "[{";
+  for (size_t i = 0; i < keys.size(); ++i) {
+    m_buf += keys[i];
+    if (i < keys.size() - 1)
+      m_buf += ", ";
+  }
+  m_buf += "}]:";
+  m_frames.push_back(f);
+}
 
-        // Trim key
-        size_t first = key.find_first_not_of(" ");
-        size_t last = key.find_last_not_of(" ");
-        if (first != string::npos)
-          keys.push_back(key.substr(first, (last - first + 1)));
+void Writer::begin_row() {
+  Frame &t = m_frames.back();
+  assert(t.kind == TABLE);
+  m_buf += "\n";
+  indent(m_buf, t.level + 1);
+  Frame f = {ROW, t.level + 1, t.size, 0};
+  t.written++;
+  m_frames.push_back(f);
+}
 
-        if (i < str.size() && str[i] == ',')
-          i++;
-      }
-      if (i < str.size())
-        i++; // skip }
-    } else {
-      string n;
-      while (i < str.size() && isdigit(str[i]))
-        n += str[i++];
-      if (!n.empty())
-        count = std::stoi(n);
-    }
+void Writer::end_row() {
+  assert(!m_frames.empty() && m_frames.back().kind == ROW);
+  assert(m_frames.back().written == m_frames.back().size);
+  m_frames.pop_back();
+  maybe_flush();
+}
 
-    // Skip closing bracket and optional colon
-    while (i < str.size() && str[i] != ']')
-      i++;
-    if (i < str.size())
-      i++; // skip ]
-    if (i < str.size() && str[i] == ':')
-      i++;
+void Writer::row(std::initializer_list<Toon> cells) {
+  begin_row();
+  for (const Toon &c : cells)
+    value(c);
+  end_row();
+}
 
-    Toon::array arr;
+void Writer::row(const Toon::array &cells) {
+  begin_row();
+  for (const Toon &c : cells)
+    value(c);
+  end_row();
+}
 
-    // 2. Parsing del corpo
-    if (tabular) {
-      // In modalità tabulare, leggiamo finché l'indentazione regge
-      while (i < str.size()) {
-        consume_garbage(); // Salta commenti e newlines precedenti
+void Writer::end_table() {
+  assert(!m_frames.empty() && m_frames.back().kind == TABLE);
+  m_frames.pop_back();
+  maybe_flush();
+}
 
-        // Se siamo alla fine del file, stop
-        if (i == str.size())
-          break;
+void Writer::value(std::nullptr_t) {
+  before_value(SCALAR);
+  m_buf += "null";
+  maybe_flush();
+}
 
-        // Verifica Indentazione
-        // Salviamo la posizione corrente per fare il peek dell'indentazione
-        size_t row_start_index = i;
-        int current_indent = get_indent();
-
-        // LOGICA CRITICA:
-        // Se l'indentazione della nuova riga è <= all'indentazione del
-        // genitore, significa che l'array tabulare è finito e siamo tornati al
-        // livello superiore. Nota: parent_indent == -1 significa root, quindi
-        // accettiamo tutto.
-        if (parent_indent != -1 && current_indent <= parent_indent) {
-          // Ripristiniamo l'indice in modo che il genitore possa leggere questa
-          // riga
-          i = row_start_index;
-          break;
-        }
+void Writer::value(bool v) {
+  before_value(SCALAR);
+  toon::dump(v, m_buf, 0);
+  maybe_flush();
+}
 
-        // Se l'indentazione è valida, parsiamo la riga come oggetto
-        Toon::object obj;
-        bool row_failed = false;
+void Writer::value(int v) {
+  before_value(SCALAR);
+  toon::dump(v, m_buf, 0);
+  maybe_flush();
+}
 
-        for (size_t j = 0; j < keys.size(); ++j) {
-          consume_whitespace();
+void Writer::value(long v) { value(static_cast<long long>(v)); }
 
-          // Gestione fine inaspettata della riga
-          if (i == str.size() || str[i] == '\n') {
-            // Se mancano colonne, decidiamo se fallire o mettere null.
-            // Qui interrompiamo la riga.
-            row_failed = true;
-            break;
-          }
+void Writer::value(long long v) {
+  before_value(SCALAR);
+  helper_toon::format_int(v, m_buf);
+  maybe_flush();
+}
 
-          Toon val = parse_value();
-          if (failed)
-            return Toon(); // Propaga errore critico
+void Writer::value(unsigned v) { value(static_cast<unsigned long long>(v)); }
 
-          obj[keys[j]] = val;
-          consume_whitespace();
+void Writer::value(unsigned long v) {
+  value(static_cast<unsigned long long>(v));
+}
 
-          // Salta la virgola se presente tra le colonne
-          if (j < keys.size() - 1 && i < str.size() && str[i] == ',')
-            i++;
-        }
+void Writer::value(unsigned long long v) {
+  before_value(SCALAR);
+  helper_toon::format_unsigned(v, m_buf);
+  maybe_flush();
+}
 
-        if (!row_failed) {
-          arr.push_back(obj);
-        } else {
-          // Se la riga è fallita o incompleta, potremmo voler uscire
-          // o semplicemente ignorarla. Qui usciamo per sicurezza.
-          break;
-        }
-      }
-    } else {
-      // Modalità Standard [N]: v1, v2, ...
-      // Qui l'indentazione è meno rilevante perché abbiamo il count esplicito,
-      // ma è comunque utile consumare whitespace correttamente.
-      for (int k = 0; count < 0 || k < count; ++k) {
-        consume_garbage(); // Importante per array multilinea
+void Writer::value(double v) {
+  before_value(SCALAR);
+  toon::dump(v, m_buf, 0);
+  maybe_flush();
+}
 
-        if (i == str.size())
-          break;
+void Writer::value(StringView v) {
+  before_value(SCALAR);
+  dump_string(v, m_buf);
+  maybe_flush();
+}
 
-        // Check opzionale: se siamo in array senza count esplicito (se mai
-        // supportato) potremmo usare la stessa logica dell'indentazione qui.
-        // Per ora ci fidiamo di 'count'.
+void Writer::value(const Toon &v) {
+  Kind kind = v.is_object() ? OBJECT : v.is_array() ? ARRAY : SCALAR;
+  v.dump(m_buf, before_value(kind));
+  maybe_flush();
+}
 
-        arr.push_back(parse_value());
+/* JSON transcoding */
 
-        consume_whitespace();
-        if (i < str.size() && str[i] == ',')
-          i++;
-        else if (count < 0) // Se count non c'è, stop al primo che non ha
-                            // virgola (o newline)
-          break;
+// Reads a whole JSON text, validating it as it goes, and writes it to a
+// Writer. The first time an array is reached it is scanned to its end
+// (scan_array()), which records the element count and tabular form of it
+// and of every array nested in it, in document order; the writing pass then
+// takes those records in the same order, so each byte is scanned twice.
+class JsonReader {
+public:
+  JsonReader(StringView in, string &err)
+      : s(in.data()), len(in.size()), err(err) {}
+
+  bool run(Writer &out) {
+    ws();
+    if (!value(&out))
+      return false;
+    ws();
+    return i == len || fail("unexpected data after the value");
+  }
+
+private:
+  struct ArrayInfo {
+    size_t count;
+    bool tabular;
+    size_t keys_begin; // in `keys`, the raw keys of the first element
+    size_t key_count;
+  };
+
+  bool fail(const char *what) {
+    size_t line = 1, column = 1;
+    for (size_t k = 0; k < i && k < len; ++k) {
+      if (s[k] == '\n') {
+        ++line;
+        column = 1;
+      } else {
+        ++column;
       }
     }
-    return arr;
+    err = string(what) + " at line " + std::to_string(line) + ", column " +
+          std::to_string(column);
+    return false;
   }
 
-  Toon parse_object(int parent_indent) {
-    Toon::object obj;
-    while (i < str.size()) {
-      consume_garbage();
-      size_t saved_i = i;
-      int current_indent = get_indent();
+  void ws() {
+    while (i < len &&
+           (s[i] == ' ' || s[i] == '\n' || s[i] == '\t' || s[i] == '\r'))
+      ++i;
+  }
 
-      // Controllo uscita dall'oggetto corrente
-      if (current_indent <= parent_indent && !obj.empty()) {
-        i = saved_i;
+  bool expect(char c, const char *what) {
+    ws();
+    if (i < len && s[i] == c) {
+      ++i;
+      return true;
+    }
+    return fail(what);
+  }
+
+  // The string at i, between quotes, still escaped; unescape() decodes it.
+  bool string_token(StringView &raw) {
+    const size_t start = ++i;
+    while (true) {
+      i = helper_toon::scan(s, i, len, helper_toon::NEEDS_ESCAPE);
+      if (i == len)
+        return fail("unterminated string");
+      if (s[i] == '"')
         break;
+      if (s[i] != '\\')
+        return fail("control character in string");
+      if (++i == len)
+        return fail("unterminated string");
+      if (s[i] == 'u') {
+        string unicode_err;
+        ++i;
+        helper_toon::parse_unicode_codepoint(s, len, i, unicode_err);
+        if (!unicode_err.empty())
+          return fail("invalid unicode escape");
+      } else if (s[i] && strchr("\"\\/bfnrt", s[i])) {
+        ++i;
+      } else {
+        return fail("invalid escape");
       }
+    }
+    raw = StringView(s + start, i - start);
+    ++i; // closing quote
+    return true;
+  }
 
-      string key;
-      while (i < str.size() && str[i] != ':')
-        key += str[i++];
-      if (i == str.size())
+  static char unescaped(char esc) {
+    switch (esc) {
+    case 'b':
+      return '\b';
+    case 'f':
+      return '\f';
+    case 'n':
+      return '\n';
+    case 'r':
+      return '\r';
+    case 't':
+      return '\t';
+    default: // " \ /
+      return esc;
+    }
+  }
+
+  // Decodes a string already checked by string_token().
+  static const string &unescape(StringView raw, string &out) {
+    out.clear();
+    const char *p = raw.data();
+    const size_t n = raw.size();
+    for (size_t k = 0; k < n;) {
+      const char *bs = static_cast<const char *>(memchr(p + k, '\\', n - k));
+      const size_t run = bs ? static_cast<size_t>(bs - p) : n;
+      out.append(p + k, run - k);
+      if (run == n)
         break;
-      i++; // skip :
+      k = run + 1;
+      const char esc = p[k++];
+      if (esc != 'u') {
+        out += unescaped(esc);
+        continue;
+      }
+      string unused;
+      uint32_t cp = helper_toon::parse_unicode_codepoint(p, n, k, unused);
+      // Combine a UTF-16 surrogate pair into a single codepoint.
+      if (cp >= 0xd800 && cp <= 0xdbff && k + 6 <= n && p[k] == '\\' &&
+          p[k + 1] == 'u') {
+        size_t next = k + 2;
+        uint32_t lo = helper_toon::parse_unicode_codepoint(p, n, next, unused);
+        if (unused.empty() && lo >= 0xdc00 && lo <= 0xdfff) {
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+          k = next;
+        }
+      }
+      helper_toon::encode_utf8(cp, out);
+    }
+    return out;
+  }
 
-      consume_whitespace();
+  static bool same_key(StringView a, StringView b, string &x, string &y) {
+    if (a == b)
+      return true;
+    if (!memchr(a.data(), '\\', a.size()) && !memchr(b.data(), '\\', b.size()))
+      return false;
+    return unescape(a, x) == unescape(b, y);
+  }
 
-      if (i < str.size() && str[i] == '\n') {
-        // Valore su una nuova riga (nested object o array)
-        i++;               // skip \n
-        consume_garbage(); // posizionati all'inizio della riga successiva
+  bool number(Writer *out) {
+    const size_t start = i;
+    if (s[i] != '-' && (s[i] < '0' || s[i] > '9'))
+      return fail("invalid value");
+    if (s[i] == '-')
+      ++i;
+    auto digits = [&] {
+      const size_t from = i;
+      while (i < len && s[i] >= '0' && s[i] <= '9')
+        ++i;
+      return i > from;
+    };
+    if (i < len && s[i] == '0')
+      ++i;
+    else if (!digits())
+      return fail("invalid number");
+    bool integral = true;
+    if (i < len && s[i] == '.') {
+      ++i;
+      integral = false;
+      if (!digits())
+        return fail("invalid number");
+    }
+    if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+      ++i;
+      integral = false;
+      if (i < len && (s[i] == '+' || s[i] == '-'))
+        ++i;
+      if (!digits())
+        return fail("invalid number");
+    }
+    if (!out)
+      return true;
+    bool negative;
+    uint64_t magnitude;
+    if (integral &&
+        helper_toon::parse_integer(s + start, i - start, negative, magnitude) &&
+        (!negative || magnitude <= uint64_t(1) << 63)) {
+      if (negative)
+        out->value(static_cast<long long>(0 - magnitude));
+      else
+        out->value(static_cast<unsigned long long>(magnitude));
+      return true;
+    }
+    double d;
+    helper_toon::parse_double(s + start, i - start, d);
+    out->value(d);
+    return true;
+  }
 
-        // Importante: ricalcoliamo l'indentazione del contenuto annidato
-        int nested_indent = get_indent();
+  bool literal(const char *word, size_t n) {
+    if (len - i < n || memcmp(s + i, word, n) != 0)
+      return fail("invalid value");
+    i += n;
+    return true;
+  }
 
-        if (str[i] == '[') {
-          // PASSAGGIO CHIAVE: passiamo nested_indent (o current_indent)
-          // Solitamente l'array è indentato rispetto alla chiave che lo
-          // contiene. Se la sintassi è: key:
-          //   [3]: ...
-          // Allora nested_indent è corretto.
-          obj[key] = parse_array(current_indent);
-        } else {
-          obj[key] = parse_object(current_indent);
-        }
-      } else {
-        // Valore inline
-        if (str[i] == '[') {
-          // Array inline sulla stessa riga: key: [3]: ...
-          // In questo caso passiamo current_indent perché fa parte della stessa
-          // riga logica
-          obj[key] = parse_array(current_indent);
-        } else {
-          obj[key] = parse_value();
+  // Reads one value; writes it to `out` unless null, when only scanning.
+  bool value(Writer *out) {
+    ws();
+    if (i == len)
+      return fail("expected a value");
+    switch (s[i]) {
+    case '{':
+    case '[': {
+      const Nested level(nesting);
+      if (nesting > kDefaultMaxDepth)
+        return fail(too_deep(kDefaultMaxDepth).c_str());
+      return s[i] == '{' ? object(out) : array(out);
+    }
+    case '"': {
+      StringView raw;
+      if (!string_token(raw))
+        return false;
+      if (out)
+        out->value(StringView(unescape(raw, scratch)));
+      return true;
+    }
+    case 't':
+    case 'f': {
+      const bool v = s[i] == 't';
+      if (!(v ? literal("true", 4) : literal("false", 5)))
+        return false;
+      if (out)
+        out->value(v);
+      return true;
+    }
+    case 'n':
+      if (!literal("null", 4))
+        return false;
+      if (out)
+        out->value(nullptr);
+      return true;
+    default:
+      return number(out);
+    }
+  }
+
+  // Calls `member(raw_key)` with i at each member's value.
+  template <class F> bool members(F member) {
+    ++i; // {
+    ws();
+    if (i < len && s[i] == '}') {
+      ++i;
+      return true;
+    }
+    while (true) {
+      ws();
+      StringView raw;
+      if (i == len || s[i] != '"')
+        return fail("expected a key");
+      if (!string_token(raw) || !expect(':', "expected ':'") || !member(raw))
+        return false;
+      ws();
+      if (i < len && s[i] == ',') {
+        ++i;
+        continue;
+      }
+      return expect('}', "expected ',' or '}'");
+    }
+  }
+
+  bool object(Writer *out) {
+    ++objects;
+    if (!out)
+      return members([&](StringView) { return value(nullptr); });
+    out->begin_object();
+    const bool ok = members([&](StringView raw) {
+      out->key(unescape(raw, scratch));
+      return value(out);
+    });
+    if (ok)
+      out->end_object();
+    return ok;
+  }
+
+  // Calls `element()` with i at each element.
+  template <class F> bool elements(F element) {
+    ++i; // [
+    ws();
+    if (i < len && s[i] == ']') {
+      ++i;
+      return true;
+    }
+    while (true) {
+      if (!element())
+        return false;
+      ws();
+      if (i < len && s[i] == ',') {
+        ++i;
+        continue;
+      }
+      return expect(']', "expected ',' or ']'");
+    }
+  }
+
+  // Scans the array at i, validating it, and records it and the arrays
+  // nested in it.
+  bool scan_array() {
+    const size_t index = infos.size();
+    infos.push_back(ArrayInfo{0, true, 0, 0});
+    const bool ok = elements([&] {
+      ArrayInfo &info = infos[index];
+      const size_t n = info.count++;
+      ws();
+      if (!info.tabular || i == len || s[i] != '{') {
+        infos[index].tabular = false;
+        return value(nullptr);
+      }
+      // Compare the keys with the first element's as they come. Those are
+      // appended once the element is done, after any of its nested arrays.
+      size_t k = 0;
+      vector<StringView> first;
+      const bool scanned = members([&](StringView raw) {
+        ArrayInfo &a = infos[index];
+        if (n == 0) {
+          first.push_back(raw);
+        } else if (a.tabular &&
+                   (k >= a.key_count ||
+                    !same_key(raw, keys[a.keys_begin + k], key_a, key_b))) {
+          a.tabular = false;
         }
+        ++k;
+        // Cells hold no objects, at any depth.
+        const size_t before = objects;
+        if (!value(nullptr))
+          return false;
+        if (objects != before)
+          infos[index].tabular = false;
+        return true;
+      });
+      ArrayInfo &a = infos[index];
+      if (n == 0) {
+        a.keys_begin = keys.size();
+        a.key_count = first.size();
+        keys.insert(keys.end(), first.begin(), first.end());
       }
+      if (k != a.key_count || a.key_count == 0)
+        a.tabular = false;
+      return scanned;
+    });
+    if (infos[index].count == 0)
+      infos[index].tabular = false;
+    return ok;
+  }
+
+  bool array(Writer *out) {
+    if (!out)
+      return scan_array();
+    if (next_info == infos.size()) {
+      infos.clear();
+      keys.clear();
+      next_info = 0;
+      const size_t start = i;
+      if (!scan_array())
+        return false;
+      i = start;
+    }
+    const ArrayInfo info = infos[next_info++];
+    if (!info.tabular) {
+      out->begin_array(info.count);
+      if (!elements([&] { return value(out); }))
+        return false;
+      out->end_array();
+      return true;
     }
-    return obj;
+    vector<string> names(info.key_count);
+    for (size_t k = 0; k < info.key_count; ++k)
+      unescape(keys[info.keys_begin + k], names[k]);
+    out->begin_table(names);
+    const bool ok = elements([&] {
+      ws();
+      out->begin_row();
+      if (!members([&](StringView) { return value(out); }))
+        return false;
+      out->end_row();
+      return true;
+    });
+    if (ok)
+      out->end_table();
+    return ok;
   }
+
+  const char *s;
+  size_t len;
+  size_t i = 0;
+  string &err;
+  size_t nesting = 0; // objects and arrays open around i
+  size_t objects = 0; // objects reached so far
+  string scratch, key_a, key_b;
+  vector<ArrayInfo> infos;
+  vector<StringView> keys;
+  size_t next_info = 0;
 };
 
-Toon Toon::parse(const string &in, string &err, ToonParse) {
-  ToonParser parser{in, 0, err, false};
-  parser.consume_garbage();
-  if (parser.i == in.size())
-    return Toon();
+bool json_to_toon(StringView json, Writer &out, string &err) {
+  JsonReader reader(json, err);
+  return reader.run(out);
+}
+
+bool json_to_toon(StringView json, string &out, string &err) {
+  // Through a separate buffer, so that `out` is left as it was on error.
+  string toon;
+  bool ok;
+  {
+    Writer writer(toon);
+    ok = json_to_toon(json, writer, err);
+  }
+  if (ok)
+    out += toon;
+  return ok;
+}
+
+void JsonWriter::before_value() {
+  if (m_started.empty())
+    return;
+  if (m_after_key) {
+    m_after_key = false;
+    return;
+  }
+  if (m_started.back())
+    m_out += ',';
+  m_started.back() = true;
+}
 
-  // If it starts with [ it is definitely not a top-level object
-  if (in[parser.i] == '[')
-    return parser.parse_value();
+void JsonWriter::begin_object() {
+  before_value();
+  m_out += '{';
+  m_started.push_back(false);
+}
 
-  // If it contains : it might be an object, but we need to check if it's not
-  // inside quotes/brackets For simplicity, let's assume if it has : and doesn't
-  // start with [, it's an object. Actually, unquoted strings could contain :?
-  // No, : is a special char.
-  if (in.find(':') != string::npos) {
-    return parser.parse_object(-1);
-  } else {
-    return parser.parse_value();
+void JsonWriter::on_key(StringView key) {
+  if (m_started.back())
+    m_out += ',';
+  m_started.back() = true;
+  write_escaped(key, m_out);
+  m_out += ':';
+  m_after_key = true;
+}
+
+void JsonWriter::end_object() {
+  m_out += '}';
+  m_started.pop_back();
+}
+
+void JsonWriter::begin_array(int) {
+  before_value();
+  m_out += '[';
+  m_started.push_back(false);
+}
+
+void JsonWriter::end_array() {
+  m_out += ']';
+  m_started.pop_back();
+}
+
+void JsonWriter::begin_table(const vector<string> &keys) {
+  begin_array(-1);
+  m_table_keys = keys;
+}
+
+void JsonWriter::table_row(DocArray cells) {
+  before_value();
+  m_out += '{';
+  for (size_t j = 0; j < m_table_keys.size(); ++j) {
+    if (j > 0)
+      m_out += ',';
+    write_escaped(m_table_keys[j], m_out);
+    m_out += ':';
+    write(cells[j]);
+  }
+  m_out += '}';
+}
+
+void JsonWriter::end_table() { end_array(); }
+
+void JsonWriter::on_scalar(DocValue value) {
+  before_value();
+  write(value);
+}
+
+void JsonWriter::write(DocValue value) {
+  switch (value.type()) {
+  case Toon::NUL:
+    m_out += "null";
+    break;
+  case Toon::BOOL:
+    m_out += value.bool_value() ? "true" : "false";
+    break;
+  case Toon::NUMBER:
+    if (!value.is_integer())
+      toon::dump(value.number_value(), m_out, 0);
+    else if (value.number_value() < 0)
+      helper_toon::format_int(value.int64_value(), m_out);
+    else
+      helper_toon::format_unsigned(value.uint64_value(), m_out);
+    break;
+  case Toon::STRING:
+    write_escaped(value.string_value(), m_out);
+    break;
+  case Toon::ARRAY: {
+    m_out += '[';
+    bool first = true;
+    for (DocValue item : value.array_items()) {
+      if (!first)
+        m_out += ',';
+      first = false;
+      write(item);
+    }
+    m_out += ']';
+    break;
+  }
+  case Toon::OBJECT: {
+    m_out += '{';
+    bool first = true;
+    for (const DocMember &m : value.object_items()) {
+      if (!first)
+        m_out += ',';
+      first = false;
+      write_escaped(m.key(), m_out);
+      m_out += ':';
+      write(m.value());
+    }
+    m_out += '}';
+    break;
+  }
+  }
+}
+
+bool toon_to_json(StringView toon, string &out, string &err) {
+  string json;
+  JsonWriter writer(json);
+  StreamParser parser(writer);
+  if (!parser.feed(toon) || !parser.finish()) {
+    err = parser.error();
+    return false;
   }
+  out += json.empty() ? "null" : json;
+  return true;
 }
 
 } // namespace toon
@@ -26,18 +26,239 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
 #include <initializer_list>
+#include <limits>
 #include <map>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace toon {
 
-enum ToonParse { STANDARD };
+enum ToonParse {
+  STANDARD,
+  // Objects keep their keys in document order (Toon::parse only; Document
+  // always sorts its members).
+  PRESERVE_ORDER
+};
 
 class ToonValue;
+class ToonArray;
+class ToonObject;
+struct BoundedSink;
+
+// Non-owning reference to a run of characters (a minimal C++11 stand-in for
+// std::string_view). The referenced buffer must outlive the view.
+class StringView final {
+public:
+  StringView() noexcept : m_data(""), m_size(0) {}
+  StringView(const char *s) : m_data(s), m_size(std::strlen(s)) {}
+  StringView(const char *s, size_t n) noexcept : m_data(s), m_size(n) {}
+  StringView(const std::string &s) noexcept
+      : m_data(s.data()), m_size(s.size()) {}
+
+  const char *data() const { return m_data; }
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+  const char *begin() const { return m_data; }
+  const char *end() const { return m_data + m_size; }
+  char operator[](size_t i) const { return m_data[i]; }
+  std::string str() const { return std::string(m_data, m_size); }
+
+  int compare(StringView rhs) const {
+    size_t n = m_size < rhs.m_size ? m_size : rhs.m_size;
+    int r = n ? std::memcmp(m_data, rhs.m_data, n) : 0;
+    if (r != 0)
+      return r;
+    return m_size < rhs.m_size ? -1 : (m_size > rhs.m_size ? 1 : 0);
+  }
+
+  friend bool operator==(StringView a, StringView b) {
+    return a.m_size == b.m_size &&
+           (a.m_size == 0 || std::memcmp(a.m_data, b.m_data, a.m_size) == 0);
+  }
+  friend bool operator!=(StringView a, StringView b) { return !(a == b); }
+  friend bool operator<(StringView a, StringView b) {
+    return a.compare(b) < 0;
+  }
 
+private:
+  const char *m_data;
+  size_t m_size;
+};
+
+/* Object keys
+ *
+ * Key is an immutable, reference-counted string with a precomputed hash.
+ * Keys interned by the same KeyTable share one copy of their text, so two
+ * of them are equal exactly when they are the same pointer; other keys own
+ * their text. Toon::parse interns every key it reads, which makes the keys
+ * repeated across a document's objects a single allocation.
+ */
+class Key final {
+public:
+  Key() noexcept; // ""
+  Key(const std::string &text);
+  Key(std::string &&text);
+  explicit Key(const char *text);
+  explicit Key(StringView text);
+  Key(const Key &other) noexcept : m_rep(other.m_rep) { retain(); }
+  Key(Key &&other) noexcept;
+  Key &operator=(const Key &other) noexcept;
+  Key &operator=(Key &&other) noexcept;
+  ~Key() { release(); }
+
+  const std::string &str() const { return m_rep->text; }
+  operator const std::string &() const { return m_rep->text; }
+  StringView view() const { return m_rep->text; }
+  uint32_t hash() const { return m_rep->hash; }
+
+  friend bool operator==(const Key &a, const Key &b) {
+    if (a.m_rep == b.m_rep)
+      return true;
+    if (a.m_rep->hash != b.m_rep->hash ||
+        (a.m_rep->owner && a.m_rep->owner == b.m_rep->owner))
+      return false;
+    return a.m_rep->text == b.m_rep->text;
+  }
+  friend bool operator!=(const Key &a, const Key &b) { return !(a == b); }
+  friend bool operator<(const Key &a, const Key &b) {
+    return a.m_rep != b.m_rep && a.m_rep->text < b.m_rep->text;
+  }
+  friend bool operator==(const Key &a, const std::string &b) {
+    return a.str() == b;
+  }
+  friend bool operator==(const Key &a, const char *b) { return a.str() == b; }
+  friend bool operator!=(const Key &a, const std::string &b) {
+    return a.str() != b;
+  }
+  friend bool operator!=(const Key &a, const char *b) { return a.str() != b; }
+  friend bool operator==(const Key &a, StringView b) { return a.view() == b; }
+  friend bool operator!=(const Key &a, StringView b) { return a.view() != b; }
+
+private:
+  friend class KeyTable;
+  struct Rep {
+    Rep(std::string &&text, uint32_t hash, bool immortal, uint64_t owner)
+        : refs(1), hash(hash), immortal(immortal), owner(owner),
+          text(std::move(text)) {}
+    std::atomic<long> refs;
+    uint32_t hash;
+    bool immortal;     // never counted nor freed (KeyTable::global())
+    uint64_t owner; // id of the interning KeyTable, 0 if none
+    std::string text;
+  };
+  explicit Key(Rep *rep) noexcept : m_rep(rep) {}
+  static Rep *empty() noexcept;
+  void retain() const noexcept {
+    if (!m_rep->immortal)
+      m_rep->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  void release() noexcept;
+
+  Rep *m_rep;
+};
+
+// Thread-safe interning table. Keys it hands out stay valid after the
+// table is destroyed. global() is a process-wide table whose keys are never
+// freed, meant for a bounded vocabulary of field names shared by many
+// documents.
+class KeyTable final {
+public:
+  KeyTable();
+  ~KeyTable();
+  KeyTable(const KeyTable &) = delete;
+  KeyTable &operator=(const KeyTable &) = delete;
+
+  Key intern(StringView text);
+  size_t size() const;
+
+  static KeyTable &global();
+
+private:
+  struct Impl;
+  explicit KeyTable(bool immortal);
+  std::unique_ptr<Impl> m_impl;
+};
+
+/* Instrumentation
+ *
+ * Built with -DTOON_STATS, the parser and the serializer count what they do
+ * and time their phases. Toon::parse and Toon::dump overloads return the
+ * figures for one call, and a StatsHook installed with set_stats_hook()
+ * receives them for every top-level parse and dump, for export to a metrics
+ * system. Without TOON_STATS none of this is compiled into the hot paths:
+ * the overloads leave the stats zeroed and the hook is never called.
+ */
+struct ParseStats {
+  size_t bytes = 0;        // input scanned
+  size_t nodes = 0;        // values built, containers included
+  size_t strings = 0;      // string values allocated
+  size_t string_bytes = 0; // bytes copied into them
+  size_t unescaped = 0;    // strings that had escapes to decode
+  size_t table_rows = 0;
+  size_t max_depth = 0; // deepest array or object nesting
+  double total_ms = 0;
+  double table_ms = 0;    // reading table rows
+  double unescape_ms = 0; // decoding escaped strings
+};
+
+struct DumpStats {
+  size_t bytes = 0;  // output written
+  size_t nodes = 0;  // values written, containers included
+  size_t strings = 0;
+  size_t quoted = 0; // strings that needed quotes or escapes
+  size_t table_rows = 0;
+  size_t max_depth = 0; // deepest indentation level
+  double total_ms = 0;
+  double table_ms = 0; // writing table rows
+};
+
+class StatsHook {
+public:
+  virtual ~StatsHook() {}
+  // Called on the thread that ran the parse or dump, possibly on several
+  // threads at once.
+  virtual void on_parse(const ParseStats &stats) { (void)stats; }
+  virtual void on_dump(const DumpStats &stats) { (void)stats; }
+};
+
+// Installs `hook` process-wide; nullptr removes it. The hook must stay
+// alive until it has been removed and no call to it is still running.
+void set_stats_hook(StatsHook *hook);
+// Whether the library was built with TOON_STATS.
+bool stats_enabled();
+
+/* Nesting limit
+ *
+ * Every parser (Toon::parse and its variants, Document, Parser,
+ * StreamParser, parse_binary and json_to_toon) rejects input with arrays
+ * and objects nested more than kDefaultMaxDepth levels deep through its
+ * error, instead of recursing until the stack runs out. A Parser or
+ * StreamParser can be given another limit when it is constructed. The bound
+ * applies to parsed input only: dump(), operator== and ~Toon() still
+ * recurse through values built by hand, however deep they are.
+ */
+const size_t kDefaultMaxDepth = 1000;
+
+/* Sharing across threads
+ *
+ * A Toon that no thread modifies can be read from any number of threads at
+ * once. Accessors only read, and what is built on first use (object_items()
+ * maps, table rows, lazy values, hashes) is built once under
+ * std::call_once or published atomically. Copies share strings, arrays and
+ * objects through an atomic reference count, which hot shared documents
+ * pay for on every copy; null, booleans and numbers live in the handle and
+ * have none. Reading through const references or ToonRef touches no count.
+ * Editing needs exclusive use of the handle being edited, see Copy-on-write
+ * editing.
+ */
 class Toon final {
 public:
   // Types
@@ -46,12 +267,18 @@ public:
   // Array and object typedefs
   typedef std::vector<Toon> array;
   typedef std::map<std::string, Toon> object;
+  typedef std::vector<std::pair<Key, Toon>> members;
 
   // Constructors
   Toon() noexcept;                // NUL
   Toon(std::nullptr_t) noexcept;  // NUL
   Toon(double value);             // NUMBER
-  Toon(int value);                // NUMBER
+  Toon(int value);                // NUMBER (integer)
+  Toon(long value);               // NUMBER (integer)
+  Toon(long long value);          // NUMBER (integer)
+  Toon(unsigned value);           // NUMBER (integer)
+  Toon(unsigned long value);      // NUMBER (integer)
+  Toon(unsigned long long value); // NUMBER (integer)
   Toon(bool value);               // BOOL
   Toon(const std::string &value); // STRING
   Toon(std::string &&value);      // STRING
@@ -83,6 +310,12 @@ public:
 
   Toon(void *) = delete;
 
+  Toon(const Toon &other) noexcept;
+  Toon(Toon &&other) noexcept;
+  Toon &operator=(const Toon &other) noexcept;
+  Toon &operator=(Toon &&other) noexcept;
+  ~Toon();
+
   // Accessors
   Type type() const;
 
@@ -93,8 +326,13 @@ public:
   bool is_array() const { return type() == ARRAY; }
   bool is_object() const { return type() == OBJECT; }
 
+  // Numbers written without a fraction or exponent are kept as 64-bit
+  // integers, exactly; int64_value() and uint64_value() convert the others.
+  bool is_integer() const;
   double number_value() const;
   int int_value() const;
+  int64_t int64_value() const;
+  uint64_t uint64_value() const;
   bool bool_value() const;
   const std::string &string_value() const;
   const array &array_items() const;
@@ -102,6 +340,56 @@ public:
 
   const Toon &operator[](size_t i) const;
   const Toon &operator[](const std::string &key) const;
+  // Uses the key's precomputed hash; with a key interned by the table that
+  // parsed this object the match is a pointer compare.
+  const Toon &operator[](const Key &key) const;
+
+  // Objects keep their members in one flat vector, sorted by key unless
+  // built with preserve_order, and index large ones with a hash table, so
+  // operator[] needs no std::map. object_members() is that vector, in dump
+  // order; object_items() builds the std::map view on first use.
+  // from_members() takes the members as they are: a repeated key keeps
+  // its first position and its last value.
+  static Toon from_members(members values, bool preserve_order = false);
+  const members &object_members() const;
+
+  // Tabular arrays. Toon::table() and the parser (for `[{k1, k2}]:`
+  // headers) store the keys once and the cells row-major instead of one
+  // object per row; array_items() and operator[] build the row objects
+  // lazily on first use, and dump() writes the tabular form directly.
+  // `cells` holds table_rows() * table_keys().size() values; a trailing
+  // partial row is padded with null.
+  static Toon table(std::vector<std::string> keys, array cells);
+  bool is_table() const;
+  const std::vector<std::string> &table_keys() const;
+  size_t table_rows() const;
+  const Toon &table_cell(size_t row, size_t col) const;
+
+  // Copy-on-write editing. Copies of a Toon share their arrays and objects,
+  // so every edit first makes this handle the only owner of its top level:
+  // in place when it already is, otherwise by copying that one level (the
+  // children stay shared until they are edited themselves). Tables become
+  // arrays of row objects and lazy values are built; any other value is
+  // replaced by an empty array or object.
+  array &mutable_array();
+  void push_back(Toon value);
+  // Inserts null when `key` is missing. References are valid until the
+  // next insertion or erase on this object.
+  Toon &mutable_member(const Key &key);
+  Toon &mutable_member(const std::string &key) {
+    return mutable_member(Key(key));
+  }
+  void set(const Key &key, Toon value);
+  void set(const std::string &key, Toon value) {
+    set(Key(key), std::move(value));
+  }
+  // Returns false, and leaves the value alone, when `key` is missing.
+  bool erase(const Key &key);
+  bool erase(const std::string &key) { return erase(Key(key)); }
+  // Move the contents out, copying them only when shared; leave null.
+  array take_array() &&;
+  object take_object() &&;
+  members take_members() &&;
 
   // Serialize
   void dump(std::string &out, int indent_level = 0) const;
@@ -110,36 +398,1082 @@ public:
     dump(out);
     return out;
   }
+  // Appends to `out` like dump(out) and fills `stats` (see DumpStats).
+  void dump(std::string &out, DumpStats &stats) const;
+  // Length of dump(out, indent_level) in bytes, counted without writing
+  // it: large outputs can be reserved for, or sized, up front.
+  size_t dump_size(int indent_level = 0) const;
+  // Writes dump() straight into `buf`, at most `size` bytes of it (no
+  // terminating NUL), and returns its full length, like snprintf: a result
+  // above `size` means the output was cut short and a buffer of that size
+  // is needed.
+  size_t dump_into(char *buf, size_t size) const;
+  // Appends dump() to `out` cut down to at most `max_bytes`, and returns
+  // whether nothing had to be left out. Arrays, tables and objects that do
+  // not fit keep their full count in the header, and "... K more" stands
+  // in for the K elements dropped at their end; tables drop whole rows.
+  // When nothing fits, `out` is left unchanged. For a token budget, pass
+  // its estimate in bytes (about 4 per token for typical text).
+  bool dump_truncated(std::string &out, size_t max_bytes) const;
+
+  // Same output as dump(), byte for byte, with large arrays, tables and
+  // objects (thousands of elements, rows or members) split into runs that
+  // are serialized concurrently into separate buffers and then joined.
+  // `threads` defaults to std::thread::hardware_concurrency().
+  void dump_parallel(std::string &out, unsigned threads = 0) const;
+  std::string dump_parallel(unsigned threads = 0) const {
+    std::string out;
+    dump_parallel(out, threads);
+    return out;
+  }
+  // Same, running at most `chunks` tasks through `execute`, as for
+  // parse_parallel().
+  void dump_parallel(std::string &out,
+                     const std::function<void(std::function<void()>)> &execute,
+                     unsigned chunks) const;
 
   // Parse
   static Toon parse(const std::string &in, std::string &err,
                     ToonParse strategy = ToonParse::STANDARD);
+  // Interns the keys in `keys` (for instance KeyTable::global()) instead
+  // of a table private to this parse, so they are shared across documents.
+  static Toon parse(const std::string &in, std::string &err, KeyTable &keys,
+                    ToonParse strategy = ToonParse::STANDARD);
+  // Parse `len` bytes at `data`, which need not be NUL-terminated.
+  static Toon parse(const char *data, size_t len, std::string &err,
+                    ToonParse strategy = ToonParse::STANDARD);
+  static Toon parse(const char *data, size_t len, std::string &err,
+                    KeyTable &keys, ToonParse strategy = ToonParse::STANDARD);
+  // Also fills `stats` with what the parse counted (see ParseStats).
+  static Toon parse(const std::string &in, std::string &err,
+                    ParseStats &stats,
+                    ToonParse strategy = ToonParse::STANDARD);
+  // Parses the file at `path` from a read-only mapping (see MappedFile)
+  // instead of a copy; errors opening it are reported through `err`.
+  static Toon parse_file(const std::string &path, std::string &err,
+                         ToonParse strategy = ToonParse::STANDARD);
+
+  // Lazy mode: the arrays and objects nested under keys are checked and
+  // skipped, then built on first access (operator[], array_items(), dump(),
+  // ...), again lazily one level at a time. Errors are reported exactly as
+  // by parse(). The result owns `in` until every lazy value has been built.
+  // Pays off when only part of a large document is read; reading all of it
+  // costs a skim more than parse().
+  static Toon parse_lazy(std::string in, std::string &err,
+                         ToonParse strategy = ToonParse::STANDARD);
+
+  // Parses a top-level `[{k1, k2}]:` table with its rows split at line
+  // boundaries into chunks that are parsed concurrently and then joined.
+  // The result and any error are exactly those of parse(); other documents,
+  // and tables under 1 MiB, are parsed sequentially. `threads` defaults to
+  // std::thread::hardware_concurrency().
+  static Toon parse_parallel(const std::string &in, std::string &err,
+                             unsigned threads = 0);
+  // Same, handing each of `chunks` tasks to `execute`, which must run it
+  // once on any thread (e.g. by posting it to a pool); returns when all of
+  // them have finished.
+  static Toon
+  parse_parallel(const std::string &in, std::string &err,
+                 const std::function<void(std::function<void()>)> &execute,
+                 unsigned chunks);
+
+  // Binary form, for caches and other storage that no model reads: the
+  // same values, length-prefixed, with each key written once and tables
+  // stored as typed columns under a single header, so loading does no text
+  // scanning. Objects keep their ordering mode and tables stay tables.
+  // dump_binary() appends to `out`; parse_binary() rejects other format
+  // versions and malformed input through `err`.
+  void dump_binary(std::string &out) const;
+  std::string dump_binary() const {
+    std::string out;
+    dump_binary(out);
+    return out;
+  }
+  static Toon parse_binary(StringView in, std::string &err);
+  // Reads the file at `path` through a read-only mapping (see MappedFile).
+  static Toon parse_binary_file(const std::string &path, std::string &err);
 
   bool operator==(const Toon &rhs) const;
   bool operator<(const Toon &rhs) const;
   bool operator!=(const Toon &rhs) const { return !(*this == rhs); }
 
+  // Structural hash, consistent with operator==: numbers hash by value (1
+  // and 1.0 alike), objects regardless of member order and tables like the
+  // arrays of objects they stand for. Arrays, objects and tables keep
+  // theirs once computed, and operator== then rejects unequal values by
+  // comparing the two. Also available as std::hash<Toon>.
+  uint64_t hash() const;
+
 private:
-  std::shared_ptr<ToonValue> m_ptr;
+  friend struct DumpPlan;
+  friend class Interner;
+  friend class ToonLazy;
+  friend struct BinaryWriter;
+  friend struct BoundedSink;
+  explicit Toon(std::shared_ptr<ToonValue> &&ptr) noexcept;
+  // dump(out, indent_level) into the buffer of dump_into().
+  void dump(BoundedSink &out, int indent_level) const;
+  const ToonValue *value() const;
+  void unwrap_lazy();
+  ToonArray &own_array();
+  ToonObject &own_object();
+  int compare_integers(const Toon &other) const;
+
+  // Null, booleans and numbers are stored in the handle itself; strings,
+  // arrays and objects are shared through m_ptr.
+  enum Storage : uint8_t { S_NULL, S_BOOL, S_INT64, S_UINT64, S_DOUBLE, S_PTR };
+  union {
+    bool m_bool;
+    int64_t m_int64;
+    uint64_t m_uint64; // only values above INT64_MAX
+    double m_double;
+    std::shared_ptr<ToonValue> m_ptr;
+  };
+  Storage m_storage;
+};
+
+/* Borrowed handles
+ *
+ * ToonRef refers to a Toon owned elsewhere without sharing ownership:
+ * copying it, looking values up and iterating through it touch no reference
+ * count. It stays valid while the value it was taken from is alive and
+ * unmodified, like a const Toon &, and cannot be taken from a temporary. A
+ * default ToonRef, and lookups that miss, refer to null. to_toon() takes an
+ * owning copy, which also makes ToonRef convertible to Toon.
+ */
+class ToonRef final {
+public:
+  ToonRef() noexcept; // NUL
+  ToonRef(const Toon &value) noexcept : m_value(&value) {}
+  ToonRef(Toon &&) = delete;
+
+  const Toon &get() const { return *m_value; }
+  operator const Toon &() const { return *m_value; }
+  const Toon *operator->() const { return m_value; }
+
+  Toon::Type type() const { return m_value->type(); }
+  bool is_null() const { return m_value->is_null(); }
+  bool is_number() const { return m_value->is_number(); }
+  bool is_bool() const { return m_value->is_bool(); }
+  bool is_string() const { return m_value->is_string(); }
+  bool is_array() const { return m_value->is_array(); }
+  bool is_object() const { return m_value->is_object(); }
+
+  bool is_integer() const { return m_value->is_integer(); }
+  double number_value() const { return m_value->number_value(); }
+  int int_value() const { return m_value->int_value(); }
+  int64_t int64_value() const { return m_value->int64_value(); }
+  uint64_t uint64_value() const { return m_value->uint64_value(); }
+  bool bool_value() const { return m_value->bool_value(); }
+  const std::string &string_value() const { return m_value->string_value(); }
+  const Toon::array &array_items() const { return m_value->array_items(); }
+  const Toon::members &object_members() const {
+    return m_value->object_members();
+  }
+
+  // Lookups refer into the document, or to a static null when they miss.
+  ToonRef operator[](size_t i) const { return (*m_value)[i]; }
+  ToonRef operator[](const std::string &key) const { return (*m_value)[key]; }
+  ToonRef operator[](const Key &key) const { return (*m_value)[key]; }
+
+  Toon to_toon() const { return *m_value; }
+
+private:
+  const Toon *m_value;
 };
 
 // Internal class hierarchy
 class ToonValue {
 protected:
   friend class Toon;
+  friend class ToonArray;
+  friend class ToonObject;
+  friend class ToonTable;
+  friend class ToonLazy;
+  friend struct DumpPlan;
+  friend struct BinaryWriter;
   virtual Toon::Type type() const = 0;
   virtual bool equals(const ToonValue *other) const = 0;
   virtual bool less(const ToonValue *other) const = 0;
   virtual void dump(std::string &out, int indent_level) const = 0;
-  virtual double number_value() const;
-  virtual int int_value() const;
-  virtual bool bool_value() const;
+  virtual void dump(BoundedSink &out, int indent_level) const = 0;
+  virtual size_t dump_size(int indent_level) const = 0;
+  virtual uint64_t hash() const = 0;
+  // The hash if already computed and kept, else 0.
+  virtual uint64_t cached_hash() const;
   virtual const std::string &string_value() const;
   virtual const Toon::array &array_items() const;
   virtual const Toon &operator[](size_t i) const;
   virtual const Toon::object &object_items() const;
+  virtual const Toon::members &object_members() const;
   virtual const Toon &operator[](const std::string &key) const;
+  virtual const Toon &operator[](const Key &key) const;
+  virtual bool is_table() const;
+  virtual const std::vector<std::string> &table_keys() const;
+  virtual size_t table_rows() const;
+  virtual const Toon &table_cell(size_t row, size_t col) const;
+  // The value this one stands for; other than `this` only for values that
+  // are built on first use (Toon::parse_lazy).
+  virtual const ToonValue *resolved() const;
   virtual ~ToonValue() {}
 };
 
+/* File input
+ *
+ * MappedFile gives read-only access to a whole file without copying it into
+ * a std::string: it is memory-mapped on POSIX systems and read into one
+ * heap buffer elsewhere. Toon::parse_file() parses straight from the
+ * mapping; Document::parse_file() keeps it open so that the document's
+ * strings can point into it.
+ */
+class MappedFile final {
+public:
+  MappedFile() noexcept;
+  MappedFile(MappedFile &&other) noexcept;
+  MappedFile &operator=(MappedFile &&other) noexcept;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile();
+
+  // Replaces the current contents with the file at `path`. On failure
+  // sets `err`, leaves the object empty and returns false.
+  bool open(const std::string &path, std::string &err);
+  void close();
+
+  const char *data() const { return m_data; }
+  size_t size() const { return m_size; }
+  StringView view() const { return StringView(m_data, m_size); }
+
+private:
+  const char *m_data;
+  size_t m_size;
+  bool m_mapped; // otherwise m_data was allocated with new[]
+};
+
+/* Arena-backed documents
+ *
+ * Document is an opt-in alternative to the shared_ptr based Toon tree: every
+ * node, string and child list produced by one parse lives in a bump-allocated
+ * Arena and is released in one shot when the Document is destroyed. Values
+ * are read through lightweight DocValue handles that mirror the Toon
+ * accessors; DocValue::to_toon() converts a subtree back into a Toon.
+ */
+
+// Bump allocator handing out memory from a chain of blocks. Individual
+// allocations are never freed; reset() and the destructor release
+// everything at once.
+class Arena final {
+public:
+  explicit Arena(size_t block_size = 64 * 1024);
+  Arena(Arena &&other) noexcept;
+  Arena &operator=(Arena &&other) noexcept;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  ~Arena();
+
+  void *allocate(size_t size, size_t align = alignof(double));
+  template <class T> T *allocate_array(size_t n) {
+    return static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+  }
+  const char *copy_string(const char *data, size_t size);
+
+  // Releases all blocks but the last one, which is kept for reuse.
+  void reset();
+  // Total bytes reserved from the system allocator.
+  size_t capacity() const { return m_capacity; }
+
+private:
+  struct Block {
+    Block *next;
+    size_t size;
+  };
+  void release(Block *keep);
+
+  Block *m_blocks;
+  char *m_cur;
+  char *m_end;
+  size_t m_block_size;
+  size_t m_capacity;
+};
+
+// Internal node layout of a Document. Strings reference `size` chars,
+// arrays `size` contiguous DocNodes and objects `size` DocMembers sorted by
+// key.
+struct DocMember;
+struct DocNode {
+  uint32_t size;
+  uint8_t type;        // Toon::Type
+  uint8_t number_kind; // NUMBER: 0 double, 1 int64, 2 uint64
+  union {
+    double number;
+    int64_t int64;
+    uint64_t uint64;
+    bool boolean;
+    const char *chars;
+    const DocNode *items;
+    const DocMember *members;
+  };
+};
+
+class DocArray;
+class DocObject;
+
+class DocValue final {
+public:
+  DocValue() noexcept : m_node(nullptr) {} // NUL
+  explicit DocValue(const DocNode *node) noexcept : m_node(node) {}
+
+  Toon::Type type() const;
+
+  bool is_null() const { return type() == Toon::NUL; }
+  bool is_number() const { return type() == Toon::NUMBER; }
+  bool is_bool() const { return type() == Toon::BOOL; }
+  bool is_string() const { return type() == Toon::STRING; }
+  bool is_array() const { return type() == Toon::ARRAY; }
+  bool is_object() const { return type() == Toon::OBJECT; }
+
+  bool is_integer() const;
+  double number_value() const;
+  int int_value() const;
+  int64_t int64_value() const;
+  uint64_t uint64_value() const;
+  bool bool_value() const;
+  StringView string_value() const;
+  DocArray array_items() const;
+  DocObject object_items() const;
+
+  DocValue operator[](size_t i) const;
+  DocValue operator[](StringView key) const;
+
+  // Deep copy into the shared_ptr model; also makes DocValue implicitly
+  // convertible to Toon.
+  Toon to_toon() const;
+
+private:
+  const DocNode *m_node;
+};
+
+struct DocMember {
+  const char *key_chars;
+  uint32_t key_size;
+  DocNode node;
+
+  StringView key() const { return StringView(key_chars, key_size); }
+  DocValue value() const { return DocValue(&node); }
+};
+
+class DocArray final {
+public:
+  class iterator {
+  public:
+    explicit iterator(const DocNode *p) : m_p(p) {}
+    DocValue operator*() const { return DocValue(m_p); }
+    iterator &operator++() {
+      ++m_p;
+      return *this;
+    }
+    bool operator==(const iterator &o) const { return m_p == o.m_p; }
+    bool operator!=(const iterator &o) const { return m_p != o.m_p; }
+
+  private:
+    const DocNode *m_p;
+  };
+
+  DocArray() : m_items(nullptr), m_size(0) {}
+  DocArray(const DocNode *items, size_t size) : m_items(items), m_size(size) {}
+
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+  DocValue operator[](size_t i) const {
+    return i < m_size ? DocValue(m_items + i) : DocValue();
+  }
+  iterator begin() const { return iterator(m_items); }
+  iterator end() const { return iterator(m_items + m_size); }
+
+private:
+  const DocNode *m_items;
+  size_t m_size;
+};
+
+class DocObject final {
+public:
+  DocObject() : m_members(nullptr), m_size(0) {}
+  DocObject(const DocMember *members, size_t size)
+      : m_members(members), m_size(size) {}
+
+  size_t size() const { return m_size; }
+  bool empty() const { return m_size == 0; }
+  const DocMember *begin() const { return m_members; }
+  const DocMember *end() const { return m_members + m_size; }
+  // Binary search over the sorted members; nullptr when absent.
+  const DocMember *find(StringView key) const;
+
+private:
+  const DocMember *m_members;
+  size_t m_size;
+};
+
+class Document final {
+public:
+  Document() noexcept;
+  Document(Document &&other) noexcept;
+  Document &operator=(Document &&other) noexcept;
+
+  static Document parse(const std::string &in, std::string &err,
+                        ToonParse strategy = ToonParse::STANDARD);
+  // Zero-copy mode: unescaped strings and keys are views into `in`, only
+  // escaped strings are decoded into the arena. The caller guarantees that
+  // the buffer outlives the document.
+  static Document parse_view(StringView in, std::string &err,
+                             ToonParse strategy = ToonParse::STANDARD);
+  // Zero-copy parse of the file at `path`. The document keeps the file
+  // mapped for as long as it lives, so no string is copied unless it has
+  // escapes.
+  static Document parse_file(const std::string &path, std::string &err,
+                             ToonParse strategy = ToonParse::STANDARD);
+
+  DocValue root() const { return DocValue(m_root); }
+  DocValue operator[](size_t i) const { return root()[i]; }
+  DocValue operator[](StringView key) const { return root()[key]; }
+
+  // Bytes reserved by the arena backing this document.
+  size_t memory_usage() const { return m_arena.capacity(); }
+
+private:
+  Document(StringView in, std::string &err, bool zero_copy);
+
+  MappedFile m_file;
+  Arena m_arena;
+  const DocNode *m_root;
+};
+
+/* Reusable parser
+ *
+ * A Parser keeps what parsing allocates for itself from one call to the
+ * next: the key table and its lookup cache, the buffer escaped strings are
+ * decoded into, the document builder's staging vectors and its arena. A
+ * server parsing many small messages on one thread then allocates only the
+ * values themselves with parse(), and nothing at all with parse_view() once
+ * the arena is large enough. Not thread safe: use one Parser per thread.
+ */
+class Parser final {
+public:
+  // Input nested more than `max_depth` levels deep fails to parse.
+  explicit Parser(ToonParse strategy = ToonParse::STANDARD,
+                  size_t max_depth = kDefaultMaxDepth);
+  ~Parser();
+  Parser(const Parser &) = delete;
+  Parser &operator=(const Parser &) = delete;
+
+  // Same result as Toon::parse(). Keys are interned in the parser's table,
+  // so the values of successive parses share them.
+  Toon parse(StringView in, std::string &err);
+  // Zero-copy parse as Document::parse_view, into the parser's arena. The
+  // arena is reset by each call, so the result is only valid until the
+  // next parse_view() or the parser's destruction, and `in` must outlive
+  // it. Objects are always sorted.
+  DocValue parse_view(StringView in, std::string &err);
+
+  // Bytes held for reuse.
+  size_t memory_usage() const;
+  // Releases everything held; the next parse starts from scratch.
+  void clear();
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> m_impl;
+};
+
+/* Hash-consing
+ *
+ * An Interner deduplicates values: intern() returns a value equal to its
+ * argument whose strings, arrays, objects and tables, at every depth, are
+ * the ones of an equal value interned before when there is one. Repeated
+ * subtrees are then stored once and compare equal by pointer. The interner
+ * holds a reference to every distinct value it has seen until clear().
+ * Not thread safe.
+ */
+class Interner final {
+public:
+  Interner();
+  ~Interner();
+  Interner(const Interner &) = delete;
+  Interner &operator=(const Interner &) = delete;
+
+  Toon intern(const Toon &value);
+  // Distinct strings, arrays, objects and tables held.
+  size_t size() const;
+  void clear();
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> m_impl;
+};
+
+/* Streaming parser
+ *
+ * StreamParser consumes TOON text incrementally, in chunks of any size, and
+ * reports its structure to a ToonHandler instead of building a tree. Memory
+ * use is bounded by the longest line and the nesting depth, so tabular
+ * datasets can be processed row by row.
+ *
+ * Input is processed line by line: quoted strings must not contain raw
+ * newlines (Toon::dump always escapes them). A document whose first line
+ * has no ':' is read as a single scalar.
+ */
+
+// Event callbacks. StringView and DocValue arguments point into the parser's
+// buffers and are only valid for the duration of the call.
+class ToonHandler {
+public:
+  virtual ~ToonHandler() {}
+  virtual void begin_object() {}
+  virtual void on_key(StringView key) { (void)key; }
+  virtual void end_object() {}
+  // `count` is the declared length of `[N]:`, or -1 when missing.
+  virtual void begin_array(int count) { (void)count; }
+  virtual void end_array() {}
+  // `[{k1, k2}]:` header; each following row is reported as one call with
+  // one cell per key.
+  virtual void begin_table(const std::vector<std::string> &keys) {
+    (void)keys;
+  }
+  virtual void table_row(DocArray cells) { (void)cells; }
+  virtual void end_table() {}
+  virtual void on_scalar(DocValue value) { (void)value; }
+};
+
+class StreamParser final {
+public:
+  // Input nested more than `max_depth` levels deep fails to parse.
+  explicit StreamParser(ToonHandler &handler,
+                        size_t max_depth = kDefaultMaxDepth);
+  ~StreamParser();
+
+  // Both return false once an error has been found; see error().
+  bool feed(const char *data, size_t len);
+  bool feed(StringView chunk) { return feed(chunk.data(), chunk.size()); }
+  // Flushes the last line and closes every open container.
+  bool finish();
+
+  const std::string &error() const;
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> m_impl;
+};
+
+/* Path queries
+ *
+ * A Path is compiled once from an expression and can then be run against
+ * any number of documents. Steps are separated by '.' or bracketed:
+ *
+ *   users[*].email   every user's email
+ *   users[0].name    the first user's name; [-1] is the last element
+ *   config.*         the value of every member of config
+ *   ["a.b"].c        quoted keys may contain any character
+ *
+ * On tabular arrays, `[*].key` and `[N].key` read the column straight from
+ * the table's cells without building the row objects. PathHandler runs a
+ * Path over StreamParser events and ignores everything outside the
+ * subtrees it can still match.
+ */
+class Path final {
+public:
+  Path() {} // matches the root itself
+  // Compiles `expr`. A syntax error is reported through `err` and leaves a
+  // path that matches nothing.
+  Path(const std::string &expr, std::string &err);
+  explicit Path(const std::string &expr);
+
+  // Matches in document order; the pointers are valid while `root` lives.
+  std::vector<const Toon *> select(const Toon &root) const;
+  // Appends the matches to `out`, so the vector can be reused.
+  void select(const Toon &root, std::vector<const Toon *> &out) const;
+  // The first match, or null.
+  const Toon &first(const Toon &root) const;
+
+  std::vector<DocValue> select(DocValue root) const;
+  void select(DocValue root, std::vector<DocValue> &out) const;
+
+private:
+  friend class PathHandler;
+  bool compile(const std::string &expr, std::string &err);
+  template <class Visit>
+  bool walk(const Toon &value, size_t step, Visit &visit) const;
+  template <class Visit>
+  bool walk(DocValue value, size_t step, Visit &visit) const;
+
+  struct Step {
+    enum Kind : uint8_t { KEY, INDEX, ALL } kind;
+    long index; // INDEX; negative values count from the end
+    Key key;    // KEY
+  };
+  std::vector<Step> m_steps;
+  bool m_valid = true;
+};
+
+// Calls `on_match` for every value `path` matches in the event stream:
+// scalars, and table cells (which may be inline arrays). Matches are only
+// valid during the call. Other arrays and objects arrive as events, so they
+// are not reported as a whole; paths should end at the values inside them.
+// Negative indexes only match in arrays with a declared length.
+class PathHandler final : public ToonHandler {
+public:
+  PathHandler(const Path &path, std::function<void(DocValue)> on_match);
+
+  void begin_object() override;
+  void on_key(StringView key) override;
+  void end_object() override;
+  void begin_array(int count) override;
+  void end_array() override;
+  void begin_table(const std::vector<std::string> &keys) override;
+  void table_row(DocArray cells) override;
+  void end_table() override;
+  void on_scalar(DocValue value) override;
+
+private:
+  struct Frame {
+    bool object;
+    int step;     // step the children are matched against, -1 for none
+    size_t count; // arrays and tables: children seen so far
+    int declared; // declared array length, -1 when unknown
+    int column;   // tables: column selected by the step after `step`,
+                  // -1 for every column, -2 for none
+  };
+  int child_step();
+  void open(bool object, int declared = -1);
+  void match(DocValue value, size_t step);
+
+  Path m_path;
+  std::function<void(DocValue)> m_on_match;
+  std::vector<Frame> m_frames;
+  int m_pending; // objects: step for the value of the last key
+};
+
+/* Streaming serializer
+ *
+ * Writer emits TOON incrementally through a fixed-size buffer into a sink,
+ * so large documents never need to exist as a Toon tree or as one string.
+ * Output is formatted exactly like Toon::dump. Containers are opened and
+ * closed explicitly; begin_table() declares the keys once and rows are then
+ * pushed one at a time.
+ */
+
+class ToonSink {
+public:
+  virtual ~ToonSink() {}
+  // Returns false on failure; the writer then stops writing.
+  virtual bool write(const char *data, size_t len) = 0;
+};
+
+class Writer final {
+public:
+  explicit Writer(ToonSink &sink, size_t buffer_size = 64 * 1024);
+  explicit Writer(std::FILE *file, size_t buffer_size = 64 * 1024);
+  explicit Writer(int fd, size_t buffer_size = 64 * 1024);
+  // Appends to `out`.
+  explicit Writer(std::string &out, size_t buffer_size = 64 * 1024);
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+  ~Writer(); // flushes
+
+  // Objects: key() precedes every member value.
+  void begin_object();
+  void key(StringView key);
+  void end_object();
+
+  // `[N]: v1, v2, ...`; exactly `count` values must follow.
+  void begin_array(size_t count);
+  void end_array();
+
+  // `[{k1, k2}]:` followed by one line per row. Rows can be pushed whole or
+  // cell by cell between begin_row() and end_row().
+  void begin_table(const std::vector<std::string> &keys);
+  void begin_row();
+  void end_row();
+  void row(std::initializer_list<Toon> cells);
+  void row(const Toon::array &cells);
+  void end_table();
+
+  // Scalars, or a complete value serialized as Toon::dump would.
+  void value(std::nullptr_t);
+  void value(bool v);
+  void value(int v);
+  void value(long v);
+  void value(long long v);
+  void value(unsigned v);
+  void value(unsigned long v);
+  void value(unsigned long long v);
+  void value(double v);
+  void value(StringView v);
+  void value(const char *v) { value(StringView(v)); }
+  void value(const std::string &v) { value(StringView(v)); }
+  void value(const Toon &v);
+
+  // Hands buffered output to the sink.
+  bool flush();
+  // False once the sink has reported a failure.
+  bool good() const { return m_good; }
+
+private:
+  enum Kind { OBJECT, ARRAY, TABLE, ROW, SCALAR };
+  struct Frame {
+    Kind kind;
+    int level;
+    size_t size; // ARRAY: declared length, ROW: number of columns
+    size_t written;
+  };
+  int before_value(Kind kind);
+  void maybe_flush() {
+    if (m_buf.size() >= m_capacity)
+      flush();
+  }
+
+  std::unique_ptr<ToonSink> m_owned;
+  ToonSink *m_sink;
+  std::string m_buf;
+  size_t m_capacity;
+  std::vector<Frame> m_frames;
+  bool m_good;
+};
+
+/* JSON transcoding
+ *
+ * Converts between JSON and TOON in one pass, with no Toon tree on either
+ * side. json_to_toon() writes through a Writer what Toon::dump would write
+ * for the same value parsed with PRESERVE_ORDER: members stay in JSON
+ * order, and arrays of objects sharing the same keys, with no object in
+ * any of their cells, become tables. An
+ * array is read ahead once, up to its closing bracket, for its length and
+ * for that check. Repeated keys in one JSON object are written as they
+ * come.
+ *
+ * JsonWriter is the reverse: a ToonHandler that appends compact JSON for
+ * what a StreamParser reports, so TOON arriving in chunks can be converted
+ * as it comes. Tables become arrays of objects.
+ */
+bool json_to_toon(StringView json, Writer &out, std::string &err);
+// Appends to `out`.
+bool json_to_toon(StringView json, std::string &out, std::string &err);
+
+class JsonWriter final : public ToonHandler {
+public:
+  // Appends to `out`, which the caller may drain between StreamParser
+  // feeds.
+  explicit JsonWriter(std::string &out) : m_out(out) {}
+
+  void begin_object() override;
+  void on_key(StringView key) override;
+  void end_object() override;
+  void begin_array(int count) override;
+  void end_array() override;
+  void begin_table(const std::vector<std::string> &keys) override;
+  void table_row(DocArray cells) override;
+  void end_table() override;
+  void on_scalar(DocValue value) override;
+
+private:
+  void before_value();
+  void write(DocValue value);
+
+  std::string &m_out;
+  // Per open container: whether something was written in it yet.
+  std::vector<bool> m_started;
+  std::vector<std::string> m_table_keys;
+  bool m_after_key = false;
+};
+
+// Appends `toon` to `out` as compact JSON.
+bool toon_to_json(StringView toon, std::string &out, std::string &err);
+
+} // namespace toon
+
+/* Struct binding
+ *
+ * TOON_FIELDS(Type, f1, f2, ...) describes the members of a struct at
+ * compile time. A std::vector of described structs is then written as a
+ * table and read back from one without building any Toon value:
+ * write_table() formats each member straight into the Writer and
+ * TableReader assigns each cell straight into its member.
+ *
+ *   struct User { int64_t id; std::string name; double score; };
+ *   TOON_FIELDS(User, id, name, score)
+ *
+ *   std::string out;
+ *   toon::dump_table(users, out);        // [{id, name, score}]: ...
+ *   toon::parse_table(out, users, err);
+ *
+ * TOON_FIELDS goes at namespace scope, in the namespace of the struct, and
+ * takes up to 32 members. Columns follow the declaration order. When
+ * reading, columns are matched to members by name: unknown columns are
+ * skipped, and members without a column or with a null cell keep the value
+ * the default constructor gave them. Members can be bool, integers,
+ * floating point, std::string or Toon; other types can provide write_field
+ * and read_field overloads in their own namespace.
+ */
+
+#define TOON_PP_EXPAND(x) x
+#define TOON_PP_CAT_(a, b) a##b
+#define TOON_PP_CAT(a, b) TOON_PP_CAT_(a, b)
+#define TOON_PP_COUNT(...)                                                     \
+  TOON_PP_EXPAND(TOON_PP_COUNT_(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25,   \
+      24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6,  \
+      5, 4, 3, 2, 1))
+#define TOON_PP_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, \
+    _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, \
+    _29, _30, _31, _32, n, ...) n
+#define TOON_PP_EACH(m, ...)                                                   \
+  TOON_PP_EXPAND(TOON_PP_CAT(TOON_PP_EACH_, TOON_PP_COUNT(__VA_ARGS__))(       \
+      m, __VA_ARGS__))
+#define TOON_PP_EACH_1(m, x) m(x)
+#define TOON_PP_EACH_2(m, x, ...)                                              \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_1(m, __VA_ARGS__))
+#define TOON_PP_EACH_3(m, x, ...)                                              \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_2(m, __VA_ARGS__))
+#define TOON_PP_EACH_4(m, x, ...)                                              \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_3(m, __VA_ARGS__))
+#define TOON_PP_EACH_5(m, x, ...)                                              \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_4(m, __VA_ARGS__))
+#define TOON_PP_EACH_6(m, x, ...)                                              \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_5(m, __VA_ARGS__))
+#define TOON_PP_EACH_7(m, x, ...)                                              \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_6(m, __VA_ARGS__))
+#define TOON_PP_EACH_8(m, x, ...)                                              \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_7(m, __VA_ARGS__))
+#define TOON_PP_EACH_9(m, x, ...)                                              \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_8(m, __VA_ARGS__))
+#define TOON_PP_EACH_10(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_9(m, __VA_ARGS__))
+#define TOON_PP_EACH_11(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_10(m, __VA_ARGS__))
+#define TOON_PP_EACH_12(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_11(m, __VA_ARGS__))
+#define TOON_PP_EACH_13(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_12(m, __VA_ARGS__))
+#define TOON_PP_EACH_14(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_13(m, __VA_ARGS__))
+#define TOON_PP_EACH_15(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_14(m, __VA_ARGS__))
+#define TOON_PP_EACH_16(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_15(m, __VA_ARGS__))
+#define TOON_PP_EACH_17(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_16(m, __VA_ARGS__))
+#define TOON_PP_EACH_18(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_17(m, __VA_ARGS__))
+#define TOON_PP_EACH_19(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_18(m, __VA_ARGS__))
+#define TOON_PP_EACH_20(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_19(m, __VA_ARGS__))
+#define TOON_PP_EACH_21(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_20(m, __VA_ARGS__))
+#define TOON_PP_EACH_22(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_21(m, __VA_ARGS__))
+#define TOON_PP_EACH_23(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_22(m, __VA_ARGS__))
+#define TOON_PP_EACH_24(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_23(m, __VA_ARGS__))
+#define TOON_PP_EACH_25(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_24(m, __VA_ARGS__))
+#define TOON_PP_EACH_26(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_25(m, __VA_ARGS__))
+#define TOON_PP_EACH_27(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_26(m, __VA_ARGS__))
+#define TOON_PP_EACH_28(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_27(m, __VA_ARGS__))
+#define TOON_PP_EACH_29(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_28(m, __VA_ARGS__))
+#define TOON_PP_EACH_30(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_29(m, __VA_ARGS__))
+#define TOON_PP_EACH_31(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_30(m, __VA_ARGS__))
+#define TOON_PP_EACH_32(m, x, ...)                                             \
+  m(x) TOON_PP_EXPAND(TOON_PP_EACH_31(m, __VA_ARGS__))
+
+#define TOON_PP_FIELD(f) visit(#f, self.f);
+#define TOON_FIELDS(Type, ...)                                                 \
+  template <class Visit> inline void toon_fields(Type &self, Visit &visit) {  \
+    TOON_PP_EACH(TOON_PP_FIELD, __VA_ARGS__)                                   \
+  }                                                                            \
+  template <class Visit>                                                       \
+  inline void toon_fields(const Type &self, Visit &visit) {                    \
+    TOON_PP_EACH(TOON_PP_FIELD, __VA_ARGS__)                                   \
+  }
+
+namespace toon {
+
+// Cell formatting, one overload per member type.
+inline void write_field(Writer &w, bool v) { w.value(v); }
+template <class F, typename std::enable_if<std::is_integral<F>::value,
+                                           int>::type = 0>
+inline void write_field(Writer &w, F v) {
+  if (std::is_signed<F>::value)
+    w.value(static_cast<long long>(v));
+  else
+    w.value(static_cast<unsigned long long>(v));
+}
+template <class F, typename std::enable_if<std::is_floating_point<F>::value,
+                                           int>::type = 0>
+inline void write_field(Writer &w, F v) {
+  w.value(static_cast<double>(v));
+}
+inline void write_field(Writer &w, const std::string &v) { w.value(v); }
+inline void write_field(Writer &w, const Toon &v) { w.value(v); }
+
+// Cell conversions; false when the cell holds another type or a number out
+// of the member's range.
+bool read_field(DocValue cell, bool &out);
+bool read_field(DocValue cell, double &out);
+bool read_field(DocValue cell, float &out);
+bool read_field(DocValue cell, std::string &out);
+bool read_field(DocValue cell, Toon &out);
+bool read_integer(DocValue cell, int64_t min, int64_t max, int64_t &out);
+bool read_unsigned(DocValue cell, uint64_t max, uint64_t &out);
+template <class F, typename std::enable_if<std::is_integral<F>::value &&
+                                               std::is_signed<F>::value,
+                                           int>::type = 0>
+inline bool read_field(DocValue cell, F &out) {
+  int64_t v;
+  if (!read_integer(cell, std::numeric_limits<F>::min(),
+                    std::numeric_limits<F>::max(), v))
+    return false;
+  out = static_cast<F>(v);
+  return true;
+}
+template <class F, typename std::enable_if<std::is_integral<F>::value &&
+                                               std::is_unsigned<F>::value &&
+                                               !std::is_same<F, bool>::value,
+                                           int>::type = 0>
+inline bool read_field(DocValue cell, F &out) {
+  uint64_t v;
+  if (!read_unsigned(cell, std::numeric_limits<F>::max(), v))
+    return false;
+  out = static_cast<F>(v);
+  return true;
+}
+
+// Visitors behind field_names() and write_table().
+struct FieldNames {
+  std::vector<std::string> names;
+  template <class F> void operator()(const char *name, const F &) {
+    names.push_back(name);
+  }
+};
+
+struct FieldWriter {
+  Writer &w;
+  template <class F> void operator()(const char *, const F &v) {
+    write_field(w, v);
+  }
+};
+
+// The member names of a described struct, in declaration order.
+template <class T> std::vector<std::string> field_names() {
+  FieldNames visit;
+  const T sample = T();
+  toon_fields(sample, visit);
+  return visit.names;
+}
+
+// Writes `rows` as one table, or as `[0]:` when there are none, at the
+// position of a value: top level, after key(), or inside an array.
+template <class T> void write_table(Writer &w, const std::vector<T> &rows) {
+  if (rows.empty()) {
+    w.begin_array(0);
+    w.end_array();
+    return;
+  }
+  w.begin_table(field_names<T>());
+  FieldWriter visit = {w};
+  for (const T &row : rows) {
+    w.begin_row();
+    toon_fields(row, visit);
+    w.end_row();
+  }
+  w.end_table();
+}
+
+template <class T>
+void dump_table(const std::vector<T> &rows, std::string &out) {
+  Writer w(out);
+  write_table(w, rows);
+}
+
+// Column bookkeeping shared by every TableReader.
+class TableReaderBase : public ToonHandler {
+public:
+  void begin_table(const std::vector<std::string> &keys) override;
+  void end_table() override;
+  // False, with the reason in `err`, if no table was read completely or a
+  // cell did not fit its member.
+  bool finish(std::string &err) const;
+
+protected:
+  explicit TableReaderBase(std::vector<std::string> fields);
+  // Starts a row; false when rows are being skipped.
+  bool begin_row();
+  // Column of the field at `index`, or -1 when the table has none.
+  int column(size_t index) const { return m_columns[index]; }
+  void fail(size_t index);
+
+private:
+  enum State { WAITING, READING, DONE };
+  std::vector<std::string> m_fields;
+  std::vector<int> m_columns;
+  State m_state;
+  size_t m_rows;
+  std::string m_error;
+};
+
+// Appends one T per row of the first table in the stream; everything
+// before and after that table is ignored. Feed it through a StreamParser.
+template <class T> class TableReader final : public TableReaderBase {
+public:
+  explicit TableReader(std::vector<T> &out)
+      : TableReaderBase(field_names<T>()), m_out(out) {}
+
+  void table_row(DocArray cells) override {
+    if (!begin_row())
+      return;
+    m_out.emplace_back();
+    Cells visit = {*this, cells, 0};
+    toon_fields(m_out.back(), visit);
+  }
+
+private:
+  struct Cells {
+    TableReader &reader;
+    DocArray cells;
+    size_t index;
+    template <class F> void operator()(const char *, F &v) {
+      int col = reader.column(index++);
+      if (col < 0 || cells[col].is_null())
+        return;
+      if (!read_field(cells[col], v))
+        reader.fail(index - 1);
+    }
+  };
+  std::vector<T> &m_out;
+};
+
+// Parses the first table in `in` into `out`, appending one T per row.
+template <class T>
+bool parse_table(StringView in, std::vector<T> &out, std::string &err) {
+  TableReader<T> reader(out);
+  StreamParser parser(reader);
+  if (!parser.feed(in) || !parser.finish()) {
+    err = parser.error();
+    return false;
+  }
+  return reader.finish(err);
+}
+
 } // namespace toon
+
+namespace std {
+template <> struct hash<toon::Toon> {
+  size_t operator()(const toon::Toon &value) const {
+    return static_cast<size_t>(value.hash());
+  }
+};
+} // namespace std
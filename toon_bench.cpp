@@ -0,0 +1,825 @@
+/*
+ * TOON (Token-Oriented Object Notation) Library for C++11
+ *
+ * Copyright (c) 2025 Gemini + Emanuele Luzzu
+ *
+ * This software is released under the MIT License.
+ * See the LICENSE file in the project root for full license information.
+ *
+ * Based on the [Json11](https://github.com/dropbox/json11) API design by
+ * Dropbox, Inc.
+ */
+
+/* Benchmarks (POSIX only: every case runs in a forked child so that its peak
+ * RSS can be reported independently). Each line reports the time, the
+ * throughput, the number of heap allocations made by the timed work, the
+ * time taken to destroy its result and the peak RSS growth.
+ *
+ *   g++ -std=c++11 -O2 -pthread toon.cpp toon_bench.cpp -o toon_bench
+ *   ./toon_bench [rows]
+ *
+ * To compare with json11 on the equivalent JSON documents, put json11.hpp
+ * and json11.cpp next to this file and build with -DTOON_BENCH_JSON11:
+ *
+ *   g++ -std=c++11 -O2 -pthread -DTOON_BENCH_JSON11 toon.cpp json11.cpp \
+ *       toon_bench.cpp -o toon_bench
+ */
+
+#include "toon.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef TOON_BENCH_JSON11
+#include "json11.hpp"
+#endif
+
+using namespace toon;
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static double ms_since(Clock::time_point start) {
+  return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+// Current resident set size in KiB, read from /proc/self/statm.
+static long current_rss_kb() {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Allocation counting */
+
+// Every operator new in the process goes through here; timed() reads the
+// count around the work it measures.
+static std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+// All of these release what the malloc() above returned.
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+/* Workloads */
+
+static string tabular_payload(size_t rows) {
+  string out = "[{active, email, id, name, score}]:\n";
+  char buf[160];
+  for (size_t i = 0; i < rows; ++i) {
+    snprintf(buf, sizeof buf,
+             "  %s, user%zu@example.com, %zu, User %zu, %zu.5\n",
+             i % 3 ? "true" : "false", i, i, i, i % 1000);
+    out += buf;
+  }
+  return out;
+}
+
+// Many columns per row, so every row is a long line.
+static string wide_payload(size_t rows, size_t cols) {
+  string out = "data:\n  [{";
+  for (size_t j = 0; j < cols; ++j)
+    out += (j ? ", c" : "c") + to_string(j);
+  out += "}]:\n";
+  for (size_t i = 0; i < rows; ++i) {
+    out += "    ";
+    for (size_t j = 0; j < cols; ++j)
+      out += (j ? ", " : "") + to_string((i * 31 + j) % 100000);
+    out += "\n";
+  }
+  return out;
+}
+
+// One nested object per record, with the same long field names each time.
+static string object_payload(size_t rows) {
+  string out;
+  char buf[200];
+  for (size_t i = 0; i < rows; ++i) {
+    snprintf(buf, sizeof buf,
+             "record%zu:\n  customer_identifier: %zu\n"
+             "  shipping_address_line: street %zu\n  order_status: open\n",
+             i, i, i % 500);
+    out += buf;
+  }
+  return out;
+}
+
+// Long free-text cells; every fourth one is quoted and carries escapes.
+static string text_payload(size_t rows) {
+  static const char words[] = "lorem ipsum dolor sit amet consectetur "
+                              "adipiscing elit sed do eiusmod tempor ";
+  string out = "[{id, text}]:\n";
+  for (size_t i = 0; i < rows; ++i) {
+    out += "  " + to_string(i) + ", ";
+    bool quoted = i % 4 == 0;
+    if (quoted)
+      out += '"';
+    for (int k = 0; k < 6; ++k)
+      out += words;
+    if (quoted)
+      out += "a, b\\n \\\"c\\\"\"";
+    out += "\n";
+  }
+  return out;
+}
+
+// A request envelope: a few routing fields and a large nested body.
+static string envelope_payload(size_t rows) {
+  string out = "route: /orders\ntenant: acme\npriority: 3\nbody:\n";
+  out += "  customer:\n    name: Ann\n    tier: gold\n";
+  out += "  lines:\n    [{sku, qty, price, note}]:\n";
+  char buf[120];
+  for (size_t i = 0; i < rows; ++i) {
+    snprintf(buf, sizeof buf, "      sku-%zu, %zu, %zu.25, line %zu ok\n", i,
+             i % 7, i % 500, i);
+    out += buf;
+  }
+  out += "trace:\n  [3]: a, b, c\n";
+  return out;
+}
+
+// `count` trees of objects nested `depth` levels deep.
+static string nested_payload(size_t count, int depth) {
+  Toon::object top;
+  for (size_t i = 0; i < count; ++i) {
+    Toon node = Toon::object{{"leaf", static_cast<int>(i)},
+                             {"name", "node " + to_string(i)}};
+    for (int d = 0; d < depth; ++d)
+      node = Toon::object{{"child", node}, {"level", d}, {"tag", "t"}};
+    top["tree" + to_string(i)] = node;
+  }
+  return Toon(top).dump();
+}
+
+// Integers of every size, negative values, decimals and exponents.
+static string numeric_payload(size_t rows) {
+  string out = "[{count, delta, ratio, tiny, total}]:\n";
+  char buf[160];
+  for (size_t i = 0; i < rows; ++i) {
+    snprintf(buf, sizeof buf, "  %zu, -%zu, %zu.%03zu, %.6e, %llu\n", i % 100,
+             i * 7919 % 100003, i % 1000, i % 997, (i + 1) * 1.5e-9,
+             static_cast<unsigned long long>(i) * 2862933555777941757ull);
+    out += buf;
+  }
+  return out;
+}
+
+// Long `[N]:` arrays of numbers and short words.
+static string inline_payload(size_t arrays, size_t length) {
+  Toon::object top;
+  for (size_t a = 0; a < arrays; ++a) {
+    Toon::array values;
+    for (size_t i = 0; i < length; ++i)
+      values.push_back(i % 4 ? Toon(static_cast<int>(i * a % 10007))
+                             : Toon("w" + to_string(i % 89)));
+    top["series" + to_string(a)] = values;
+  }
+  return Toon(top).dump();
+}
+
+/* Cases */
+
+struct Timing {
+  double run_ms;
+  double destroy_ms;
+  size_t allocs; // made by `make`
+};
+
+// Times `make` and then the destruction of what it returned.
+// The result's storage is allocated up front, outside the count.
+template <class T, class F> static Timing timed(F make) {
+  void *storage = ::operator new(sizeof(T));
+  size_t allocs0 = allocations.load(std::memory_order_relaxed);
+  Clock::time_point t0 = Clock::now();
+  T *value = new (storage) T(make());
+  Timing r;
+  r.run_ms = ms_since(t0);
+  r.allocs = allocations.load(std::memory_order_relaxed) - allocs0;
+  Clock::time_point t1 = Clock::now();
+  value->~T();
+  ::operator delete(storage);
+  r.destroy_ms = ms_since(t1);
+  return r;
+}
+
+// The tabular payload's rows as a typed record, convertible through
+// to_toon() or described for dump_table()/parse_table().
+struct User {
+  bool active;
+  string email;
+  int64_t id;
+  string name;
+  double score;
+
+  Toon to_toon() const {
+    return Toon::object{{"active", active},
+                        {"email", email},
+                        {"id", id},
+                        {"name", name},
+                        {"score", score}};
+  }
+};
+TOON_FIELDS(User, active, email, id, name, score)
+
+struct CountingHandler : ToonHandler {
+  size_t rows = 0;
+  void table_row(DocArray) override { rows++; }
+};
+
+// Feeds the payload in 64 KiB chunks, as if read from a socket or file.
+static size_t stream_rows(const string &in) {
+  CountingHandler h;
+  StreamParser sp(h);
+  for (size_t off = 0; off < in.size(); off += 65536)
+    sp.feed(in.data() + off, std::min<size_t>(65536, in.size() - off));
+  sp.finish();
+  return h.rows;
+}
+
+// Runs `fn` in a child process, best of `reps` runs, and prints timings
+// together with the peak RSS growth observed by the child. `bytes` is the
+// amount of TOON text processed per run (0 for cases that parse nothing).
+static void bench(const char *name, size_t bytes, function<Timing()> fn,
+                  int reps = 3) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+#ifdef __GLIBC__
+    malloc_trim(0); // return the parent's free heap pages first
+#endif
+    long base_kb = current_rss_kb();
+    Timing best = fn();
+    for (int k = 1; k < reps; ++k) {
+      Timing t = fn();
+      if (t.run_ms + t.destroy_ms < best.run_ms + best.destroy_ms)
+        best = t;
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    char rate[32] = "";
+    if (bytes)
+      snprintf(rate, sizeof rate, "(%7.1f MB/s)",
+               bytes / (1024.0 * 1024.0) / (best.run_ms / 1000.0));
+    printf("%-24s %9.2f ms %-14s %9zu allocs  destroy %8.2f ms  "
+           "peak RSS +%ld KiB\n",
+           name, best.run_ms, rate, best.allocs, best.destroy_ms,
+           ru.ru_maxrss - base_kb);
+    fflush(stdout);
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+}
+
+// Runs `fn` `n` times and prints the median and 99th percentile latency of
+// one call, with the allocations made per call.
+static void latency(const char *name, size_t n, const function<void()> &fn) {
+  vector<double> us(n);
+  size_t allocs0 = allocations.load(std::memory_order_relaxed);
+  for (size_t k = 0; k < n; ++k) {
+    Clock::time_point t0 = Clock::now();
+    fn();
+    us[k] = ms_since(t0) * 1000;
+  }
+  double per_call =
+      double(allocations.load(std::memory_order_relaxed) - allocs0) / n;
+  sort(us.begin(), us.end());
+  printf("%-24s p50 %7.2f us  p99 %7.2f us  %8.1f allocs/call\n", name,
+         us[n / 2], us[n * 99 / 100], per_call);
+  fflush(stdout);
+}
+
+#ifdef TOON_BENCH_JSON11
+// `v` as JSON text, with json11 doing the string escaping.
+static void to_json(const Toon &v, string &out) {
+  char buf[32];
+  switch (v.type()) {
+  case Toon::NUL:
+    out += "null";
+    break;
+  case Toon::BOOL:
+    out += v.bool_value() ? "true" : "false";
+    break;
+  case Toon::NUMBER:
+    snprintf(buf, sizeof buf, "%.17g", v.number_value());
+    out += buf;
+    break;
+  case Toon::STRING:
+    json11::Json(v.string_value()).dump(out);
+    break;
+  case Toon::ARRAY:
+    out += '[';
+    for (size_t i = 0; i < v.array_items().size(); ++i) {
+      if (i)
+        out += ',';
+      to_json(v.array_items()[i], out);
+    }
+    out += ']';
+    break;
+  case Toon::OBJECT:
+    out += '{';
+    for (const auto &kv : v.object_items()) {
+      if (out.back() != '{')
+        out += ',';
+      json11::Json(kv.first).dump(out);
+      out += ':';
+      to_json(kv.second, out);
+    }
+    out += '}';
+    break;
+  }
+}
+
+// The json11 counterparts of bench_document(), on the same data as JSON.
+static void bench_json11(const Toon &doc) {
+  string json, err;
+  to_json(doc, json);
+  printf("  as JSON: %.1f MB\n", json.size() / 1048576.0);
+  bench("json11::Json::parse", json.size(), [&] {
+    return timed<json11::Json>([&] {
+      string err;
+      return json11::Json::parse(json, err);
+    });
+  });
+  const json11::Json a = json11::Json::parse(json, err);
+  const json11::Json b = json11::Json::parse(json, err);
+  bench("json11::Json::dump", json.size(),
+        [&] { return timed<string>([&] { return a.dump(); }); });
+  bench("json11 operator==", json.size(),
+        [&] { return timed<bool>([&] { return a == b; }); });
+}
+#endif
+
+// The binary form of `doc`, parsed from `in`: its size, and the cost of
+// writing and loading it (rates are per byte of the text).
+static void bench_binary(const Toon &doc, const string &in) {
+  const string bin = doc.dump_binary();
+  printf("binary: %.1f MB (%.0f%% of the text)\n", bin.size() / 1048576.0,
+         100.0 * bin.size() / in.size());
+  bench("Toon::dump_binary", in.size(),
+        [&] { return timed<string>([&] { return doc.dump_binary(); }); });
+  bench("Toon::parse_binary", in.size(), [&] {
+    return timed<Toon>([&] {
+      string err;
+      return Toon::parse_binary(bin, err);
+    });
+  });
+}
+
+// Transcoding `in` to JSON and the result back, without building a tree
+// (rates are per byte of the TOON text).
+static void bench_transcode(const string &in) {
+  string json, err;
+  toon_to_json(in, json, err);
+  bench("toon_to_json", in.size(), [&] {
+    return timed<string>([&] {
+      string out, err;
+      toon_to_json(in, out, err);
+      return out;
+    });
+  });
+  bench("json_to_toon", in.size(), [&] {
+    return timed<string>([&] {
+      string out, err;
+      json_to_toon(json, out, err);
+      return out;
+    });
+  });
+}
+
+// Dumping an array of doubles, against the "%.17g" the shortest-digits
+// formatter replaced. Rates are per byte of the dump() output.
+static void bench_doubles(const char *what, const Toon::array &values) {
+  const Toon doc(values);
+  const size_t bytes = doc.dump_size();
+  printf("doubles, %s: %zu values, %.1f MB\n", what, values.size(),
+         bytes / 1048576.0);
+  bench("Toon::dump", bytes,
+        [&] { return timed<string>([&] { return doc.dump(); }); });
+  bench("Toon::dump_size", bytes,
+        [&] { return timed<size_t>([&] { return doc.dump_size(); }); });
+  bench("snprintf %.17g", bytes, [&] {
+    return timed<string>([&] {
+      string out;
+      char buf[32];
+      for (const Toon &v : values) {
+        out.append(buf, snprintf(buf, sizeof buf, "%.17g", v.number_value()));
+        out += ", ";
+      }
+      return out;
+    });
+  });
+}
+
+// Parse, dump, and operator== between two separately parsed copies, so that
+// the comparison has to walk both trees.
+static void bench_document(const string &in) {
+  bench("Toon::parse", in.size(), [&] {
+    return timed<Toon>([&] {
+      string err;
+      return Toon::parse(in, err);
+    });
+  });
+  string err;
+  const Toon a = Toon::parse(in, err);
+  const Toon b = Toon::parse(in, err);
+  bench("Toon::dump", in.size(),
+        [&] { return timed<string>([&] { return a.dump(); }); });
+  bench("Toon::dump_size", in.size(),
+        [&] { return timed<size_t>([&] { return a.dump_size(); }); });
+  bench("dump_size + dump", in.size(), [&] {
+    return timed<string>([&] {
+      string out;
+      out.reserve(a.dump_size());
+      a.dump(out);
+      return out;
+    });
+  });
+  // An eighth of the document: the rate is per byte written.
+  const size_t budget = in.size() / 8;
+  bench("dump_truncated (1/8)", budget, [&] {
+    return timed<string>([&] {
+      string out;
+      a.dump_truncated(out, budget);
+      return out;
+    });
+  });
+  bench("Toon::operator==", in.size(),
+        [&] { return timed<bool>([&] { return a == b; }); });
+  bench_binary(a, in);
+  bench_transcode(in);
+  // One run: later ones would find the hash already kept.
+  bench("Toon::hash", in.size(),
+        [&] { return timed<uint64_t>([&] { return a.hash(); }); }, 1);
+  bench("Interner::intern x2", in.size(), [&] {
+    return timed<size_t>([&] {
+      Interner pool;
+      pool.intern(a);
+      pool.intern(b);
+      return pool.size();
+    });
+  });
+  Interner pool;
+  const Toon ia = pool.intern(a), ib = pool.intern(b);
+  bench("operator== (interned)", 0,
+        [&] { return timed<bool>([&] { return ia == ib; }); });
+#ifdef TOON_BENCH_JSON11
+  bench_json11(a);
+#endif
+}
+
+int main(int argc, char **argv) {
+  size_t rows = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+
+  const string table = tabular_payload(rows);
+  printf("tabular: %zu rows, %.1f MB\n", rows, table.size() / 1048576.0);
+  bench("Toon::parse", table.size(), [&] {
+    return timed<Toon>([&] {
+      string err;
+      return Toon::parse(table, err);
+    });
+  });
+  bench("Toon::parse_parallel", table.size(), [&] {
+    return timed<Toon>([&] {
+      string err;
+      return Toon::parse_parallel(table, err);
+    });
+  });
+  bench("Document::parse", table.size(), [&] {
+    return timed<Document>([&] {
+      string err;
+      return Document::parse(table, err);
+    });
+  });
+  bench("Document::parse_view", table.size(), [&] {
+    return timed<Document>([&] {
+      string err;
+      return Document::parse_view(table, err);
+    });
+  });
+  bench("StreamParser", table.size(),
+        [&] { return timed<size_t>([&] { return stream_rows(table); }); });
+
+  // The same table loaded from a file: read into a string first, or mapped.
+  const char *path = "toon_bench.tmp";
+  FILE *f = fopen(path, "wb");
+  if (f) {
+    fwrite(table.data(), 1, table.size(), f);
+    fclose(f);
+  }
+  bench("read + Toon::parse", table.size(), [&] {
+    return timed<Toon>([&] {
+      string in, err;
+      FILE *f = fopen(path, "rb");
+      char chunk[65536];
+      size_t n;
+      while (f && (n = fread(chunk, 1, sizeof chunk, f)) > 0)
+        in.append(chunk, n);
+      if (f)
+        fclose(f);
+      return Toon::parse(in, err);
+    });
+  });
+  bench("Toon::parse_file", table.size(), [&] {
+    return timed<Toon>([&] {
+      string err;
+      return Toon::parse_file(path, err);
+    });
+  });
+  bench("Document::parse_file", table.size(), [&] {
+    return timed<Document>([&] {
+      string err;
+      return Document::parse_file(path, err);
+    });
+  });
+  remove(path);
+
+  // One column of the table, on first use (one run each, in a fresh child):
+  // a loop over the rows, which builds the row objects, or a compiled Path.
+  string err;
+  const Toon parsed = Toon::parse(table, err);
+  bench("rows[i][\"email\"]", 0,
+        [&] {
+          return timed<size_t>([&] {
+            size_t n = 0;
+            for (const Toon &row : parsed.array_items())
+              n += row["email"].string_value().size();
+            return n;
+          });
+        },
+        1);
+  const Path emails("[*].email");
+  bench("Path::select", 0,
+        [&] {
+          return timed<size_t>([&] {
+            size_t n = 0;
+            for (const Toon *email : emails.select(parsed))
+              n += email->string_value().size();
+            return n;
+          });
+        },
+        1);
+
+  // A plain array of uniform objects, which dump() has to detect as tabular.
+  const Toon objects = Toon::parse(table, err).array_items();
+  bench("Toon::dump", table.size(), [&] {
+    return timed<string>([&] { return objects.dump(); });
+  });
+  bench("Toon::dump_parallel", table.size(), [&] {
+    return timed<string>([&] { return objects.dump_parallel(); });
+  });
+  const Toon reparsed = Toon::parse(table, err);
+  bench("Toon::operator==", table.size(), [&] {
+    return timed<bool>([&] { return parsed == reparsed; });
+  });
+  bench_binary(parsed, table);
+  bench_transcode(table);
+#ifdef TOON_BENCH_JSON11
+  bench_json11(parsed);
+#endif
+
+  // Typed records: through Toon values, or bound straight to the table.
+  vector<User> users;
+  parse_table(table, users, err);
+  bench("to_toon + dump", table.size(), [&] {
+    return timed<string>([&] { return Toon(users).dump(); });
+  });
+  bench("dump_table", table.size(), [&] {
+    return timed<string>([&] {
+      string out;
+      dump_table(users, out);
+      return out;
+    });
+  });
+  bench("parse + row lookups", table.size(), [&] {
+    return timed<vector<User>>([&] {
+      string err;
+      vector<User> out;
+      const Toon doc = Toon::parse(table, err);
+      for (const Toon &row : doc.array_items()) {
+        User u;
+        u.active = row["active"].bool_value();
+        u.email = row["email"].string_value();
+        u.id = row["id"].int64_value();
+        u.name = row["name"].string_value();
+        u.score = row["score"].number_value();
+        out.push_back(u);
+      }
+      return out;
+    });
+  });
+  bench("parse_table", table.size(), [&] {
+    return timed<vector<User>>([&] {
+      string err;
+      vector<User> out;
+      parse_table(table, out, err);
+      return out;
+    });
+  });
+
+  const string wide = wide_payload(rows / 100, 500);
+  printf("wide: %zu rows x 500 columns, %.1f MB\n", rows / 100,
+         wide.size() / 1048576.0);
+  bench("Toon::parse", wide.size(), [&] {
+    return timed<Toon>([&] {
+      string err;
+      return Toon::parse(wide, err);
+    });
+  });
+
+  const string records = object_payload(rows / 2);
+  printf("objects: %zu records, %.1f MB\n", rows / 2,
+         records.size() / 1048576.0);
+  bench("Toon::parse", records.size(), [&] {
+    return timed<Toon>([&] {
+      string err;
+      return Toon::parse(records, err);
+    });
+  });
+
+  // Enrichment: one field added to every record, by rebuilding the maps or
+  // with the copy-on-write editing API on a document we own.
+  bench("copy + rebuild", 0,
+        [&] {
+          Toon doc = Toon::parse(records, err);
+          return timed<Toon>([&] {
+            Toon::object top = doc.object_items();
+            for (auto &kv : top) {
+              Toon::object record = kv.second.object_items();
+              record["enriched"] = true;
+              kv.second = record;
+            }
+            return Toon(move(top));
+          });
+        },
+        1);
+  bench("Toon::set", 0,
+        [&] {
+          Toon doc = Toon::parse(records, err);
+          return timed<Toon>([&] {
+            Toon::members top = move(doc).take_members();
+            for (auto &kv : top)
+              kv.second.set("enriched", true);
+            return Toon::from_members(move(top));
+          });
+        },
+        1);
+
+  // Twenty field lookups per request on 40-key objects.
+  Toon::object fields;
+  for (int k = 0; k < 40; ++k)
+    fields["request_field_" + to_string(k)] = k;
+  const Toon request = Toon::parse(Toon(fields).dump(), err);
+  vector<string> wanted;
+  for (int k = 0; k < 40; k += 2)
+    wanted.push_back("request_field_" + to_string(k));
+  printf("lookups: %zu requests x %zu fields\n", rows * 5, wanted.size());
+  bench("Toon::operator[]", 0, [&] {
+    return timed<long>([&] {
+      long sum = 0;
+      for (size_t r = 0; r < rows * 5; ++r)
+        for (const string &key : wanted)
+          sum += request[key].int_value();
+      return sum;
+    });
+  });
+
+  // The same requests split over four threads reading one shared document,
+  // each taking a handle to its section first: copying a Toon bumps the
+  // shared reference count, a ToonRef does not.
+  const Toon shared = Toon::object{{"section", request}};
+  auto shared_reads = [&](bool borrowed) {
+    std::atomic<long> total(0);
+    vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+      threads.emplace_back([&] {
+        long sum = 0;
+        for (size_t r = 0; r < rows * 5 / 4; ++r) {
+          if (borrowed) {
+            const ToonRef section = shared["section"];
+            sum += section[wanted[r % wanted.size()]].int_value();
+          } else {
+            const Toon section = shared["section"];
+            sum += section[wanted[r % wanted.size()]].int_value();
+          }
+        }
+        total += sum;
+      });
+    for (auto &t : threads)
+      t.join();
+    return total.load();
+  };
+  bench("shared reads (Toon)", 0,
+        [&] { return timed<long>([&] { return shared_reads(false); }); });
+  bench("shared reads (ToonRef)", 0,
+        [&] { return timed<long>([&] { return shared_reads(true); }); });
+
+  // Routing: three top-level fields read out of a ~500 KB request.
+  const string envelope = envelope_payload(12000);
+  printf("routing: %zu requests of %.0f KB\n", rows / 1000,
+         envelope.size() / 1024.0);
+  bench("Toon::parse", envelope.size() * (rows / 1000), [&] {
+    return timed<long>([&] {
+      long sum = 0;
+      for (size_t r = 0; r < rows / 1000; ++r) {
+        string err;
+        Toon t = Toon::parse(envelope, err);
+        sum += t["priority"].int_value() + t["route"].string_value().size() +
+               t["tenant"].string_value().size();
+      }
+      return sum;
+    });
+  });
+  bench("Toon::parse_lazy", envelope.size() * (rows / 1000), [&] {
+    return timed<long>([&] {
+      long sum = 0;
+      for (size_t r = 0; r < rows / 1000; ++r) {
+        string err;
+        Toon t = Toon::parse_lazy(envelope, err);
+        sum += t["priority"].int_value() + t["route"].string_value().size() +
+               t["tenant"].string_value().size();
+      }
+      return sum;
+    });
+  });
+
+  // Small RPC messages parsed one at a time, cold or with a reused Parser.
+  const string message = "id: 1842\nmethod: orders.update\nauth:\n"
+                         "  tenant: acme\n  token: \"k3y\\t9\"\n"
+                         "params:\n  order: 77120\n  status: shipped\n"
+                         "  items:\n    [{sku, qty}]:\n      a-1, 2\n"
+                         "      b-7, 1\n";
+  printf("rpc: %zu messages of %zu bytes\n", rows, message.size());
+  latency("Toon::parse", rows, [&] {
+    string err;
+    Toon t = Toon::parse(message, err);
+  });
+  Parser rpc;
+  latency("Parser::parse", rows, [&] {
+    string err;
+    Toon t = rpc.parse(message, err);
+  });
+  latency("Document::parse_view", rows, [&] {
+    string err;
+    Document d = Document::parse_view(message, err);
+  });
+  latency("Parser::parse_view", rows, [&] {
+    string err;
+    rpc.parse_view(message, err);
+  });
+
+  const string text = text_payload(rows / 4);
+  printf("text: %zu rows, %.1f MB\n", rows / 4, text.size() / 1048576.0);
+  bench_document(text);
+
+  const string numbers = numeric_payload(rows);
+  printf("numeric: %zu rows, %.1f MB\n", rows, numbers.size() / 1048576.0);
+  bench_document(numbers);
+
+  // Computed ratios need all 17 digits; prices and scores only a few.
+  Toon::array ratios, decimals;
+  for (size_t i = 0; i < rows; ++i) {
+    ratios.push_back((i + 1) / 3.0 * (i % 2 ? 1e-3 : 1e5));
+    decimals.push_back((i % 100000) / 100.0);
+  }
+  bench_doubles("full precision", ratios);
+  bench_doubles("two decimals", decimals);
+
+  const string nested = nested_payload(rows / 50, 40);
+  printf("nested: %zu trees of depth 40, %.1f MB\n", rows / 50,
+         nested.size() / 1048576.0);
+  bench_document(nested);
+
+  const string inline_arrays = inline_payload(20, rows / 4);
+  printf("inline arrays: 20 x [%zu], %.1f MB\n", rows / 4,
+         inline_arrays.size() / 1048576.0);
+  bench_document(inline_arrays);
+  return 0;
+}
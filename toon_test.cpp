@@ -11,8 +11,16 @@
  */
 
 #include "toon.h"
+#include <algorithm>
 #include <cassert>
+#include <clocale>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <thread>
+#include <unordered_map>
 
 using namespace toon;
 using namespace std;
@@ -46,6 +54,40 @@ void test_object() {
   assert(parsed["name"].string_value() == "Alice");
   assert(parsed["age"].int_value() == 30);
 
+  // Indentation stays right across raw newlines inside quoted strings.
+  Toon nested = Toon::parse("a:\n  s: \"x\ny\"\n  t: 1\nb: 2", err);
+  assert(err.empty());
+  assert(nested["a"]["s"].string_value() == "x\ny");
+  assert(nested["a"]["t"].int_value() == 1);
+  assert(nested["b"].int_value() == 2);
+
+  // Large objects are hash indexed; lookups and the map view agree.
+  Toon::object fields;
+  for (int k = 0; k < 40; ++k)
+    fields["field" + to_string(k)] = k;
+  Toon wide = Toon::parse(Toon(fields).dump(), err);
+  assert(err.empty());
+  for (int k = 0; k < 40; ++k)
+    assert(wide["field" + to_string(k)].int_value() == k);
+  assert(wide["field40"].is_null());
+  assert(wide.object_items() == fields);
+  assert(wide == Toon(fields));
+
+  // Duplicate keys: the last value wins, sorted or in document order.
+  Toon dup = Toon::parse("b: 1\na: 2\nb: 3", err);
+  assert(dup.object_members().size() == 2 && dup["b"].int_value() == 3);
+  assert(dup.dump() == "a: 2\nb: 3");
+  Toon ordered = Toon::parse("b: 1\na: 2\nb: 3", err, PRESERVE_ORDER);
+  assert(ordered.dump() == "b: 3\na: 2");
+  assert(ordered == dup && !(ordered < dup) && !(dup < ordered));
+  Toon::members many;
+  for (int k = 39; k >= 0; --k)
+    many.emplace_back("f" + to_string(k % 30), k);
+  Toon big = Toon::from_members(many, true);
+  assert(big.object_members().size() == 30);
+  assert(big.object_members()[0].first == "f9");
+  assert(big["f9"].int_value() == 9 && big["f29"].int_value() == 29);
+
   cout << "Object tests passed!" << endl;
 }
 
@@ -75,14 +117,1437 @@ void test_tabular() {
   assert(parsed[0]["x"].int_value() == 1);
   assert(parsed[1]["y"].int_value() == 4);
 
+  // Same size but different keys, or a non-object row: list form.
+  Toon mixed = Toon::array{Toon::object{{"a", 1}, {"b", 2}},
+                           Toon::object{{"a", 3}, {"c", 4}}};
+  assert(mixed.dump().compare(0, 5, "[2]: ") == 0);
+  Toon tail = Toon::array{Toon::object{{"a", 1}}, 5};
+  assert(tail.dump().compare(0, 5, "[2]: ") == 0);
+
   cout << "Tabular tests passed!" << endl;
 }
 
+void test_long_strings() {
+  // Special characters at every offset around the 16-byte scan blocks.
+  const char specials[] = {',', ':', '\n', '[', '}', '#', '"', '\\', '\x01'};
+  string err;
+  for (size_t n = 1; n < 40; ++n) {
+    for (size_t pos = 0; pos < n; ++pos) {
+      for (char c : specials) {
+        string v(n, 'a');
+        v[pos] = c;
+        Toon t = Toon::object{{"k", v}};
+        string d = t.dump();
+        bool quoted = d != "k: " + v;
+        assert(quoted == (c != '"' && c != '\\' && c != '\x01'));
+        if (quoted) {
+          Toon back = Toon::parse(d, err);
+          assert(err.empty() && back == t);
+        }
+      }
+    }
+    string plain(n, 'x');
+    assert(Toon::parse("k: " + plain + ", tail", err)["k"].string_value() ==
+           plain);
+  }
+  cout << "Long string tests passed!" << endl;
+}
+
+void test_document() {
+  const string in = "meta:\n  id: 7\n  tags: [2]: a, \"b c\"\n"
+                    "name: Alice\n"
+                    "rows: [{x, y}]:\n  1, 2\n  3, 4\n"
+                    "name: Bob";
+  string err;
+  Document doc = Document::parse(in, err);
+  if (!err.empty())
+    cout << "Parse error: " << err << endl;
+  assert(err.empty());
+  assert(doc.root().is_object());
+  assert(doc["name"].string_value() == "Bob"); // last duplicate wins
+  assert(doc["meta"]["id"].int_value() == 7);
+  assert(doc["meta"]["tags"].array_items().size() == 2);
+  assert(doc["meta"]["tags"][1].string_value() == "b c");
+  assert(doc["rows"][1]["y"].int_value() == 4);
+  assert(doc["missing"].is_null());
+  assert(doc["rows"][5].is_null());
+
+  size_t n = 0;
+  for (DocValue row : doc["rows"].array_items())
+    n += row.object_items().size();
+  assert(n == 4);
+
+  Toon converted = doc.root();
+  assert(converted == Toon::parse(in, err));
+
+  Document moved = std::move(doc);
+  assert(moved["meta"]["id"].int_value() == 7);
+
+  cout << "Document tests passed!" << endl;
+}
+
+void test_escapes() {
+  Toon s = Toon::object{{"msg", "tab\there \"quoted\" \\ back\nline \x01"}};
+  string err;
+  Toon back = Toon::parse(s.dump(), err);
+  assert(err.empty());
+  assert(back == s);
+
+  Toon u = Toon::parse("k: \"caf\\u00e9 \\ud83d\\ude00 \\b\"", err);
+  assert(err.empty());
+  assert(u["k"].string_value() == "caf\xc3\xa9 \xf0\x9f\x98\x80 \b");
+
+  // The quoting decision is kept by the string; dumps must not change.
+  const Toon forms = Toon::array{"plain", "a, b", "", "7up", "q\"\x1f,"};
+  const string expected = "[5]: plain, \"a, b\", \"\", \"7up\", "
+                          "\"q\\\"\\u001f,\"";
+  assert(forms.dump() == expected && forms.dump() == expected);
+  assert(forms.dump_size() == expected.size());
+
+  Toon::parse("k: \"\\u12\"", err);
+  assert(!err.empty());
+
+  Toon::parse("a: 1\nb:\n  c: \"x\\q\"", err);
+  assert(err == "invalid escape at line 3, column 8");
+
+  cout << "Escape tests passed!" << endl;
+}
+
+void test_hash() {
+  // Equal values hash alike, whatever their representation.
+  assert(Toon(1).hash() == Toon(1.0).hash());
+  assert(Toon(0.0).hash() == Toon(-0.0).hash());
+  assert(Toon(1).hash() != Toon("1").hash() && Toon().hash() != Toon(0).hash());
+  Toon sorted = Toon::object{{"a", 1}, {"b", Toon::array{true, "x"}}};
+  string err;
+  Toon ordered = Toon::parse("b: [2]: true, x\na: 1", err, PRESERVE_ORDER);
+  assert(sorted == ordered && sorted.hash() == ordered.hash());
+  assert(sorted.hash() != Toon(Toon::object{{"a", 2}}).hash());
+
+  const string text = "rows:\n  [{id, name}]:\n    1, ann\n    2, bob\n";
+  Toon table = Toon::parse(text, err);
+  Toon lazy = Toon::parse_lazy(text, err);
+  Toon plain = Toon::object{
+      {"rows", Toon::array{Toon::object{{"id", 1}, {"name", "ann"}},
+                           Toon::object{{"id", 2}, {"name", "bob"}}}}};
+  assert(table["rows"].is_table() && table == plain);
+  assert(table.hash() == plain.hash() && lazy.hash() == plain.hash());
+
+  std::unordered_map<Toon, int> seen;
+  seen[table] = 1;
+  assert(seen.count(plain) == 1 && seen.count(sorted) == 0);
+
+  // Edits reset the kept hash.
+  Toon edited = plain;
+  const uint64_t before = edited.hash();
+  edited.mutable_member("rows").push_back(Toon::object{{"id", 3}});
+  assert(edited.hash() != before && edited != plain);
+  edited.mutable_member("rows").mutable_array().pop_back();
+  assert(edited.hash() == before && edited == plain);
+
+  // Interned values share equal subtrees.
+  Interner interner;
+  Toon a = interner.intern(Toon::parse(text, err));
+  Toon b = interner.intern(plain);
+  assert(a == plain && b == plain);
+  assert(&a.object_members() == &b.object_members());
+  Toon c = interner.intern(Toon::array{plain["rows"], "bob"});
+  assert(&c[0].array_items() == &a["rows"].array_items());
+  assert(&c[1].string_value() == &a["rows"][1]["name"].string_value());
+  const size_t held = interner.size();
+  interner.intern(Toon::parse(text, err));
+  assert(interner.size() == held);
+  interner.clear();
+  assert(interner.size() == 0);
+
+  cout << "Hash tests passed!" << endl;
+}
+
+void test_dump_size() {
+  const Toon values[] = {
+      Toon(),
+      Toon(false),
+      Toon(-1234567),
+      Toon(std::numeric_limits<int64_t>::min()),
+      Toon(std::numeric_limits<uint64_t>::max()),
+      Toon(0.1),
+      Toon(-2.5e-300),
+      Toon(std::nan("")),
+      Toon(""),
+      Toon("-12 and \"tab\"\t\x01 \\ \n"),
+      Toon::array{},
+      Toon::object{},
+      Toon::array{1, "two", Toon::array{3.5, nullptr}},
+      Toon::array{Toon::object{{"a", 1}, {"b", "x, y"}},
+                  Toon::object{{"a", 2}, {"b", Toon::array{}}}},
+      Toon::object{{"name", "toon"},
+                   {"nested", Toon::object{{"deep", Toon::object{{"k", 1}}},
+                                           {"list", Toon::array{1, 2}}}},
+                   {"empty", Toon::object{}}},
+  };
+  for (const Toon &v : values) {
+    for (int level = 0; level < 3; ++level) {
+      string out;
+      v.dump(out, level);
+      assert(v.dump_size(level) == out.size());
+    }
+  }
+
+  string err;
+  const string text = "users:\n  [{id, name}]:\n    1, \"a\\tb\"\n    2, "
+                      "bob\nmeta:\n  tags[3]: x, \"y z\", 7\n";
+  for (Toon t : {Toon::parse(text, err), Toon::parse_lazy(text, err)}) {
+    assert(err.empty());
+    assert(t["users"].is_table());
+    assert(t.dump_size() == t.dump().size());
+  }
+
+  Toon doc = Toon::parse(text, err);
+  const string expected = doc.dump();
+  vector<char> buf(expected.size() + 1, '#');
+  assert(doc.dump_into(buf.data(), buf.size()) == expected.size());
+  assert(string(buf.data(), expected.size()) == expected);
+  assert(buf.back() == '#');
+  // A short buffer gets the start of the output and nothing past its end.
+  for (size_t size : {size_t(0), size_t(1), size_t(9), expected.size() - 1}) {
+    std::fill(buf.begin(), buf.end(), '#');
+    assert(doc.dump_into(buf.data(), size) == expected.size());
+    assert(string(buf.data(), size) == expected.substr(0, size));
+    assert(buf[size] == '#');
+  }
+  assert(Toon().dump_into(nullptr, 0) == 4);
+  for (const Toon &v : values) {
+    const string whole = v.dump();
+    vector<char> out(whole.size());
+    assert(v.dump_into(out.data(), out.size()) == whole.size());
+    assert(string(out.begin(), out.end()) == whole);
+  }
+  Toon lazy = Toon::parse_lazy(text, err);
+  buf.assign(expected.size(), '#');
+  assert(lazy.dump_into(buf.data(), buf.size()) == expected.size());
+  assert(string(buf.begin(), buf.end()) == expected);
+
+  cout << "Dump size tests passed!" << endl;
+}
+
+void test_dump_truncated() {
+  string err;
+  const Toon doc = Toon::parse("name: report\nrows: [{id, name}]:\n  1, Ann\n"
+                               "  2, Bob\n  3, Cy\ntags: [4]: a, b, c, d\n"
+                               "meta:\n  x: 1\n  y: [2]: 1, 2",
+                               err, PRESERVE_ORDER);
+  assert(err.empty());
+  string out;
+  assert(!doc.dump_truncated(out, 70));
+  assert(out == "name: report\nrows: [{id, name}]:\n    1, Ann\n"
+                "    ... 2 more\n... 2 more");
+  out.clear();
+  assert(!doc.dump_truncated(out, 104));
+  assert(out.substr(out.size() - 32) == "tags: [4]: a, b, c, d\n... 1 more");
+
+  // Within the budget, and the whole of dump() once that fits in it.
+  const size_t full = doc.dump_size();
+  for (size_t budget = 0; budget <= full + 1; ++budget) {
+    out = "kept";
+    const bool whole = doc.dump_truncated(out, budget);
+    assert(out.compare(0, 4, "kept") == 0 && out.size() <= budget + 4);
+    assert(whole == (budget >= full));
+    assert(!whole || out == "kept" + doc.dump());
+    Toon::parse(out.substr(4), err);
+    assert(err.empty());
+  }
+
+  const Toon nested = Toon::object{
+      {"list", Toon::array{Toon::array{1, 2, 3}, "s", Toon::object{{"z", 1}}}},
+      {"deep", Toon::object{{"f", Toon::object{{"g", "x"}}}}}};
+  out.clear();
+  assert(!nested.dump_truncated(out, 53));
+  assert(out == "deep: \n  f: \n    g: x\nlist: [3]: ... 3 more");
+  out.clear();
+  assert(nested.dump_truncated(out, 54) && out == nested.dump());
+  out.clear();
+  assert(!Toon("long string").dump_truncated(out, 5) && out.empty());
+  assert(Toon(1).dump_truncated(out, 1) && out == "1");
+
+  cout << "Truncated dump tests passed!" << endl;
+}
+
+void test_parser() {
+  Parser parser;
+  string err;
+  const string messages[] = {
+      "id: 1\nmethod: get\nargs:\n  key: \"a\\tb\"\n",
+      "id: 2\nmethod: put\nargs:\n  [{k, v}]:\n    x, 1\n    y, 2\n",
+      "[3]: 1, two, \"th\\\"ree\""};
+  for (int round = 0; round < 3; ++round) {
+    for (const string &m : messages) {
+      err.clear();
+      Toon t = parser.parse(m, err);
+      assert(err.empty() && t == Toon::parse(m, err));
+      DocValue v = parser.parse_view(m, err);
+      assert(err.empty() && v.to_toon() == t);
+    }
+  }
+  Toon first = parser.parse(messages[0], err);
+  assert(first["args"]["key"] == "a\tb");
+
+  // Once warmed up, the arena is reused instead of growing.
+  const size_t held = parser.memory_usage();
+  for (int k = 0; k < 100; ++k)
+    parser.parse_view(messages[1], err);
+  assert(parser.memory_usage() == held);
+
+  // An error does not leak into the next parse.
+  err.clear();
+  parser.parse("a:\n  b: \"open\n", err);
+  assert(!err.empty());
+  err.clear();
+  assert(parser.parse(messages[2], err)[2] == "th\"ree" && err.empty());
+  assert(parser.parse_view(messages[2], err)[1].string_value() == "two");
+
+  parser.clear();
+  assert(parser.memory_usage() < held);
+  assert(parser.parse(messages[0], err) == first);
+
+  cout << "Parser tests passed!" << endl;
+}
+
+void test_document_view() {
+  const string in = "plain: hello\nesc: \"a\\nb\"\nlist: [2]: x, \"y\"";
+  string err;
+  Document doc = Document::parse_view(in, err);
+  assert(err.empty());
+  StringView plain = doc["plain"].string_value();
+  assert(plain == "hello");
+  assert(plain.data() >= in.data() && plain.data() < in.data() + in.size());
+  StringView key = doc.root().object_items().begin()->key();
+  assert(key.data() >= in.data() && key.data() < in.data() + in.size());
+  StringView esc = doc["esc"].string_value();
+  assert(esc == "a\nb");
+  assert(esc.data() < in.data() || esc.data() >= in.data() + in.size());
+  assert(doc["list"][1].string_value() == "y");
+  assert(doc.root().to_toon() == Toon::parse(in, err));
+
+  cout << "Document view tests passed!" << endl;
+}
+
+void test_file() {
+  const string in = "name: demo\nesc: \"a\\tb\"\nrows:\n  [{id, v}]:\n"
+                    "    1, x\n    2, y";
+  const char *path = "toon_test_file.tmp";
+  FILE *f = fopen(path, "wb");
+  assert(f && fwrite(in.data(), 1, in.size(), f) == in.size());
+  fclose(f);
+
+  string err;
+  const Toon expected = Toon::parse(in, err);
+  Toon t = Toon::parse_file(path, err);
+  assert(err.empty() && t == expected);
+
+  MappedFile file;
+  assert(file.open(path, err) && file.view() == StringView(in));
+  Document doc = Document::parse_file(path, err);
+  assert(err.empty() && doc.root().to_toon() == expected);
+  // Unescaped strings point into the mapping, which the document owns.
+  Document moved = move(doc);
+  assert(moved["name"].string_value() == "demo");
+  assert(moved["esc"].string_value() == "a\tb");
+
+  // Buffers without a terminating NUL, which a mapping usually is.
+  vector<char> exact(in.begin(), in.end());
+  assert(Toon::parse(exact.data(), exact.size(), err) == expected);
+  assert(Toon::parse(exact.data(), 4, err) == Toon("name"));
+
+  f = fopen(path, "wb");
+  fclose(f);
+  assert(Toon::parse_file(path, err).is_null() && err.empty());
+  remove(path);
+
+  assert(Toon::parse_file("no/such/file.toon", err).is_null());
+  assert(err.find("cannot open no/such/file.toon") == 0);
+  err.clear();
+  assert(Document::parse_file("no/such/file.toon", err).root().is_null());
+  assert(!err.empty() && !file.open("no/such/file.toon", err));
+  assert(file.size() == 0);
+
+  cout << "File tests passed!" << endl;
+}
+
+// Rebuilds a Toon tree from StreamParser events.
+struct TreeHandler : ToonHandler {
+  struct Frame {
+    int kind; // 0 object, 1 array, 2 table
+    Toon::object obj;
+    Toon::array arr;
+    string key;
+    vector<string> keys;
+  };
+  vector<Frame> frames;
+  Toon result;
+  size_t rows = 0;
+
+  void add(const Toon &v) {
+    if (frames.empty())
+      result = v;
+    else if (frames.back().kind == 0)
+      frames.back().obj[frames.back().key] = v;
+    else
+      frames.back().arr.push_back(v);
+  }
+  void open(int kind) {
+    frames.push_back(Frame());
+    frames.back().kind = kind;
+  }
+  Frame close() {
+    Frame f = frames.back();
+    frames.pop_back();
+    return f;
+  }
+  void begin_object() override { open(0); }
+  void on_key(StringView key) override { frames.back().key = key.str(); }
+  void end_object() override { add(close().obj); }
+  void begin_array(int) override { open(1); }
+  void end_array() override { add(close().arr); }
+  void begin_table(const vector<string> &keys) override {
+    open(2);
+    frames.back().keys = keys;
+  }
+  void table_row(DocArray cells) override {
+    Toon::object row;
+    for (size_t j = 0; j < cells.size(); ++j)
+      row[frames.back().keys[j]] = cells[j].to_toon();
+    frames.back().arr.push_back(row);
+    rows++;
+  }
+  void end_table() override { add(close().arr); }
+  void on_scalar(DocValue v) override { add(v.to_toon()); }
+};
+
+static Toon stream_parse(const string &in, size_t chunk, string &err) {
+  TreeHandler h;
+  StreamParser sp(h);
+  for (size_t off = 0; off < in.size(); off += chunk)
+    sp.feed(in.data() + off, std::min(chunk, in.size() - off));
+  sp.finish();
+  err = sp.error();
+  return h.result;
+}
+
+void test_binary() {
+  string err;
+  const string text = "name: demo\nesc: \"a\\tb\"\nn: -42\n"
+                      "big: 18446744073709551615\npi: 3.25\nok: true\n"
+                      "none: null\nlist: [3]: 1, x, 2.5\n"
+                      "rows:\n  [{id, v, w, flag, mixed}]:\n"
+                      "    1, x, 0.5, true, 7\n    -2, y, 1e300, false, z\n"
+                      "nested:\n  rows:\n    [{id, v}]:\n      3, \"\"\n";
+  for (ToonParse strategy : {ToonParse::STANDARD, ToonParse::PRESERVE_ORDER}) {
+    err.clear();
+    const Toon doc = Toon::parse(text, err, strategy);
+    assert(err.empty());
+    const string bin = doc.dump_binary();
+    Toon back = Toon::parse_binary(bin, err);
+    assert(err.empty() && back == doc && back.dump() == doc.dump());
+    assert(back["rows"].is_table() && back["nested"]["rows"].is_table());
+    assert(back["big"].uint64_value() == UINT64_MAX);
+
+    // Every truncation, and a stray byte after the value, is an error.
+    for (size_t n = 0; n < bin.size(); ++n) {
+      err.clear();
+      assert(Toon::parse_binary(StringView(bin.data(), n), err).is_null());
+      assert(!err.empty());
+    }
+    Toon::parse_binary(bin + '\0', err);
+    assert(err == "unexpected data after the value at offset " +
+                      to_string(bin.size()));
+  }
+
+  const Toon scalars[] = {Toon(), Toon(-0.5), Toon(INT64_MIN), Toon("s"),
+                          Toon::array{}, Toon::object{}};
+  err.clear();
+  for (const Toon &v : scalars)
+    assert(Toon::parse_binary(v.dump_binary(), err) == v && err.empty());
+
+  string bad = Toon(1).dump_binary();
+  bad[5] = 9;
+  Toon::parse_binary(bad, err);
+  assert(err == "unsupported binary TOON version 9");
+  Toon::parse_binary("a: 1", err);
+  assert(err == "not binary TOON");
+  bad = Toon(1).dump_binary();
+  bad[6] = 99;
+  Toon::parse_binary(bad, err);
+  assert(err == "invalid binary tag at offset 6");
+
+  const char *path = "toon_test_binary.tmp";
+  const string bin = Toon::parse(text, err).dump_binary();
+  FILE *f = fopen(path, "wb");
+  assert(f && fwrite(bin.data(), 1, bin.size(), f) == bin.size());
+  fclose(f);
+  err.clear();
+  assert(Toon::parse_binary_file(path, err) == Toon::parse(text, err));
+  assert(err.empty());
+  remove(path);
+
+  cout << "Binary tests passed!" << endl;
+}
+
+void test_depth() {
+  // Inline arrays nest without indentation, a level every five bytes.
+  auto inline_arrays = [](size_t n) {
+    string s;
+    for (size_t k = 0; k < n; ++k)
+      s += "[1]: ";
+    return s + "1";
+  };
+  string err;
+  const string fits = inline_arrays(kDefaultMaxDepth);
+  const string deep = inline_arrays(kDefaultMaxDepth + 1);
+  const string expected =
+      "nesting deeper than 1000 levels at line 1, column 5001";
+  assert(Toon::parse(fits, err).dump() == fits && err.empty());
+  Toon::parse(deep, err);
+  assert(err == expected);
+  err.clear();
+  Toon::parse_lazy(deep, err);
+  assert(err == expected);
+  err.clear();
+  Document::parse(deep, err);
+  assert(err == expected);
+  err.clear();
+  Parser parser;
+  parser.parse(deep, err);
+  assert(err == expected);
+  TreeHandler tree;
+  StreamParser stream(tree);
+  assert(!stream.feed(deep) || !stream.finish());
+  assert(stream.error() == expected);
+
+  // Objects nest through indentation; tables count as a level.
+  string nested;
+  for (size_t k = 0; k <= kDefaultMaxDepth; ++k)
+    nested += string(2 * k, ' ') + "a:\n";
+  nested += string(2 * (kDefaultMaxDepth + 1), ' ') + "b: 1";
+  err.clear();
+  Toon::parse_lazy(nested, err);
+  assert(err == "nesting deeper than 1000 levels at line 1001, column 2001");
+  const string table = "[{a}]:\n  " + inline_arrays(kDefaultMaxDepth);
+  err.clear();
+  Toon::parse(table, err);
+  assert(err == "nesting deeper than 1000 levels at line 2, column 4998");
+
+  Toon value = 1;
+  for (size_t k = 0; k <= kDefaultMaxDepth; ++k)
+    value = Toon::array{value};
+  err.clear();
+  Toon::parse_binary(value.dump_binary(), err);
+  assert(err == "nesting deeper than 1000 levels at offset 2006");
+  string toon;
+  assert(!json_to_toon(string(1001, '[') + string(1001, ']'), toon, err));
+  assert(err == "nesting deeper than 1000 levels at line 1, column 1001");
+
+  // Parser and StreamParser take their own limit; others keep the default.
+  Parser shallow(ToonParse::STANDARD, 2);
+  err.clear();
+  assert(shallow.parse("a:\n  b: 1", err)["a"]["b"] == 1 && err.empty());
+  shallow.parse("a:\n  b: [1]: 1", err);
+  assert(err == "nesting deeper than 2 levels at line 2, column 6");
+  err.clear();
+  shallow.parse_view("a:\n  b: [1]: 1", err);
+  assert(err == "nesting deeper than 2 levels at line 2, column 6");
+  err.clear();
+  assert(Toon::parse("a:\n  b: [1]: 1", err)["a"]["b"][0] == 1);
+  assert(err.empty());
+  TreeHandler small;
+  StreamParser limited(small, 2);
+  assert(!limited.feed("a:\n  b: [1]: 1") || !limited.finish());
+  assert(limited.error() == "nesting deeper than 2 levels at line 2, column 6");
+  Parser deeper(ToonParse::STANDARD, kDefaultMaxDepth + 1);
+  assert(deeper.parse(deep, err).dump() == deep && err.empty());
+
+  cout << "Depth tests passed!" << endl;
+}
+
+void test_stream() {
+  const char *docs[] = {
+      "name: Alice\nage: 30",
+      "meta:\n  id: 7\n  inner:\n    deep: \"x, y\"\n  tags: [2]: a, b\n"
+      "rows:\n  [{x, y}]:\n    1, 2\n    3, \"q\\nr\"\nz: [0]:\nend: true",
+      "[{a, b}]:\n  1, hello\n  # comment\n\n  2, [2]: 3, 4\n",
+      "[3]: 1,\n  2,\n  3",
+      "[2]: [2]: 1, 2, [1]: 3",
+      "42",
+      "",
+      "a:\n  b: 1\nc:\n",
+  };
+  for (const char *d : docs) {
+    string err1, err2;
+    Toon expected = Toon::parse(d, err1);
+    assert(err1.empty());
+    for (size_t chunk : {size_t(1), size_t(3), size_t(64)}) {
+      Toon got = stream_parse(d, chunk, err2);
+      if (!err2.empty() || got != expected)
+        cout << "Stream mismatch on: " << d << " (" << err2 << ")" << endl;
+      assert(err2.empty());
+      assert(got == expected);
+    }
+  }
+
+  Toon big = Toon::array{Toon::object{{"id", 1}, {"v", "a"}},
+                         Toon::object{{"id", 2}, {"v", "b, c"}},
+                         Toon::object{{"id", 3}, {"v", "d"}}};
+  TreeHandler h;
+  StreamParser sp(h);
+  string text = big.dump();
+  assert(sp.feed(text) && sp.finish());
+  assert(h.rows == 3 && h.result == big);
+
+  string err;
+  stream_parse("a: 1\nbogus line\n", 4, err);
+  assert(err == "expected ':' after key at line 2, column 1");
+  stream_parse("a: 1\nb: \"x\\q\"\n", 64, err);
+  assert(err == "invalid escape at line 2, column 6");
+
+  cout << "Stream tests passed!" << endl;
+}
+
+void test_edit() {
+  Toon a = Toon::object{{"k", 1}, {"list", Toon::array{1, 2}}};
+  Toon b = a;
+  b.set("k", 2);
+  b.mutable_member("list").push_back(3);
+  assert(a["k"].int_value() == 1 && a["list"].array_items().size() == 2);
+  assert(b["k"].int_value() == 2 && b["list"].array_items().size() == 3);
+  // Sole owners are edited in place.
+  const Toon *k = &b["k"];
+  b.set("k", 5);
+  assert(&b["k"] == k && b["k"].int_value() == 5);
+  assert(b.erase("k") && !b.erase("k") && b.object_members().size() == 1);
+
+  // Inserts keep the members sorted and the hash index current.
+  string err;
+  Toon wide;
+  for (int i = 40; i-- > 0;)
+    wide.set("key" + to_string(i), i);
+  assert(wide.object_members().size() == 40);
+  assert(wide.object_members()[0].first == "key0");
+  for (int i = 0; i < 40; i += 2)
+    assert(wide.erase("key" + to_string(i)));
+  for (int i = 0; i < 40; ++i)
+    assert(wide["key" + to_string(i)].is_null() == (i % 2 == 0));
+  assert(wide == Toon::parse(wide.dump(), err));
+
+  Toon ordered = Toon::parse("z: 1\na: 2", err, ToonParse::PRESERVE_ORDER);
+  ordered.set("m", 3);
+  assert(ordered.dump() == "z: 1\na: 2\nm: 3");
+
+  // A built object_items() map is not left stale.
+  Toon mapped = Toon::object{{"x", 1}};
+  assert(mapped.object_items().size() == 1);
+  mapped.set("y", 2);
+  assert(mapped.object_items().size() == 2 && mapped.object_items().count("y"));
+
+  // Tables turn into arrays of rows, lazy values are built first.
+  Toon table = Toon::parse("[{id, v}]:\n  1, a\n  2, b", err);
+  table.push_back(Toon::object{{"id", 3}, {"v", "c"}});
+  assert(!table.is_table() && table.array_items().size() == 3);
+  assert(table.dump() == "[{id, v}]:\n  1, a\n  2, b\n  3, c");
+  Toon lazy = Toon::parse_lazy("user:\n  name: ann\n  age: 3\nn: 1", err);
+  lazy.mutable_member("user").set("name", "bob");
+  assert(lazy.dump() == "n: 1\nuser: \n  age: 3\n  name: bob");
+  Toon scalar = 7;
+  scalar.mutable_array().push_back(1);
+  assert(scalar.dump() == "[1]: 1");
+
+  // take_*() move out of sole owners and copy out of shared values.
+  Toon arr = Toon::array{"x", "y"};
+  const Toon *data = arr.array_items().data();
+  Toon::array taken = std::move(arr).take_array();
+  assert(taken.data() == data && arr.is_null());
+  Toon shared = Toon::object{{"a", 1}, {"b", 2}};
+  Toon keep = shared;
+  Toon::object obj = std::move(shared).take_object();
+  assert(obj.size() == 2 && keep.object_members().size() == 2);
+  assert(std::move(keep).take_members().size() == 2 && keep.is_null());
+
+  // Assigning a value from inside itself keeps the part being assigned.
+  Toon parent = Toon::object{{"a", Toon::array{1, 2}}};
+  parent = parent["a"];
+  assert(parent == Toon(Toon::array{1, 2}));
+  parent = parent[1];
+  assert(parent == 2);
+  Toon list = Toon::array{Toon::object{{"k", "v"}}};
+  list = list[0];
+  assert(list["k"] == "v");
+  Toon moved = Toon::object{{"a", Toon::object{{"b", 1}}}};
+  moved = std::move(moved.mutable_member("a"));
+  assert(moved["b"] == 1);
+
+  cout << "Edit tests passed!" << endl;
+}
+
+void test_ref() {
+  string err;
+  Toon doc = Toon::parse("config:\n  mode: fast\n  limits: [3]: 1, 2, 3\n"
+                         "users:\n  [{id, name}]:\n    1, ann\n    2, bob",
+                         err);
+  assert(err.empty());
+  const ToonRef root = doc;
+  const ToonRef config = root["config"];
+  assert(&config.get() == &doc["config"]);
+  assert(config["mode"].string_value() == "fast");
+  assert(config["limits"][2].int_value() == 3 && config["limits"]->is_array());
+  assert(root["users"][1]["name"].string_value() == "bob");
+  assert(root["missing"]["deeper"].is_null() && ToonRef().is_null());
+  int sum = 0;
+  for (const Toon &v : config["limits"].array_items())
+    sum += v.int_value();
+  assert(sum == 6);
+  const Toon owned = config["limits"];
+  assert(owned == doc["config"]["limits"]);
+  assert(config["limits"].to_toon() == owned);
+
+  // A ToonRef shares no ownership: the only owner is still edited in place.
+  const Toon *mode = &doc["config"];
+  const ToonRef borrowed = doc;
+  doc.set("users", 1);
+  assert(&doc["config"] == mode && &borrowed.get() == &doc);
+
+  // Concurrent readers of one document, through values built on first use.
+  const Toon shared = Toon::parse_lazy("a:\n  [{k, v}]:\n    x, 1\n    y, 2\n"
+                                       "b:\n  c: [2]: 3, 4",
+                                       err);
+  vector<std::thread> readers;
+  vector<uint64_t> hashes(4);
+  for (int k = 0; k < 4; ++k)
+    readers.emplace_back([&shared, &hashes, k] {
+      const ToonRef r = shared;
+      assert(r["a"][1]["v"].int_value() == 2);
+      assert(r["b"]["c"][0].int_value() == 3);
+      assert(r["b"]->object_items().size() == 1);
+      hashes[k] = r->hash();
+    });
+  for (auto &r : readers)
+    r.join();
+  assert(std::count(hashes.begin(), hashes.end(), hashes[0]) == 4);
+
+  cout << "Ref tests passed!" << endl;
+}
+
+void test_lazy() {
+  const char *docs[] = {
+      "name: demo\nmeta:\n  owner: ann\n  tags: [3]: a, b, c\n"
+      "users:\n  [{id, note}]:\n    1, \"two\nlines\"\n    2, plain\n"
+      "deep:\n  a:\n    b:\n      c: 1\n  # comment\n\n  d: [2]: 1,\n2\n"
+      "last: x",
+      "a:\n  b: 1\nc:\n",
+      "list:\n  [2]: [2]: 1, 2, [1]: 3\nafter: 1",
+      "[{a, b}]:\n  1, 2",
+      "flat: 1",
+  };
+  for (const char *d : docs) {
+    string err1, err2;
+    Toon expected = Toon::parse(d, err1);
+    Toon lazy = Toon::parse_lazy(d, err2);
+    assert(err1.empty() && err2.empty());
+    assert(lazy.dump() == expected.dump());
+    assert(Toon::parse_lazy(d, err2) == expected);
+    assert(expected == Toon::parse_lazy(d, err2));
+  }
+
+  string err;
+  Toon t = Toon::parse_lazy(docs[0], err);
+  assert(t["meta"].is_object() && t["users"].is_array());
+  assert(t["deep"]["a"]["b"]["c"].int_value() == 1);
+  assert(t["users"].is_table() && t["users"][0]["note"] == Toon("two\nlines"));
+  assert(t["meta"]["tags"].array_items().size() == 3);
+  assert(t["deep"]["d"][1].int_value() == 2 && t["last"] == Toon("x"));
+
+  // Errors in skipped subtrees are reported up front, as by parse().
+  const char *bad = "a: 1\nb:\n  c:\n    d: \"x\\q\"\ne: 2";
+  string lazy_err;
+  Toon::parse(bad, err);
+  Toon::parse_lazy(bad, lazy_err);
+  assert(!err.empty() && lazy_err == err);
+
+  // Concurrent first accesses build the value once.
+  Toon shared = Toon::parse_lazy(docs[0], err);
+  vector<std::thread> readers;
+  for (int k = 0; k < 4; ++k)
+    readers.emplace_back([&shared] {
+      assert(shared["deep"]["a"]["b"]["c"].int_value() == 1);
+    });
+  for (auto &r : readers)
+    r.join();
+
+  Toon ordered = Toon::parse_lazy("o:\n  z: 1\n  a: 2", err,
+                                  ToonParse::PRESERVE_ORDER);
+  assert(ordered["o"].object_members()[0].first == "z");
+
+  cout << "Lazy tests passed!" << endl;
+}
+
+void test_path() {
+  const string in = "users:\n  [{email, id, tags}]:\n    a@x.io, 1, [2]: p, q\n"
+                    "    b@x.io, 2, [1]: r\nconfig:\n  mode: fast\n"
+                    "  a.b: dotted\n  list: [3]: 10, 20, 30";
+  string err;
+  const Toon doc = Toon::parse(in, err);
+  assert(err.empty());
+
+  Path emails("users[*].email");
+  vector<const Toon *> got = emails.select(doc);
+  assert(got.size() == 2 && *got[0] == Toon("a@x.io") &&
+         *got[1] == Toon("b@x.io"));
+  // The column came from the table's cells, not from built row objects.
+  assert(got[0] == &doc["users"].table_cell(0, 0));
+  // Reused across documents.
+  Toon other = Toon::parse("users:\n  [{email}]:\n    c@x.io", err);
+  assert(emails.select(other).size() == 1);
+  assert(*emails.select(other)[0] == Toon("c@x.io"));
+
+  assert(Path("users[-1].id").first(doc).int_value() == 2);
+  assert(Path("users[1].tags[0]").first(doc) == Toon("r"));
+  assert(Path("users[*].tags[*]").select(doc).size() == 3);
+  assert(Path("config.list[2]").first(doc).int_value() == 30);
+  assert(Path("config[\"a.b\"]").first(doc) == Toon("dotted"));
+  assert(Path("config.*").select(doc).size() == 3);
+  assert(Path("").select(doc).size() == 1 && *Path().select(doc)[0] == doc);
+  assert(Path("config.missing").select(doc).empty());
+  assert(Path("config.list[7]").select(doc).empty());
+  assert(Path("users.email").select(doc).empty());
+
+  // Syntax errors leave a path that matches nothing.
+  Path bad("users[*", err);
+  assert(err == "invalid path: expected ']' at column 8");
+  assert(bad.select(doc).empty() && bad.first(doc).is_null());
+  Path("users]x", err);
+  assert(err == "invalid path: expected '.' or '[' at column 6");
+  Path("a[x]", err);
+  assert(err.find("expected an index") != string::npos);
+
+  // Documents, and streams, give the same matches.
+  Document d = Document::parse(in, err);
+  vector<DocValue> docs = emails.select(d.root());
+  assert(docs.size() == 2 && docs[1].string_value() == "b@x.io");
+  assert(Path("config.list[-1]").select(d.root())[0].int_value() == 30);
+
+  for (const char *expr : {"users[*].email", "users[-1].id", "config.list[1]",
+                           "config.*", "users[0].tags[*]",
+                           "config.list[*]"}) {
+    Path path(expr);
+    vector<Toon> streamed;
+    PathHandler h(path, [&streamed](DocValue v) {
+      streamed.push_back(v.to_toon());
+    });
+    StreamParser sp(h);
+    assert(sp.feed(in) && sp.finish());
+    // Streams report scalars only.
+    vector<const Toon *> expected;
+    for (const Toon *t : path.select(doc))
+      if (!t->is_array() && !t->is_object())
+        expected.push_back(t);
+    if (string(expr) == "users[-1].id") {
+      assert(streamed.empty()); // tables declare no length
+      continue;
+    }
+    // Objects are sorted by key, streams come in document order.
+    vector<Toon> wanted;
+    for (const Toon *t : expected)
+      wanted.push_back(*t);
+    sort(streamed.begin(), streamed.end());
+    sort(wanted.begin(), wanted.end());
+    assert(streamed == wanted);
+  }
+
+  cout << "Path tests passed!" << endl;
+}
+
+struct StringSink : ToonSink {
+  string out;
+  size_t writes = 0;
+  bool write(const char *data, size_t len) override {
+    out.append(data, len);
+    writes++;
+    return true;
+  }
+};
+
+void test_writer() {
+  Toon expected = Toon::object{
+      {"name", "Alice, B"},
+      {"meta", Toon::object{{"id", 1}, {"tags", Toon::array{"a", "b"}}}},
+      {"rows", Toon::array{Toon::object{{"x", 1}, {"y", "p q"}},
+                           Toon::object{{"x", 2}, {"y", Toon()}}}},
+      {"empty", Toon::array{}}};
+
+  StringSink sink;
+  {
+    Writer w(sink, 16);
+    w.begin_object();
+    w.key("empty");
+    w.begin_array(0);
+    w.end_array();
+    w.key("meta");
+    w.begin_object();
+    w.key("id");
+    w.value(1);
+    w.key("tags");
+    w.begin_array(2);
+    w.value("a");
+    w.value(string("b"));
+    w.end_array();
+    w.end_object();
+    w.key("name");
+    w.value("Alice, B");
+    w.key("rows");
+    w.begin_table({"x", "y"});
+    w.row({1, "p q"});
+    w.begin_row();
+    w.value(2);
+    w.value(nullptr);
+    w.end_row();
+    w.end_table();
+    w.end_object();
+  }
+  assert(sink.out == expected.dump());
+  assert(sink.writes > 1);
+
+  StringSink whole;
+  {
+    Writer w(whole);
+    w.value(expected);
+  }
+  assert(whole.out == expected.dump());
+
+  std::FILE *f = tmpfile();
+  {
+    Writer w(f);
+    w.begin_table({"k"});
+    for (int i = 0; i < 3; ++i)
+      w.row({i});
+    w.end_table();
+    assert(w.flush() && w.good());
+  }
+  char buf[64] = {0};
+  rewind(f);
+  size_t n = fread(buf, 1, sizeof buf - 1, f);
+  fclose(f);
+  assert(string(buf, n) == "[{k}]:\n  0\n  1\n  2");
+
+  cout << "Writer tests passed!" << endl;
+}
+
+struct Record {
+  int64_t id;
+  string name;
+  double score;
+  bool active;
+  uint8_t level;
+  Toon tags;
+};
+TOON_FIELDS(Record, id, name, score, active, level, tags)
+
+void test_json() {
+  string err, toon;
+  assert(json_to_toon("[{\"a\": 1, \"b\": \"x y\"}, {\"a\": 2, \"b\": null}]",
+                      toon, err));
+  assert(toon == "[{a, b}]:\n  1, x y\n  2, null");
+
+  const string json =
+      "{\"users\":[{\"id\":1,\"name\":\"Ann\",\"tags\":[\"a\",\"b\"]},"
+      "{\"id\":2,\"name\":\"B\\u00f6b \\\"x\\\"\",\"tags\":[]}],"
+      "\"meta\":{\"ok\":true,\"none\":null,\"pi\":3.25,\"count\":2,"
+      "\"big\":18446744073709551615,\"min\":-9223372036854775808},"
+      "\"mixed\":[1,\"x\",false],\"none\":[],"
+      "\"esc\":\"line\\nbreak\\t\\u0001\",\"pair\":\"\\ud83d\\ude00\"}";
+  toon.clear();
+  assert(json_to_toon(json, toon, err) && err.empty());
+  // What dump() writes for the same value, with members in JSON order.
+  Toon doc = Toon::parse(toon, err, PRESERVE_ORDER);
+  assert(err.empty() && doc.dump() == toon);
+  assert(doc["users"].is_table() && !doc["mixed"].is_table());
+  assert(doc["users"][1]["name"] == "B\xc3\xb6" "b \"x\"");
+  assert(doc["meta"]["big"].uint64_value() == UINT64_MAX);
+  assert(doc["meta"]["min"].int64_value() == INT64_MIN);
+  assert(doc["pair"] == "\xf0\x9f\x98\x80");
+
+  // And back: the same JSON, with escapes written the way dump() does.
+  string back;
+  assert(toon_to_json(toon, back, err));
+  string expected = json;
+  expected.replace(expected.find("\\u00f6"), 6, "\xc3\xb6");
+  expected.replace(expected.find("\\ud83d\\ude00"), 12, "\xf0\x9f\x98\x80");
+  assert(back == expected);
+
+  // Through a StreamParser fed one byte at a time.
+  string streamed;
+  JsonWriter writer(streamed);
+  StreamParser parser(writer);
+  for (char c : toon)
+    assert(parser.feed(&c, 1));
+  assert(parser.finish() && streamed == back);
+
+  // Shapes TOON cannot read back still come out the way dump() writes them.
+  toon.clear();
+  assert(json_to_toon("{\"a\":[{\"k\":1},{\"j\":2}],\"b\":{},"
+                      "\"c\":[[1,{\"k\":[{\"x\":1}]}]]}",
+                      toon, err));
+  const Toon same = Toon::object{
+      {"a", Toon::array{Toon::object{{"k", 1}}, Toon::object{{"j", 2}}}},
+      {"b", Toon::object{}},
+      {"c", Toon::array{Toon::array{
+                1, Toon::object{{"k", Toon::array{Toon::object{{"x", 1}}}}}}}}};
+  assert(toon == same.dump());
+
+  // Objects in cells, at any depth, keep an array of records out of the
+  // tabular form; inline arrays of scalars do not.
+  const Toon records = Toon::array{Toon::object{{"a", Toon::object{{"b", 1}}}},
+                                   Toon::object{{"a", Toon::object{{"b", 2}}}}};
+  toon.clear();
+  assert(json_to_toon("[{\"a\":{\"b\":1}},{\"a\":{\"b\":2}}]", toon, err));
+  assert(toon == records.dump() && toon.compare(0, 4, "[2]:") == 0);
+  const Toon deep_cells =
+      Toon::array{Toon::object{{"a", Toon::array{1, Toon::object{{"b", 1}}}}},
+                  Toon::object{{"a", Toon::array{2}}}};
+  toon.clear();
+  assert(json_to_toon("[{\"a\":[1,{\"b\":1}]},{\"a\":[2]}]", toon, err));
+  assert(toon == deep_cells.dump() && toon.compare(0, 4, "[2]:") == 0);
+  const Toon flat_cells =
+      Toon::array{Toon::object{{"a", Toon::array{1, Toon::array{2}}}},
+                  Toon::object{{"a", Toon::array{}}}};
+  toon.clear();
+  assert(json_to_toon("[{\"a\":[1,[2]]},{\"a\":[]}]", toon, err));
+  assert(toon == flat_cells.dump());
+  assert(toon == "[{a}]:\n  [2]: 1, [1]: 2\n  [0]:");
+  assert(Toon::parse(toon, err) == flat_cells && err.empty());
+
+  const char *bad[][2] = {
+      {"{\"a\": }", "invalid value at line 1, column 7"},
+      {"[1, 2", "expected ',' or ']' at line 1, column 6"},
+      {"{\"a\" 1}", "expected ':' at line 1, column 6"},
+      {"[01]", "expected ',' or ']' at line 1, column 3"},
+      {"\"a\\x\"", "invalid escape at line 1, column 4"},
+      {"\n tru", "invalid value at line 2, column 2"},
+      {"1 2", "unexpected data after the value at line 1, column 3"},
+  };
+  for (auto const &c : bad) {
+    string out = "kept";
+    assert(!json_to_toon(c[0], out, err));
+    assert(err == c[1] && out == "kept");
+  }
+  back.clear();
+  assert(toon_to_json("", back, err) && back == "null");
+
+  cout << "JSON tests passed!" << endl;
+}
+
+void test_bind() {
+  vector<Record> rows(3);
+  rows[0].id = -7;
+  rows[0].name = "Alice, B";
+  rows[0].score = 1.5;
+  rows[0].active = true;
+  rows[0].level = 200;
+  rows[0].tags = Toon::array{"x", 2};
+  rows[1].id = 8;
+  rows[1].name = "";
+  rows[2].id = INT64_MAX;
+  rows[2].name = "a\nb";
+
+  // Columns follow the declaration order.
+  string out;
+  dump_table(rows, out);
+  assert(out.compare(0, 40, "[{id, name, score, active, level, tags}]") == 0);
+  string err;
+  Toon parsed = Toon::parse(out, err);
+  assert(err.empty() && parsed.is_table() && parsed.array_items().size() == 3);
+  assert(parsed[0]["name"] == "Alice, B");
+  assert(parsed[0]["tags"] == (Toon::array{"x", 2}));
+  assert(parsed[2]["id"] == Toon(INT64_MAX));
+
+  vector<Record> back;
+  assert(parse_table(out, back, err));
+  assert(back.size() == 3);
+  assert(back[0].id == -7 && back[0].name == "Alice, B" &&
+         back[0].score == 1.5 && back[0].active && back[0].level == 200 &&
+         back[0].tags == (Toon::array{"x", 2}));
+  assert(back[1].id == 8 && back[1].name.empty() && !back[1].active &&
+         back[1].tags.is_null());
+  assert(back[2].id == INT64_MAX && back[2].name == "a\nb");
+
+  // Columns are matched by name; unknown ones are skipped and missing ones
+  // keep the default value. The table does not have to be the root.
+  back.clear();
+  assert(parse_table("meta: 1\nusers:\n  [{extra, name, id}]:\n    x, Bob, 1\n"
+                     "    y, null, 2\n",
+                     back, err));
+  assert(back.size() == 2 && back[0].name == "Bob" && back[0].id == 1 &&
+         back[0].score == 0 && back[1].name.empty() && back[1].id == 2);
+
+  // Type and range errors name the row and column.
+  back.clear();
+  assert(!parse_table("[{id, level}]:\n  1, 2\n  2, 300\n", back, err));
+  assert(err == "row 2: cannot read column level");
+  assert(!parse_table("[{id}]:\n  1.5\n", back, err));
+  assert(!parse_table("[{id}]:\n  18446744073709551615\n", back, err));
+  assert(!parse_table("[{id}]:\n  abc\n", back, err));
+  assert(!parse_table("name: x\n", back, err));
+  assert(err == "no table found");
+
+  // An empty vector is an empty array, and write_table nests in a Writer.
+  out.clear();
+  dump_table(vector<Record>(), out);
+  assert(out == Toon(Toon::array{}).dump());
+  out.clear();
+  {
+    Writer w(out);
+    w.begin_object();
+    w.key("records");
+    write_table(w, rows);
+    w.end_object();
+  }
+  err.clear();
+  parsed = Toon::parse(out, err);
+  assert(err.empty() && parsed["records"][1]["id"] == 8);
+
+  cout << "Bind tests passed!" << endl;
+}
+
+struct CountingHook : StatsHook {
+  size_t parses = 0, dumps = 0, parse_bytes = 0, dump_bytes = 0;
+  void on_parse(const ParseStats &stats) override {
+    parses++;
+    parse_bytes += stats.bytes;
+  }
+  void on_dump(const DumpStats &stats) override {
+    dumps++;
+    dump_bytes += stats.bytes;
+  }
+};
+
+void test_stats() {
+  const string in = "meta:\n  name: \"a,\\tb\"\n  tags: [2]: x, y\n"
+                    "rows:\n  [{id, v}]:\n    1, p\n    2, q\n";
+  string err;
+  ParseStats ps;
+  Toon t = Toon::parse(in, err, ps);
+  assert(err.empty() && t["rows"][1]["v"] == "q");
+  string out;
+  DumpStats ds;
+  t.dump(out, ds);
+  assert(out == t.dump());
+
+  if (!stats_enabled()) {
+    assert(ps.bytes == 0 && ps.nodes == 0 && ds.bytes == 0);
+    cout << "Stats tests skipped (built without TOON_STATS)" << endl;
+    return;
+  }
+  assert(ps.bytes == in.size());
+  // root, meta, name, tags, x, y, rows table, four cells
+  assert(ps.nodes == 11);
+  assert(ps.strings == 5 && ps.unescaped == 1);
+  assert(ps.string_bytes == 4 + 1 + 1 + 1 + 1);
+  assert(ps.table_rows == 2 && ps.max_depth == 3);
+  assert(ps.total_ms >= ps.table_ms && ps.table_ms >= 0);
+
+  assert(ds.bytes == out.size() && ds.nodes == ps.nodes);
+  assert(ds.strings == 5 && ds.quoted == 1 && ds.table_rows == 2);
+
+  // The hook sees top-level parses and dumps only, not nested values.
+  CountingHook hook;
+  set_stats_hook(&hook);
+  Toon again = Toon::parse(in, err);
+  string text = again.dump();
+  set_stats_hook(nullptr);
+  Toon::parse(in, err).dump();
+  assert(hook.parses == 1 && hook.parse_bytes == in.size());
+  assert(hook.dumps == 1 && hook.dump_bytes == text.size());
+
+  cout << "Stats tests passed!" << endl;
+}
+
+void test_table() {
+  const string in = "[{y, x}]:\n  1, a\n  2, \"b, c\"\n  3, [2]: 4, 5";
+  string err;
+  Toon t = Toon::parse(in, err);
+  assert(err.empty());
+  assert(t.is_array() && t.is_table());
+  assert(t.table_keys() == (vector<string>{"y", "x"}));
+  assert(t.table_rows() == 3);
+  assert(t.table_cell(1, 1).string_value() == "b, c");
+  assert(t.table_cell(3, 0).is_null());
+  assert(t.dump() == in); // header order is kept
+
+  // Row objects are only built on demand.
+  assert(t[2]["x"][1].int_value() == 5);
+  assert(t.array_items().size() == 3);
+  assert(t[0]["y"].int_value() == 1);
+
+  Toon plain = Toon::array{Toon::object{{"x", "a"}, {"y", 1}},
+                           Toon::object{{"x", "b, c"}, {"y", 2}},
+                           Toon::object{{"x", Toon::array{4, 5}}, {"y", 3}}};
+  assert(!plain.is_table());
+  assert(t == plain && plain == t);
+  assert(Toon::parse(plain.dump(), err) == t);
+
+  Toon made = Toon::table({"k", "v"}, Toon::array{1, "one", 2});
+  assert(made.table_rows() == 2 && made.table_cell(1, 1).is_null());
+  assert(made.dump() == "[{k, v}]:\n  1, one\n  2, null");
+
+  cout << "Table tests passed!" << endl;
+}
+
+void test_keys() {
+  // Keys repeated across a document's objects share one interned copy.
+  string err;
+  Toon doc = Toon::parse("a:\n  name: x\n  id: 1\nb:\n  name: y\n  id: 2", err);
+  assert(err.empty());
+  const Key &ka = doc["a"].object_members()[1].first;
+  const Key &kb = doc["b"].object_members()[1].first;
+  assert(ka == "name" && &ka.str() == &kb.str());
+
+  // A shared table interns across documents, and lookups with its keys
+  // match by pointer; other keys fall back to comparing the text.
+  KeyTable table;
+  Toon d1 = Toon::parse("user:\n  email: a@x", err, table);
+  Toon d2 = Toon::parse("email: b@x", err, table);
+  assert(table.size() == 2);
+  const Key email = table.intern("email");
+  assert(&email.str() == &d2.object_members()[0].first.str());
+  assert(d1["user"][email].string_value() == "a@x");
+  assert(d2[Key("email")].string_value() == "b@x");
+  assert(d2[Key("mail")].is_null());
+  Toon::object fields;
+  for (int k = 0; k < 40; ++k)
+    fields["k" + to_string(k)] = k;
+  Toon wide = Toon::parse(Toon(fields).dump(), err, table);
+  for (int k = 0; k < 40; ++k)
+    assert(wide[table.intern("k" + to_string(k))].int_value() == k);
+
+  // Keys outlive the table that interned them.
+  Toon kept;
+  {
+    KeyTable scoped;
+    kept = Toon::parse("long_field_name_beyond_sso: 1", err, scoped);
+  }
+  assert(kept["long_field_name_beyond_sso"].int_value() == 1);
+  assert(kept == Toon::parse(kept.dump(), err));
+
+  // The global table can be used from several threads at once.
+  vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([] {
+      string e;
+      for (int k = 0; k < 200; ++k)
+        Toon::parse("test_keys_" + to_string(k % 50) + ": 1", e,
+                    KeyTable::global());
+    });
+  for (auto &t : threads)
+    t.join();
+  assert(KeyTable::global().intern("test_keys_7") ==
+         KeyTable::global().intern("test_keys_7"));
+
+  cout << "Key tests passed!" << endl;
+}
+
+void test_numbers() {
+  // Shortest representation that round-trips.
+  assert(Toon(0.1).dump() == "0.1");
+  assert(Toon(0.3).dump() == "0.3");
+  assert(Toon(-2.5).dump() == "-2.5");
+  assert(Toon(0.05).dump() == "0.05");
+  assert(Toon(100.0).dump() == "100");
+  assert(Toon(0.0).dump() == "0");
+  assert(Toon(1e20).dump() == "1e+20");
+  assert(Toon(1.0 / 3).dump() == "0.3333333333333333");
+  assert(Toon(-2147483647 - 1).dump() == "-2147483648");
+  // Plain notation from 1e-4 to 1e16, and while no zero has to be padded
+  // in; %g's e-notation, with at least two exponent digits, otherwise.
+  assert(Toon(-0.0).dump() == "-0");
+  assert(Toon(1e-4).dump() == "0.0001");
+  assert(Toon(2.5e-5).dump() == "2.5e-05");
+  assert(Toon(1e15).dump() == "1000000000000000");
+  assert(Toon(1e16).dump() == "1e+16");
+  assert(Toon(12345678901234568.0).dump() == "12345678901234568");
+  assert(Toon(5e-324).dump() == "5e-324");
+  assert(Toon(2.2250738585072014e-308).dump() == "2.2250738585072014e-308");
+  assert(Toon(std::numeric_limits<double>::max()).dump() ==
+         "1.7976931348623157e+308");
+  assert(Toon(1e23).dump() == "1e+23");
+  assert(Toon(123456.789).dump() == "123456.789");
+  // Doubles of all magnitudes, normal and subnormal, read back exactly.
+  string err;
+  uint64_t state = 88172645463325252ull;
+  for (int k = 0; k < 100000; ++k) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    double v;
+    memcpy(&v, &state, sizeof v);
+    if (!std::isfinite(v))
+      continue;
+    const string text = Toon(v).dump();
+    assert(Toon(v).dump_size() == text.size());
+    assert(Toon::parse(text, err).number_value() == v && err.empty());
+  }
+
+  const double values[] = {0.1,     1.0 / 3, 123456.789, -1e-7, 1e300,
+                           5e-324,  2.5e-5,  9007199254740993.0, -0.0};
+  for (double v : values) {
+    Toon back = Toon::parse(Toon(v).dump(), err);
+    assert(err.empty());
+    assert(back.number_value() == v);
+  }
+  assert(Toon::parse("1.5e3", err).number_value() == 1500);
+  assert(Toon::parse("-.25", err).number_value() == -0.25);
+  assert(Toon::parse("12345678901234567890123", err).number_value() ==
+         12345678901234567890123.0);
+
+  // Integers are kept exactly, beyond the 2^53 limit of doubles.
+  Toon ids = Toon::parse("big: 9007199254740993\nneg: -9223372036854775808\n"
+                         "max: 18446744073709551615\nf: 2.0\nhuge: "
+                         "18446744073709551616",
+                         err);
+  assert(err.empty());
+  assert(ids["big"].is_integer());
+  assert(ids["big"].int64_value() == 9007199254740993LL);
+  assert(ids["neg"].int64_value() == INT64_MIN);
+  assert(ids["max"].uint64_value() == UINT64_MAX);
+  assert(!ids["f"].is_integer() && ids["f"].int_value() == 2);
+  assert(!ids["huge"].is_integer());
+  assert(ids["max"].dump() == "18446744073709551615");
+  assert(Toon::parse(ids.dump(), err) == ids);
+  assert(Toon(9007199254740993LL) != Toon(9007199254740992LL));
+  assert(Toon(3) == Toon(3.0) && Toon(2) < Toon(2.5));
+  assert(Toon(-1) < Toon(UINT64_MAX));
+  Document doc = Document::parse("id: 9007199254740993", err);
+  assert(doc["id"].is_integer());
+  assert(doc["id"].int64_value() == 9007199254740993LL);
+  assert(doc.root().to_toon()["id"] == ids["big"]);
+
+  // Strings that would read back as numbers are quoted.
+  assert(Toon("2025-01-01").dump() == "\"2025-01-01\"");
+  assert(Toon("-5").dump() == "\"-5\"");
+
+  // The decimal separator does not follow the C locale.
+  if (setlocale(LC_NUMERIC, "de_DE.UTF-8") ||
+      setlocale(LC_NUMERIC, "it_IT.UTF-8")) {
+    assert(Toon(2.5).dump() == "2.5");
+    assert(Toon(1e300).dump() == "1e+300");
+    assert(Toon::parse("x: 0.1000000000000000055511151231257827", err)["x"]
+               .number_value() == 0.1);
+    setlocale(LC_NUMERIC, "C");
+  }
+
+  cout << "Number tests passed!" << endl;
+}
+
+void test_parallel() {
+  // Over 1 MiB so the rows really are split; every 97th row has a quoted
+  // cell with a raw newline, which cuts can land inside.
+  string in = "[{id, name, score}]:\n";
+  for (int r = 0; r < 60000; ++r) {
+    in += "  " + to_string(r) + ", ";
+    in += r % 97 ? "user " + to_string(r) : "\"two\nlines\"";
+    in += ", " + to_string(r % 1000) + ".5\n";
+  }
+  string err, perr;
+  Toon seq = Toon::parse(in, err);
+  assert(err.empty() && seq.table_rows() == 60000);
+  for (unsigned threads : {2u, 3u, 8u}) {
+    Toon par = Toon::parse_parallel(in, perr, threads);
+    assert(perr.empty() && par.is_table() && par == seq);
+    assert(par.dump() == seq.dump());
+  }
+
+  // Errors and early ends are those of the sequential parse.
+  string bad = in;
+  bad.replace(bad.find("user 59998"), 10, "\"\\q\"");
+  Toon::parse(bad, err);
+  Toon failed = Toon::parse_parallel(bad, perr, 4);
+  assert(!err.empty() && perr == err && failed.is_null());
+  string cut = in;
+  cut.insert(cut.size() / 2, "\n  7\n");
+  Toon short_seq = Toon::parse(cut, err);
+  Toon short_par = Toon::parse_parallel(cut, perr, 4);
+  assert(short_seq.table_rows() < 60000 && short_par == short_seq);
+
+  // User-supplied executor.
+  perr.clear();
+  vector<std::thread> pool;
+  Toon via = Toon::parse_parallel(
+      in, perr,
+      [&pool](std::function<void()> task) { pool.emplace_back(task); }, 5);
+  for (auto &t : pool)
+    t.join();
+  assert(perr.empty() && via == seq);
+
+  // Anything but a top-level table is parsed as by parse().
+  Toon obj = Toon::parse_parallel("a: 1\nb: [2]: 3, 4", perr, 4);
+  assert(perr.empty() && obj["b"][1].int_value() == 4);
+
+  // dump_parallel() writes exactly what dump() does, whether the large
+  // containers are at the top or nested under small ones.
+  Toon::array rows, mixed;
+  Toon::object wide;
+  for (int r = 0; r < 5000; ++r) {
+    rows.push_back(Toon::object{{"id", r}, {"tags", Toon::array{r, "x"}}});
+    mixed.push_back(r % 3 ? Toon(r * 0.5) : Toon(Toon::object{{"k", r}}));
+    wide["key" + to_string(r)] = r % 2 ? Toon("a b") : Toon(Toon::array{r});
+  }
+  Toon nested(Toon::object{{"data", Toon::object{{"rows", rows},
+                                                 {"table", seq}}},
+                           {"mixed", mixed},
+                           {"wide", wide},
+                           {"small", Toon::array{1, 2}}});
+  for (const Toon &t : {seq, Toon(rows), Toon(mixed), Toon(wide), nested}) {
+    const string expected = t.dump();
+    for (unsigned threads : {1u, 2u, 3u, 8u})
+      assert(t.dump_parallel(threads) == expected);
+    string out = "prefix ";
+    pool.clear();
+    t.dump_parallel(
+        out, [&pool](std::function<void()> task) { pool.emplace_back(task); },
+        4);
+    for (auto &th : pool)
+      th.join();
+    assert(out == "prefix " + expected);
+  }
+  assert(Toon(Toon::array{}).dump_parallel(4) == "[0]:");
+
+  cout << "Parallel tests passed!" << endl;
+}
+
 int main() {
   test_basic();
+  test_numbers();
+  test_keys();
   test_object();
   test_array();
   test_tabular();
+  test_table();
+  test_escapes();
+  test_dump_size();
+  test_dump_truncated();
+  test_hash();
+  test_long_strings();
+  test_document();
+  test_document_view();
+  test_parser();
+  test_file();
+  test_binary();
+  test_depth();
+  test_stream();
+  test_edit();
+  test_ref();
+  test_lazy();
+  test_path();
+  test_writer();
+  test_json();
+  test_bind();
+  test_stats();
+  test_parallel();
   cout << "All tests passed!" << endl;
   return 0;
 }